@@ -1,25 +1,42 @@
 #include "BMA400.h"
 
+#define CREATE_TRACE_POINTS
+#include "BMA400_trace.h"
+
+// called by i2c_xfer.h for every transaction, the hub is NULL until probe gets it
+struct sensor_hub *BMA400_hub(struct i2c_client *client) {
+	struct BMA400_data *BMA400_data = i2c_get_clientdata(client);
+	
+	return BMA400_data ? BMA400_data->hub : NULL;
+}
+
+// called by i2c_xfer.h after every transaction
+void BMA400_xfer_done(struct i2c_client *client, struct i2c_xfer_stats *stats, int msgs, u64 ns, int result) {
+	struct BMA400_data *BMA400_data = i2c_get_clientdata(client);
+	
+	if(BMA400_data)
+		sensor_stats_xfer(&(BMA400_data->stats), ns, result);
+	
+	trace_bma400_xfer(client->adapter->nr, client->addr, stats ? stats->name : "", msgs, ns, result);
+}
+
 int config_register(struct i2c_client *i2c_client, u8 reg_addr, u8 config) {
 	int res;
-	s32 data;
+	struct BMA400_data *BMA400_data = i2c_get_clientdata(i2c_client);
 	
-	res = i2c_smbus_write_byte_data(i2c_client, reg_addr, config);
-	if(res) {
-		PDEBUG("Failed when sending command to register: %02X. \n", reg_addr);
-		return res;
-	}
+	// write and read-back in one transaction
+	i2c_xfer_begin(&BMA400_xfer[XFER_CONFIG]);
 	
-	// return value of i2c_smbus_read_byte_data is s32 type
-	data = i2c_smbus_read_byte_data(i2c_client, reg_addr);
-	if(data < 0) {
-		PDEBUG("Failed when reading the value of register: %02X. \n", reg_addr);
-		return data;
+	res = i2c_xfer_write_verify(i2c_client, reg_addr, &config, 1, &BMA400_xfer[XFER_CONFIG]);
+	if(res == -EAGAIN) {
+		sensor_stats_inc(&(BMA400_data->stats), SENSOR_VERIFY_FAILS);
+		PDEBUG("Failed when initializing register: %02X, config: %02X. \n", reg_addr, config);
+		return res;
 	}
 	
-	if((u8)data != config) {
-		PDEBUG("Failed when initializing register: %02X, config: %02X, value: %02X. \n", reg_addr, config, (u8)data);
-		return -EAGAIN;
+	if(res) {
+		PDEBUG("Failed when sending command to register: %02X. \n", reg_addr);
+		return res;
 	}
 	
 	return 0;
@@ -40,17 +57,25 @@ void print_data(u8 *values) {
 	if(acc_z > 2047)
 		acc_z -= 4096;
 		
-	PDEBUG("Acceleration data x-axis: %d, y-axis: %d, z-axis: %d. \n", acc_x, acc_y, acc_z);
+	trace_bma400_sample(acc_x, acc_y, acc_z);
 	
 	return;
 }
 
-void BMA400_dr_work_handler(struct work_struct *work) {
-	u8 *values;
-	s32 result;
-	struct BMA400_data *BMA400_data;
+// account a delivered sample, latency counts from the oldest interrupt it served
+void BMA400_delivered(struct BMA400_data *BMA400_data, u64 irq_time) {
+	sensor_stats_inc(&(BMA400_data->stats), SENSOR_SAMPLES);
 	
-	PDEBUG("Data ready interrupt handler bottom half invoked. \n");
+	if(irq_time)
+		sensor_stats_hist(&(BMA400_data->stats), SENSOR_LATENCY_NS, ktime_get_ns() - irq_time);
+}
+
+void BMA400_dr_work_handler(struct sensor_hub_work *work) {
+	u8 values[READ_LEN], int_stat;
+	int result;
+	u64 irq_time;
+	struct i2c_xfer_seg segs[2];
+	struct BMA400_data *BMA400_data;
 	
 	BMA400_data = container_of(work, struct BMA400_data, w);
 	if(!BMA400_data) {
@@ -58,76 +83,107 @@ void BMA400_dr_work_handler(struct work_struct *work) {
 		return;
 	}
 	
-	values = kzalloc(sizeof(u8) * READ_LEN, GFP_KERNEL);
-	if(!values) {
-		PDEBUG("Failed when allocating buffer. \n");
-		return;
-	}
-
-	// getting acceleration data with burst read
-	result = i2c_smbus_read_i2c_block_data(BMA400_data->client, ACC_X_LSB_REG, READ_LEN, values);
+	trace_bma400_work(BMA400_data->irq_nr, "data_ready");
+	
+	irq_time = atomic64_xchg(&(BMA400_data->irq_time), 0);
+	
+	// acceleration data burst and interrupt state clearing share one transaction
+	segs[0].reg = ACC_X_LSB_REG;
+	segs[0].len = READ_LEN;
+	segs[0].buf = values;
+	segs[1].reg = INT_STAT0_REG;
+	segs[1].len = 1;
+	segs[1].buf = &int_stat;
+	
+	i2c_xfer_begin(&BMA400_xfer[XFER_DATA_READY]);
+	
+	result = i2c_xfer_read_multi(BMA400_data->client, segs, 2, &BMA400_xfer[XFER_DATA_READY]);
 	if(result < 0) {
+		sensor_stats_inc(&(BMA400_data->stats), SENSOR_DROPPED);
 		PDEBUG("Failed when reading the acceleration data. \n");
 		return;
 	}
 	
 	print_data(values);
 	
-	kfree(values);
-	
-	result = i2c_smbus_read_byte_data(BMA400_data->client, INT_STAT0_REG);
-	if(result < 0) {
-		PDEBUG("Failed when clearing interrupt state. \n");
-		return;
-	}
+	BMA400_delivered(BMA400_data, irq_time);
 	
 	return;
 }
 
-void BMA400_wu_work_handler(struct work_struct *work) {
-	u8 *values;
-	s32 result;
+void BMA400_wu_work_handler(struct sensor_hub_work *work) {
+	u8 values[READ_LEN], config;
+	int result;
+	u64 irq_time;
 	struct BMA400_data *BMA400_data;
 	
-	PDEBUG("Wake-up interrupt handler bottom half invoked. \n");
-	
 	BMA400_data = container_of(work, struct BMA400_data, w);
 	if(!BMA400_data) {
 		PDEBUG("Failed when retrieving data. \n");
 		return;
 	}
 	
-	values = kzalloc(sizeof(u8) * READ_LEN, GFP_KERNEL);
-	if(!values) {
-		PDEBUG("Failed when allocating buffer. \n");
-		return;
-	}
+	trace_bma400_work(BMA400_data->irq_nr, "wake_up");
+	
+	irq_time = atomic64_xchg(&(BMA400_data->irq_time), 0);
 
 	// getting acceleration data with burst read
-	result = i2c_smbus_read_i2c_block_data(BMA400_data->client, ACC_X_LSB_REG, READ_LEN, values);
+	i2c_xfer_begin(&BMA400_xfer[XFER_WAKE_UP]);
+	
+	result = i2c_xfer_read(BMA400_data->client, ACC_X_LSB_REG, values, READ_LEN, &BMA400_xfer[XFER_WAKE_UP]);
 	if(result < 0) {
+		sensor_stats_inc(&(BMA400_data->stats), SENSOR_DROPPED);
 		PDEBUG("Failed when reading the acceleration data. \n");
 		return;
 	}
 	
 	print_data(values);
 	
-	kfree(values);
+	BMA400_delivered(BMA400_data, irq_time);
 	
-	if(config_register(BMA400_data->client, ACC_CONFIG0_REG, LOW_POWER_MODE) < 0) {
+	// return to low-power mode, written and verified in the same transaction
+	config = LOW_POWER_MODE;
+	
+	result = i2c_xfer_write_verify(BMA400_data->client, ACC_CONFIG0_REG, &config, 1, &BMA400_xfer[XFER_WAKE_UP]);
+	if(result == -EAGAIN)
+		sensor_stats_inc(&(BMA400_data->stats), SENSOR_VERIFY_FAILS);
+	
+	if(result < 0) {
 		PDEBUG("Failed when returning to low-power mode. \n");
 		return;
 	}
 	
-	mdelay(2);
+	// the mode change takes 2 ms, delay the next run instead of stalling the bus worker
+	WRITE_ONCE(BMA400_data->settle, jiffies + msecs_to_jiffies(2) + 1);
 	
 	return;
 }
 
+static void BMA400_hub_put(void *hub) {
+	sensor_hub_put(hub);
+}
+
+// queue the bottom half, an interrupt arriving while it is pending is merged into it
+void BMA400_queue(struct BMA400_data *BMA400_data) {
+	unsigned long settle, delay = 0;
+	
+	sensor_stats_inc(&(BMA400_data->stats), SENSOR_IRQS);
+	
+	atomic64_cmpxchg(&(BMA400_data->irq_time), 0, ktime_get_ns());
+	
+	// not before the last mode change has completed
+	settle = READ_ONCE(BMA400_data->settle);
+	if(time_before(jiffies, settle))
+		delay = settle - jiffies;
+	
+	if(!sensor_hub_queue(BMA400_data->hub, &(BMA400_data->w), delay))
+		sensor_stats_inc(&(BMA400_data->stats), SENSOR_COALESCED);
+}
+
 irqreturn_t BMA400_dr_int_handler(int irq, void *dev_id) {
 	struct BMA400_data *BMA400_data;
 	
-	PDEBUG("Data ready interrupt detected. \n");
+	trace_bma400_irq(irq, "data_ready");
 	
 	BMA400_data = dev_id;
 	if(!BMA400_data) {
@@ -135,7 +191,7 @@ irqreturn_t BMA400_dr_int_handler(int irq, void *dev_id) {
 		return IRQ_NONE;
 	}
 	
-	queue_work(BMA400_data->wq, &(BMA400_data->w));
+	BMA400_queue(BMA400_data);
 	
 	return IRQ_HANDLED;
 }
@@ -143,7 +199,7 @@ irqreturn_t BMA400_dr_int_handler(int irq, void *dev_id) {
 irqreturn_t BMA400_wu_int_handler(int irq, void *dev_id) {
 	struct BMA400_data *BMA400_data;
 	
-	PDEBUG("Wake-up interrupt detected. \n");
+	trace_bma400_irq(irq, "wake_up");
 	
 	BMA400_data = dev_id;
 	if(!BMA400_data) {
@@ -151,41 +207,76 @@ irqreturn_t BMA400_wu_int_handler(int irq, void *dev_id) {
 		return IRQ_NONE;
 	}
 	
-	queue_work(BMA400_data->wq, &(BMA400_data->w));
+	BMA400_queue(BMA400_data);
 	
 	return IRQ_HANDLED;
 }
 
 irqreturn_t BMA400_tap_int_handler(int irq, void *dev_id) {
-	ktime_t cur;
-	cur = ktime_get(); 
-
-	PDEBUG("System time: %lld, tap interrupt detected. \n", cur);
+	struct BMA400_data *BMA400_data = dev_id;
+	
+	// the event carries the time the tap was detected
+	trace_bma400_irq(irq, "tap");
+	
+	sensor_stats_inc(&(BMA400_data->stats), SENSOR_IRQS);
 	
 	return IRQ_HANDLED;
 }
 
 int BMA400_probe(struct i2c_client *i2c_client, const struct i2c_device_id *id) {
-	u8 config, values[NUM_INT_REG];
-	s32 chip_id;
+	u8 config, chip_id, values[NUM_INT_REG];
 	int result;
 	struct BMA400_data *BMA400_data;
 	struct device *dev;
 	irqreturn_t (*mode_irq_handler)(int, void *);
-	void (*mode_work_handler)(struct work_struct *);
+	void (*mode_work_handler)(struct sensor_hub_work *);
 	
 	PDEBUG("I2C_client addr: %p. \n", i2c_client);
 	
-	PDEBUG("BMA400 probed on adapter: %d. \n", ADPT_NUM);
+	PDEBUG("BMA400 probed on adapter: %d. \n", adapter);
+	
+	// initialize device data first so the configuration is accounted as well
+	dev = &(i2c_client->dev);
+	
+	BMA400_data = devm_kzalloc(dev, sizeof(struct BMA400_data), GFP_KERNEL);
+	if(!BMA400_data) {
+		PDEBUG("Failed when allocating BMA400 data. \n");
+		return -ENOMEM;
+	}
+	
+	BMA400_data->client = i2c_client;
+	
+	result = devm_sensor_stats_init(dev, &(BMA400_data->stats), BMA400_debugfs);
+	if(result) {
+		PDEBUG("Failed when allocating statistics. \n");
+		return result;
+	}
+	
+	i2c_set_clientdata(i2c_client, BMA400_data);
+	
+	BMA400_data->settle = jiffies;
+	
+	// the bottom half and the configuration below run on the acquisition worker of the adapter
+	BMA400_data->hub = sensor_hub_get(i2c_client->adapter);
+	if(IS_ERR(BMA400_data->hub)) {
+		PDEBUG("Failed when getting sensor hub. \n");
+		return PTR_ERR(BMA400_data->hub);
+	}
+	
+	result = devm_add_action_or_reset(dev, BMA400_hub_put, BMA400_data->hub);
+	if(result)
+		return result;
 	
 	// confirm chip id
-	chip_id = i2c_smbus_read_byte_data(i2c_client, CHIPID_REG);
-	if(chip_id < 0) {
+	i2c_xfer_begin(&BMA400_xfer[XFER_PROBE]);
+	
+	result = i2c_xfer_read(i2c_client, CHIPID_REG, &chip_id, 1, &BMA400_xfer[XFER_PROBE]);
+	if(result < 0) {
 		PDEBUG("Failed when reading the chip id at: %02X. \n", CHIPID_REG);
-		return (int)chip_id;
+		return result;
 	}
 	
-	if((u8)chip_id != CHIPID_VAL) {
+	if(chip_id != CHIPID_VAL) {
 		PDEBUG("Failed when trying to establish communication. \n");
 		return -EAGAIN;
 	}
@@ -359,56 +450,38 @@ int BMA400_probe(struct i2c_client *i2c_client, const struct i2c_device_id *id)
 	
 	}
 	
-	// initialize device data	
-	dev = &(i2c_client->dev);
-	
-	BMA400_data = devm_kzalloc(dev, sizeof(struct BMA400_data), GFP_KERNEL);
-	if(!BMA400_data) {
-		PDEBUG("Failed when allocating BMA400 data. \n");
-		return -ENOMEM;
-	}
-	
-	BMA400_data->client = i2c_client;
-	
-	if(mode_work_handler) {
-		BMA400_data->wq = create_workqueue("BMA400_queue");
-		if(!BMA400_data->wq) {
-			PDEBUG("Failed when creating workqueue. \n");
-			return -ENOMEM;
-		}
-		
-		INIT_WORK(&(BMA400_data->w), mode_work_handler);
-	}	
+	// tap mode has no bottom half, the work is never queued
+	sensor_hub_init_work(&(BMA400_data->w), mode_work_handler);
 
 	// requesting irq number
-	if(!gpio_is_valid(INT_GPIO_NR)) {
-		PDEBUG("Invalid GPIO number %d. \n", INT_GPIO_NR);
+	if(!gpio_is_valid(irq_gpio)) {
+		PDEBUG("Invalid GPIO number %d. \n", irq_gpio);
 		return -ENOTTY;
 	}
 	
-	result = gpio_request(INT_GPIO_NR, INT_GPIO_LABEL);
+	result = gpio_request(irq_gpio, INT_GPIO_LABEL);
 	if(result < 0) {
 		PDEBUG("Failed when requesting %s. \n", INT_GPIO_LABEL);
 		return result;
 	}
 	
-	result = gpio_direction_input(INT_GPIO_NR);
+	result = gpio_direction_input(irq_gpio);
 	if(result < 0) {
 		PDEBUG("Failed when setting port diection. \n");
 		goto irq_fail;
 	}
 	
-	BMA400_data->irq_nr = gpio_to_irq(INT_GPIO_NR);
+	BMA400_data->irq_nr = gpio_to_irq(irq_gpio);
 	if(BMA400_data->irq_nr < 0) {
-		PDEBUG("Could not get irq number of %d. \n", INT_GPIO_NR);
+		PDEBUG("Could not get irq number of %d. \n", irq_gpio);
 		result = BMA400_data->irq_nr;
 		goto irq_fail;
 	}
 	
-	i2c_set_clientdata(i2c_client, BMA400_data);
-	
 	// initializing interrupt state 
-	result = i2c_smbus_read_i2c_block_data(i2c_client, INT_STAT0_REG, NUM_INT_REG, values);
+	i2c_xfer_begin(&BMA400_xfer[XFER_PROBE]);
+	
+	result = i2c_xfer_read(i2c_client, INT_STAT0_REG, values, NUM_INT_REG, &BMA400_xfer[XFER_PROBE]);
 	if(result < 0) {
 		PDEBUG("Failed when initializing interrupt state. \n");
 		goto irq_fail;
@@ -425,7 +498,7 @@ int BMA400_probe(struct i2c_client *i2c_client, const struct i2c_device_id *id)
 	return 0;
 	
 irq_fail:
-	gpio_free(INT_GPIO_NR);
+	gpio_free(irq_gpio);
 	
 	return result;
 }
@@ -440,16 +513,12 @@ int BMA400_remove(struct i2c_client *i2c_client) {
 		return -ENOTTY;
 	}
 	
-	if(BMA400_data->wq) {
-		cancel_work_sync(&(BMA400_data->w));
-		flush_workqueue(BMA400_data->wq);
-		mdelay(200);
-		destroy_workqueue(BMA400_data->wq);
-	}
-	
+	// no new bottom half can be queued once the interrupt is released
 	free_irq(BMA400_data->irq_nr, BMA400_data);
 	
-	gpio_free(INT_GPIO_NR);
+	sensor_hub_cancel(&(BMA400_data->w));
+	
+	gpio_free(irq_gpio);
 	
 	PDEBUG("BMA400 removed. \n");
 	
@@ -472,12 +541,15 @@ static struct i2c_client *BMA400_client;
 static int __init BMA400_init(void) {	
 	int result;
 	
-	BMA400_adpt = i2c_get_adapter(ADPT_NUM);
+	BMA400_adpt = i2c_get_adapter(adapter);
 	if(!BMA400_adpt) {
-		PDEBUG("I2C adapter number %d does not exist. \n", ADPT_NUM);
+		PDEBUG("I2C adapter number %d does not exist. \n", adapter);
 		return -ENODEV;
 	}
 	
+	// statistics are optional, the driver works without debugfs
+	BMA400_debugfs = debugfs_create_dir("BMA400", NULL);
+	
 	BMA400_client = i2c_new_client_device(BMA400_adpt, &BMA400_info);
 	PDEBUG("BMA400_client addr: %p", BMA400_client);
 	
@@ -499,6 +571,8 @@ driver_fail:
 	i2c_unregister_device(BMA400_client);
 	
 client_fail:
+	debugfs_remove_recursive(BMA400_debugfs);
+	
 	i2c_put_adapter(BMA400_adpt);
 		
 	return result;
@@ -509,6 +583,8 @@ static void __exit BMA400_exit(void) {
 	
 	i2c_unregister_device(BMA400_client);
 	
+	debugfs_remove_recursive(BMA400_debugfs);
+	
 	i2c_put_adapter(BMA400_adpt);
 	
 	PDEBUG("BMA400 I2C driver unloaded. \n");
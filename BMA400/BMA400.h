@@ -15,6 +15,28 @@
 #include <linux/time.h>
 #include <linux/jiffies.h>
 
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+
+#include "BMA400_trace.h"
+
+struct i2c_xfer_stats;
+struct sensor_hub;
+
+void BMA400_xfer_done(struct i2c_client *client, struct i2c_xfer_stats *stats, int msgs, u64 ns, int result);
+struct sensor_hub *BMA400_hub(struct i2c_client *client);
+
+// every bus transaction feeds the device statistics and the bma400_xfer event
+#define I2C_XFER_TRACE(client, stats, msgs, ns, result) BMA400_xfer_done(client, stats, msgs, ns, result)
+#define I2C_XFER_TRACE_ON() true
+
+// and runs on the acquisition worker of the adapter once the hub is known
+#define I2C_XFER_HUB(client) BMA400_hub(client)
+
+#include "i2c_xfer.h"
+#include "sensor_stats.h"
+#include "sensor_hub.h"
+
 #define DEBUG
 #ifdef DEBUG
 #	define PDEBUG(format, args...) printk(KERN_ERR "BMA400: " format, ## args)
@@ -199,6 +221,15 @@ module_param(mode, int, 0644);
 MODULE_PARM_DESC(mode, "Mode of operation");
 
 // used to initialize i2c client
+// defaults match the BeagleBone wiring, i2c_sim reports its own numbers
+static int adapter = ADPT_NUM;
+static int irq_gpio = INT_GPIO_NR;
+
+module_param(adapter, int, 0444);
+MODULE_PARM_DESC(adapter, "Number of the I2C adapter the sensor is attached to");
+module_param(irq_gpio, int, 0444);
+MODULE_PARM_DESC(irq_gpio, "GPIO connected to the interrupt pin");
+
 static struct i2c_board_info BMA400_info = {
 	I2C_BOARD_INFO("BMA400", BMA400_ADDR),
 };
@@ -212,11 +243,34 @@ static struct i2c_device_id BMA400_id_table[] = {
 // used by the kernel to construct a list of ids of supported devices
 MODULE_DEVICE_TABLE(i2c, BMA400_id_table);
 
+// bus transactions per operation, see i2c_xfer.h
+enum BMA400_op {
+	XFER_CONFIG,
+	XFER_PROBE,
+	XFER_DATA_READY,
+	XFER_WAKE_UP,
+};
+
+static struct i2c_xfer_stats BMA400_xfer[] = {
+	[XFER_CONFIG] = I2C_XFER_OP("config"),
+	[XFER_PROBE] = I2C_XFER_OP("probe"),
+	[XFER_DATA_READY] = I2C_XFER_OP("data_ready"),
+	[XFER_WAKE_UP] = I2C_XFER_OP("wake_up"),
+};
+
+I2C_XFER_STATS(BMA400_xfer);
+
+// per-device counters under /sys/kernel/debug/BMA400/<client>/stats
+static struct dentry *BMA400_debugfs;
+
 struct BMA400_data {	//only contain dynamically allocated data
-	struct work_struct w;
-	struct workqueue_struct *wq;
+	struct sensor_hub_work w;
+	struct sensor_hub *hub;
+	unsigned long settle;	// jiffies the last mode change completes at
 	struct i2c_client *client;
 	int irq_nr;
+	struct sensor_stats stats;
+	atomic64_t irq_time;	// oldest interrupt not served yet, 0 if none
 };
 
 #endif
@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* Trace events of the BMA400 driver, enabled through
+   /sys/kernel/tracing/events/bma400/
+
+   Copyright (c) 2024,2024 Zixuan Qiao <zqiao104@uottawa.ca> */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bma400
+
+#if !defined(_BMA400_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BMA400_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// interrupt edge, type is "data_ready", "wake_up" or "tap"
+TRACE_EVENT(bma400_irq,
+	TP_PROTO(int irq, const char *type),
+
+	TP_ARGS(irq, type),
+
+	TP_STRUCT__entry(
+		__field(int, irq)
+		__string(type, type)
+	),
+
+	TP_fast_assign(
+		__entry->irq = irq;
+		__assign_str(type, type);
+	),
+
+	TP_printk("irq=%d type=%s", __entry->irq, __get_str(type))
+);
+
+// start of the bottom half of an interrupt
+TRACE_EVENT(bma400_work,
+	TP_PROTO(int irq, const char *type),
+
+	TP_ARGS(irq, type),
+
+	TP_STRUCT__entry(
+		__field(int, irq)
+		__string(type, type)
+	),
+
+	TP_fast_assign(
+		__entry->irq = irq;
+		__assign_str(type, type);
+	),
+
+	TP_printk("irq=%d type=%s", __entry->irq, __get_str(type))
+);
+
+// one bus transaction, op is the i2c_xfer_stats name
+TRACE_EVENT(bma400_xfer,
+	TP_PROTO(int adpt, u16 addr, const char *op, int msgs, u64 ns, int result),
+
+	TP_ARGS(adpt, addr, op, msgs, ns, result),
+
+	TP_STRUCT__entry(
+		__field(int, adpt)
+		__field(u16, addr)
+		__string(op, op)
+		__field(int, msgs)
+		__field(u64, ns)
+		__field(int, result)
+	),
+
+	TP_fast_assign(
+		__entry->adpt = adpt;
+		__entry->addr = addr;
+		__assign_str(op, op);
+		__entry->msgs = msgs;
+		__entry->ns = ns;
+		__entry->result = result;
+	),
+
+	TP_printk("adapter=%d addr=0x%02x op=%s msgs=%d ns=%llu result=%d",
+		__entry->adpt, __entry->addr, __get_str(op), __entry->msgs,
+		__entry->ns, __entry->result)
+);
+
+// acceleration data fetched by the bottom half, 12-bit signed per axis
+TRACE_EVENT(bma400_sample,
+	TP_PROTO(int x, int y, int z),
+
+	TP_ARGS(x, y, z),
+
+	TP_STRUCT__entry(
+		__field(s16, x)
+		__field(s16, y)
+		__field(s16, z)
+	),
+
+	TP_fast_assign(
+		__entry->x = x;
+		__entry->y = y;
+		__entry->z = z;
+	),
+
+	TP_printk("x=%d y=%d z=%d", __entry->x, __entry->y, __entry->z)
+);
+
+#endif
+
+// the header lives next to the driver, see CFLAGS_BMA400.o
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE BMA400_trace
+#include <trace/define_trace.h>
@@ -1,39 +1,176 @@
 #include "DHT20_char.h"
 
-ssize_t DHT20_read(struct file *filp, char __user *buff, size_t size, loff_t *loff) {
-	int i, result;
-	char cmd_r[CMD_LEN + 1], data[READ_LEN + 2];
-	struct i2c_client *client;
+static dev_t DHT20_id;
+static struct cdev DHT20_cdev;
+static struct class *DHT20_class;
+
+static struct DHT20_dev DHT20_devs[MAX_DEVS];
+static int nr_devs;
+
+static atomic_t nr_active = ATOMIC_INIT(0);
+static int next_slot;
+static struct delayed_work DHT20_sched;
+static struct workqueue_struct *DHT20_wq;
+
+// CRC-8, polynomial 0x31, initial value 0xFF, computed over status and data bytes
+u8 DHT20_crc8(const char *data, int len) {
+	int i, j;
+	u8 crc = CRC_INIT;
 	
-	if(size < sizeof(char) * READ_LEN) {
-		PDEBUG("Insufficient buffer size, %d required. \n", READ_LEN);
-		return 0;
+	for(i = 0; i < len; i++) {
+		crc ^= (u8)data[i];
+		
+		for(j = 0; j < 8; j++) {
+			if(crc & 0x80)
+				crc = (crc << 1) ^ CRC_POLY;
+			else
+				crc <<= 1;
+		}
 	}
 	
+	return crc;
+}
+
+// trigger one measurement and wait for a frame that passes the CRC check
+int DHT20_measure(struct DHT20_dev *dev, char *data) {
+	int result, polls, attempts;
+	char cmd_r[CMD_LEN + 1];
+	
 	cmd_r[0] = CMD_1;
 	cmd_r[1] = CMD_2;
 	cmd_r[2] = CMD_3;
 	cmd_r[3] = '\0';
 	
-	client = filp->private_data;
+	for(attempts = 0; attempts < MAX_CRC_RETRY; attempts++) {
+		result = i2c_master_send(&dev->client, cmd_r, CMD_LEN);
+		if(result < 0) {
+			PDEBUG("Read command transmission failed. \n");
+			return result;
+		}
+		
+		msleep(CONV_MIN_MS);
+		
+		for(polls = 0; polls < MAX_BUSY_POLL; polls++) {
+			result = i2c_master_recv(&dev->client, data, FRAME_LEN);
+			if(result < 0) {
+				PDEBUG("Return data transmission failed. \n");
+				return result;
+			}
+			
+			if(!(data[0] & STATUS_BUSY))
+				break;
+			
+			atomic_inc(&dev->busy_retries);
+			usleep_range(BUSY_POLL_MS * 1000, BUSY_POLL_MS * 1000 + 500);
+		}
+		
+		if(polls == MAX_BUSY_POLL) {
+			PDEBUG("Conversion timed out. \n");
+			return -ETIMEDOUT;
+		}
+		
+		if(DHT20_crc8(data, FRAME_LEN - 1) == (u8)data[FRAME_LEN - 1])
+			return 0;
+		
+		atomic_inc(&dev->crc_errors);
+		PDEBUG("CRC mismatch, measuring again. \n");
+	}
 	
-	result = i2c_master_send(client, cmd_r, CMD_LEN);
-	if(result < 0) {
-		PDEBUG("Read command transmission failed. \n");
+	return -EIO;
+}
+
+// a fresh sample is one the reader has not seen yet
+bool DHT20_fresh(struct DHT20_file *file) {
+	bool fresh;
+	struct DHT20_dev *dev = file->dev;
+	
+	spin_lock(&dev->sample_lock);
+	fresh = dev->sample.seq && dev->sample.seq != file->last_seq;
+	spin_unlock(&dev->sample_lock);
+	
+	return fresh;
+}
+
+// measures one instance, queued by the scheduler in the instance's slot
+void DHT20_handler(struct work_struct *work) {
+	int result;
+	char data[FRAME_LEN + 1];
+	struct DHT20_dev *dev;
+	
+	dev = container_of(work, struct DHT20_dev, work);
+	
+	data[FRAME_LEN] = '\0';
+	
+	result = DHT20_measure(dev, data);
+	if(result)
+		return;
+	
+	spin_lock(&dev->sample_lock);
+	dev->sample.timestamp = ktime_get_ns();
+	dev->sample.seq++;
+	if(!dev->sample.seq)
+		dev->sample.seq = 1;
+	memcpy(dev->sample.data, data + 1, sizeof(char) * READ_LEN);
+	spin_unlock(&dev->sample_lock);
+	
+	wake_up_interruptible(&dev->waitq);
+}
+
+/*
+ * DHT20_schedule - Shared scheduler, the period is divided into one slot
+ * per instance and each tick triggers the instance owning the slot, 
+ * so every sensor is sampled exactly once per period no matter how many 
+ * readers it has, and conversions of different instances are staggered
+ */
+void DHT20_schedule(struct work_struct *work) {
+	struct DHT20_dev *dev;
+	
+	dev = &DHT20_devs[next_slot];
+	next_slot = (next_slot + 1) % nr_devs;
+	
+	/*
+	 * checked and queued under the instance lock so that release cannot 
+	 * clear ready and cancel in between, an instance being opened or 
+	 * released skips its slot, one still converting keeps its previous request
+	 */
+	if(mutex_trylock(&dev->lock)) {
+		if(dev->ready)
+			queue_work(DHT20_wq, &dev->work);
+		
+		mutex_unlock(&dev->lock);
+	}
+	
+	if(atomic_read(&nr_active))
+		queue_delayed_work(DHT20_wq, &DHT20_sched, msecs_to_jiffies(SAMPLE_PERIOD_MS / nr_devs));
+}
+
+ssize_t DHT20_read(struct file *filp, char __user *buff, size_t size, loff_t *loff) {
+	char data[READ_LEN];
+	struct DHT20_file *file;
+	struct DHT20_dev *dev;
+	
+	if(size < sizeof(char) * READ_LEN) {
+		PDEBUG("Insufficient buffer size, %d required. \n", READ_LEN);
 		return 0;
 	}
 	
-	mdelay(80);
+	file = filp->private_data;
+	dev = file->dev;
 	
-	data[READ_LEN + 1] = '\0';
+	if(!DHT20_fresh(file)) {
+		if(filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		
+		if(wait_event_interruptible(dev->waitq, DHT20_fresh(file)))
+			return -ERESTARTSYS;
+	}
 	
-	result = i2c_master_recv(client, data, READ_LEN + 1);
-	if(result < 0) {
-		PDEBUG("Return data transmission failed. \n");
-		return 0;
-	}	
+	spin_lock(&dev->sample_lock);
+	memcpy(data, dev->sample.data, sizeof(char) * READ_LEN);
+	file->last_seq = dev->sample.seq;
+	spin_unlock(&dev->sample_lock);
 	
-	if(copy_to_user(buff, data + 1, sizeof(char) * READ_LEN)) {
+	if(copy_to_user(buff, data, sizeof(char) * READ_LEN)) {
 		PDEBUG("Copying failed. \n");
 		return 0;
 	}
@@ -41,12 +178,66 @@ ssize_t DHT20_read(struct file *filp, char __user *buff, size_t size, loff_t *lo
 	return sizeof(char) * READ_LEN;
 }
 
-long DHT20_ioctl(struct file *filp, unsigned int command, unsigned long buff) {
-	int result, adpt_nr;
-	struct i2c_adapter *adpt_ptr;
-	struct i2c_client *client;
+__poll_t DHT20_poll(struct file *filp, struct poll_table_struct *wait) {
+	struct DHT20_file *file;
+	
+	file = filp->private_data;
+	
+	poll_wait(filp, &file->dev->waitq, wait);
+	
+	if(DHT20_fresh(file))
+		return EPOLLIN | EPOLLRDNORM;
+	
+	return 0;
+}
+
+// send the initialization byte sequence and check the calibration status
+int DHT20_init_sensor(struct i2c_client *client) {
+	int result;
 	char init_byte[2], status[2];
 	
+	msleep(100);
+	
+	init_byte[0] = INIT_CMD;
+	init_byte[1] = '\0';
+	
+	result = i2c_master_send(client, init_byte, 1);
+	if(result < 0) {
+		PDEBUG("Init command transmission failed. \n");
+		return result;
+	}
+	
+	status[1] = '\0';
+	
+	result = i2c_master_recv(client, status, 1);
+	if(result < 0) {
+		PDEBUG("Status transmission failed. \n");
+		return result;
+	}
+	
+	PDEBUG("Status received: %02X. \n", status[0]);
+	
+	status[0] |= 0x18;
+	if(status[0] != 0x18) {
+		PDEBUG("Error in initialization. \n");
+		return -EFAULT;
+	}
+	
+	msleep(10);
+	
+	return 0;
+}
+
+long DHT20_ioctl(struct file *filp, unsigned int command, unsigned long buff) {
+	int adpt_nr;
+	struct DHT20_file *file;
+	struct DHT20_dev *dev;
+	struct DHT20_stats stats;
+	struct DHT20_sample sample;
+	
+	file = filp->private_data;
+	dev = file->dev;
+	
 	switch(command) {
 		case INIT_SET_ADPT:
 			if(copy_from_user(&adpt_nr, (int *)buff, sizeof(int))) {
@@ -54,46 +245,39 @@ long DHT20_ioctl(struct file *filp, unsigned int command, unsigned long buff) {
 				return -EFAULT;
 			}
 			
-			PDEBUG("Received adapter number: %d. \n", adpt_nr);
-			
-			adpt_ptr = i2c_get_adapter(adpt_nr);
-			if(!adpt_ptr) {
-				PDEBUG("Invaild adapter number. \n");
-				return -ENODEV;
+			// the adapter is fixed by the minor, kept for older applications
+			if(adpt_nr != dev->adpt) {
+				PDEBUG("Sensor is on adapter %d, not %d. \n", dev->adpt, adpt_nr);
+				return -EINVAL;
 			}
 			
-			client = filp->private_data;
-			client->adapter = adpt_ptr;
-			
-			mdelay(100);
+			break;
 			
-			init_byte[0] = INIT_CMD;
-			init_byte[1] = '\0';
+		case GET_STATS:
+			stats.busy_retries = atomic_read(&dev->busy_retries);
+			stats.crc_errors = atomic_read(&dev->crc_errors);
 			
-			result = i2c_master_send(client, init_byte, 1);
-			if(result < 0) {
-				PDEBUG("Init command transmission failed. \n");
-				return result;
+			if(copy_to_user((struct DHT20_stats *)buff, &stats, sizeof(struct DHT20_stats))) {
+				PDEBUG("Copying failed. \n");
+				return -EFAULT;
 			}
 			
-			status[1] = '\0';
+			break;
 			
-			result = i2c_master_recv(client, status, 1);
-			if(result < 0) {
-				PDEBUG("Status transmission failed. \n");
-				return result;
-			}
+		case GET_SAMPLE:
+			spin_lock(&dev->sample_lock);
+			sample = dev->sample;
+			file->last_seq = sample.seq;
+			spin_unlock(&dev->sample_lock);
 			
-			PDEBUG("Status received: %02X. \n", status[0]);
+			if(!sample.seq)
+				return -ENODATA;
 			
-			status[0] |= 0x18;
-			if(status[0] != 0x18) {
-				PDEBUG("Error in initialization. \n");
+			if(copy_to_user((struct DHT20_sample *)buff, &sample, sizeof(struct DHT20_sample))) {
+				PDEBUG("Copying failed. \n");
 				return -EFAULT;
 			}
 			
-			mdelay(10);
-			
 			break;
 			
 		default:
@@ -106,25 +290,73 @@ long DHT20_ioctl(struct file *filp, unsigned int command, unsigned long buff) {
 }
 
 int DHT20_open(struct inode *inode, struct file *filp) {
-	struct i2c_client *new_client;
+	int result;
+	struct DHT20_file *file;
+	struct DHT20_dev *dev;
 	
 	PDEBUG("Device file opened. \n");
 	
-	new_client = (struct i2c_client *)kzalloc(sizeof(struct i2c_client), GFP_KERNEL);
-	if(!new_client) {
+	dev = &DHT20_devs[iminor(inode) - MINOR(DHT20_id)];
+	
+	file = (struct DHT20_file *)kzalloc(sizeof(struct DHT20_file), GFP_KERNEL);
+	if(!file) {
 		return -ENOMEM;
 	}
 	
-	new_client->addr = DHT20_ADDR;
+	file->dev = dev;
+	
+	if(mutex_lock_interruptible(&dev->lock)) {
+		kfree(file);
+		return -ERESTARTSYS;
+	}
+	
+	// the first user initializes the sensor and hands it to the scheduler
+	if(!dev->users) {
+		result = DHT20_init_sensor(&dev->client);
+		if(result) {
+			mutex_unlock(&dev->lock);
+			kfree(file);
+			return result;
+		}
+		
+		WRITE_ONCE(dev->ready, true);
+		
+		if(atomic_inc_return(&nr_active) == 1)
+			queue_delayed_work(DHT20_wq, &DHT20_sched, 0);
+	}
+	
+	dev->users++;
+	
+	mutex_unlock(&dev->lock);
 	
-	filp->private_data = new_client;
+	filp->private_data = file;
 	
 	return 0;
 }
 
 int DHT20_release(struct inode *inode, struct file *filp) {
+	struct DHT20_file *file;
+	struct DHT20_dev *dev;
+	
+	file = filp->private_data;
+	dev = file->dev;
+	
+	mutex_lock(&dev->lock);
+	
+	// the last user takes the sensor out of the schedule
+	if(!--dev->users) {
+		WRITE_ONCE(dev->ready, false);
+		cancel_work_sync(&dev->work);
+		atomic_dec(&nr_active);
+		
+		spin_lock(&dev->sample_lock);
+		dev->sample.seq = 0;
+		spin_unlock(&dev->sample_lock);
+	}
+	
+	mutex_unlock(&dev->lock);
 	
-	kfree(filp->private_data);
+	kfree(file);
 	
 	PDEBUG("File pointer released. \n");
 	
@@ -135,22 +367,68 @@ static struct file_operations DHT20_fops = {
 	.owner = THIS_MODULE, 
 	.open = DHT20_open,
 	.read = DHT20_read,
+	.poll = DHT20_poll,
 	.unlocked_ioctl = DHT20_ioctl,
 	.release = DHT20_release,
 };
 
-static dev_t DHT20_id;
-static struct cdev DHT20_cdev;
-static struct class *DHT20_class;
+static void DHT20_put_devs(int count) {
+	int i;
+	
+	for(i = 0; i < count; i++)
+		i2c_put_adapter(DHT20_devs[i].client.adapter);
+}
 
 static int __init DHT20_init(void) {
-	int result;
+	int i, j, result;
 	struct device *dev_res;
+	struct DHT20_dev *dev;
+	
+	if(nr_adapters < 1) {
+		PDEBUG("No adapter specified. \n");
+		return -EINVAL;
+	}
 	
-	result = alloc_chrdev_region(&DHT20_id, 0, 1, "DHT20");
+	// the sensor has a fixed address, a second instance on one bus would interleave with the first
+	for(i = 0; i < nr_adapters; i++)
+		for(j = 0; j < i; j++)
+			if(adapters[i] == adapters[j]) {
+				PDEBUG("Adapter %d specified more than once. \n", adapters[i]);
+				return -EINVAL;
+			}
+	
+	for(nr_devs = 0; nr_devs < nr_adapters; nr_devs++) {
+		dev = &DHT20_devs[nr_devs];
+		
+		dev->client.adapter = i2c_get_adapter(adapters[nr_devs]);
+		if(!dev->client.adapter) {
+			PDEBUG("I2C adapter number %d does not exist. \n", adapters[nr_devs]);
+			DHT20_put_devs(nr_devs);
+			return -ENODEV;
+		}
+		
+		dev->client.addr = DHT20_ADDR;
+		dev->adpt = adapters[nr_devs];
+		mutex_init(&dev->lock);
+		spin_lock_init(&dev->sample_lock);
+		init_waitqueue_head(&dev->waitq);
+		INIT_WORK(&dev->work, DHT20_handler);
+	}
+	
+	INIT_DELAYED_WORK(&DHT20_sched, DHT20_schedule);
+	
+	// instances on different adapters convert concurrently
+	DHT20_wq = alloc_workqueue("DHT20_queue", 0, 0);
+	if(!DHT20_wq) {
+		PDEBUG("Failed when creating workqueue. \n");
+		result = -ENOMEM;
+		goto wq_fail;
+	}
+	
+	result = alloc_chrdev_region(&DHT20_id, 0, nr_devs, "DHT20");
 	if(result < 0) {
 		PDEBUG("Failed when requesting device number. \n");
-		return result;
+		goto region_fail;
 	}
 	
 	DHT20_class = class_create(THIS_MODULE, "DHT20");
@@ -164,43 +442,64 @@ static int __init DHT20_init(void) {
 	
 	DHT20_cdev.owner = THIS_MODULE;
 	
-	result = cdev_add(&DHT20_cdev, DHT20_id, 1);
+	result = cdev_add(&DHT20_cdev, DHT20_id, nr_devs);
 	if(result < 0) {
 		goto cdev_fail;
 	}
 	
 	PDEBUG("cdev added. \n");
 	
-	dev_res= device_create(DHT20_class, NULL, DHT20_id, NULL, "DHT20");
-	result = (int)PTR_ERR_OR_ZERO(dev_res);
-	if(result) {
-		goto create_fail;
+	for(i = 0; i < nr_devs; i++) {
+		dev_res = device_create(DHT20_class, NULL, MKDEV(MAJOR(DHT20_id), MINOR(DHT20_id) + i), 
+					NULL, "DHT20-%d", DHT20_devs[i].adpt);
+		result = (int)PTR_ERR_OR_ZERO(dev_res);
+		if(result) {
+			goto create_fail;
+		}
 	}
 	
-	PDEBUG("Device file created. \n");
+	PDEBUG("Device files created. \n");
 	
 	return 0;
 	
-create_fail:		
+create_fail:
+	while(i--)
+		device_destroy(DHT20_class, MKDEV(MAJOR(DHT20_id), MINOR(DHT20_id) + i));
+	
 	cdev_del(&DHT20_cdev);
 
 cdev_fail:
 	class_destroy(DHT20_class);
 
 class_fail:
-	unregister_chrdev_region(DHT20_id, 1);
+	unregister_chrdev_region(DHT20_id, nr_devs);
+	
+region_fail:
+	destroy_workqueue(DHT20_wq);
+	
+wq_fail:
+	DHT20_put_devs(nr_devs);
 	
 	return result;
 }
 
 static void __exit DHT20_exit(void) {
-	device_destroy(DHT20_class, DHT20_id);
+	int i;
+	
+	for(i = 0; i < nr_devs; i++)
+		device_destroy(DHT20_class, MKDEV(MAJOR(DHT20_id), MINOR(DHT20_id) + i));
 		
 	cdev_del(&DHT20_cdev);
 
 	class_destroy(DHT20_class);
 	
-	unregister_chrdev_region(DHT20_id, 1);
+	unregister_chrdev_region(DHT20_id, nr_devs);
+	
+	cancel_delayed_work_sync(&DHT20_sched);
+	
+	destroy_workqueue(DHT20_wq);
+	
+	DHT20_put_devs(nr_devs);
 	
 	PDEBUG("Driver unloaded. \n");
 }
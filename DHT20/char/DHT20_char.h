@@ -10,18 +10,41 @@
 #include <linux/delay.h>
 #include <linux/i2c.h>
 #include <linux/ioctl.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
 
 #define DHT20_DEBUG
 #ifdef DHT20_DEBUG
-#	define PDEBUG(format, args...) printk(KERN_EDEBUG "DHT20: " format, ## args)
+#	define PDEBUG(format, args...) printk(KERN_DEBUG "DHT20: " format, ## args)
 #else 
 #	define PDEBUG(format, args...)
 #endif
 
 #define DHT20_ADDR 0x38
 #define READ_LEN 5
+#define FRAME_LEN 7
+
+struct DHT20_stats {
+	unsigned int busy_retries;
+	unsigned int crc_errors;
+};
+
+// latest reading kept by the background sampler, seq starts from 1
+struct DHT20_sample {
+	long long timestamp;
+	unsigned int seq;
+	char data[READ_LEN];
+};
 
 #define INIT_SET_ADPT _IOW('D', 1, int)
+#define GET_STATS _IOR('D', 2, struct DHT20_stats)
+#define GET_SAMPLE _IOR('D', 3, struct DHT20_sample)
 
 #define INIT_CMD 0x71
 #define CMD_LEN 3
@@ -29,7 +52,49 @@
 #define CMD_2 0x33
 #define CMD_3 0x00
 
+// the busy bit is polled from CONV_MIN_MS after the trigger
+#define CONV_MIN_MS 60
+#define BUSY_POLL_MS 5
+#define MAX_BUSY_POLL 20
+#define MAX_CRC_RETRY 3
+
+// every instance is measured once per period, instances are staggered within it
+#define SAMPLE_PERIOD_MS 280
+#define MAX_DEVS 8
+
+#define STATUS_BUSY 0x80
+#define CRC_INIT 0xFF
+#define CRC_POLY 0x31
+
+// state of one sensor, shared by every file opened on its minor
+struct DHT20_dev {
+	struct i2c_client client;
+	int adpt;
+	struct mutex lock;	// protects users and ready
+	int users;
+	bool ready;
+	struct work_struct work;
+	wait_queue_head_t waitq;
+	spinlock_t sample_lock;
+	struct DHT20_sample sample;
+	atomic_t busy_retries;
+	atomic_t crc_errors;
+};
+
+// per-file state, remembers the last sample handed to the reader
+struct DHT20_file {
+	struct DHT20_dev *dev;
+	unsigned int last_seq;
+};
+
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Providing user interface to DHT20");
 
+// one DHT20 per adapter, each gets its own minor /dev/DHT20-<adapter>
+static int adapters[MAX_DEVS] = {2};
+static int nr_adapters = 1;
+
+module_param_array(adapters, int, &nr_adapters, 0444);
+MODULE_PARM_DESC(adapters, "Numbers of the I2C adapters a DHT20 is attached to");
+
 #endif
@@ -1,54 +1,412 @@
 #include "DHT20.h"
 
-void DHT20_handler(struct work_struct *work) {
+#define CREATE_TRACE_POINTS
+#include "DHT20_trace.h"
+
+// account a bus transaction started at start, res as returned by i2c_master_send/recv
+static inline void DHT20_xfer_done(struct DHT20_data *DHT20_data, const char *op, u64 start, int res) {
+	u64 ns = ktime_get_ns() - start;
+	
+	res = res < 0 ? res : 0;
+	
+	sensor_stats_xfer(&(DHT20_data->stats), ns, res);
+	
+	trace_dht20_xfer(DHT20_data->client->adapter->nr, DHT20_data->client->addr, op, ns, res);
+}
+
+// CRC-8, polynomial 0x31, initial value 0xFF, computed over status and data bytes
+u8 DHT20_crc8(const unsigned char *data, int len) {
+	int i, j;
+	u8 crc = CRC_INIT;
+	
+	for(i = 0; i < len; i++) {
+		crc ^= data[i];
+		
+		for(j = 0; j < 8; j++) {
+			if(crc & 0x80)
+				crc = (crc << 1) ^ CRC_POLY;
+			else
+				crc <<= 1;
+		}
+	}
+	
+	return crc;
+}
+
+// append a reading to the history ring, overwriting the oldest one
+void DHT20_hist_add(struct DHT20_data *DHT20_data, long temperature, long humidity) {
+	struct DHT20_record *rec;
+	struct DHT20_hist *hist = DHT20_data->hist;
+	
+	mutex_lock(&(hist->lock));
+	
+	rec = &(hist->rec[hist->seq & (HIST_LEN - 1)]);
+	rec->seq = hist->seq;
+	rec->timestamp = ktime_get_ns();
+	rec->temperature = temperature;
+	rec->humidity = humidity;
+	
+	hist->seq++;
+	
+	mutex_unlock(&(hist->lock));
+}
+
+// convert the 20-bit fields of a frame to physical units and cache them
+void DHT20_store(struct DHT20_data *DHT20_data, const unsigned char *data) {
+	u32 raw_hum, raw_temp;
+	long temperature, humidity;
+	unsigned long fast, slow;
+	
+	raw_hum = ((u32)data[1] << 12) | ((u32)data[2] << 4) | (data[3] >> 4);
+	raw_temp = (((u32)data[3] & 0x0F) << 16) | ((u32)data[4] << 8) | data[5];
+	
+	// RH = raw / 2^20 * 100%, T = raw / 2^20 * 200 - 50
+	humidity = (long)(((u64)raw_hum * 100000) >> 20);
+	temperature = (long)(((u64)raw_temp * 200000) >> 20) - 50000;
+	
+	mutex_lock(&(DHT20_data->lock));
+	
+	fast = READ_ONCE(DHT20_data->interval);
+	slow = max_t(unsigned long, READ_ONCE(max_interval), fast);
+	
+	// back off while stable, snap back to fast sampling on any change
+	if(DHT20_data->valid && abs(temperature - DHT20_data->temperature) <= READ_ONCE(temp_delta)
+			&& abs(humidity - DHT20_data->humidity) <= READ_ONCE(humidity_delta))
+		DHT20_data->cur_interval = min(DHT20_data->cur_interval * 2, slow);
+	else
+		DHT20_data->cur_interval = fast;
+	
+	DHT20_data->humidity = humidity;
+	DHT20_data->temperature = temperature;
+	DHT20_data->valid = true;
+	
+	mutex_unlock(&(DHT20_data->lock));
+	
+	DHT20_hist_add(DHT20_data, temperature, humidity);
+	
+	sensor_stats_inc(&(DHT20_data->stats), SENSOR_SAMPLES);
+	sensor_stats_hist(&(DHT20_data->stats), SENSOR_LATENCY_NS, ktime_get_ns() - DHT20_data->trigger_ns);
+	
+	trace_dht20_sample(temperature, humidity, READ_ONCE(DHT20_data->cur_interval));
+}
+
+// queue the next trigger relative to the previous one to keep the cadence
+void DHT20_schedule_next(struct DHT20_data *DHT20_data) {
+	unsigned long next;
+	
+	DHT20_data->stage = DHT20_TRIGGER;
+	DHT20_data->crc_retries = 0;
+	
+	next = DHT20_data->trigger_time + msecs_to_jiffies(READ_ONCE(DHT20_data->cur_interval));
+	if(time_after(jiffies, next))
+		next = jiffies;
+	
+	sensor_hub_queue(DHT20_data->hub, &(DHT20_data->dw), next - jiffies);
+}
+
+void DHT20_handler(struct sensor_hub_work *work) {
 	int res;
+	u64 start;
 	char cmd_r[4];
-	unsigned char data[7];
+	unsigned char data[FRAME_LEN + 1];
 	struct DHT20_data *DHT20_data;
 	
-	DHT20_data = container_of(work, struct DHT20_data, dw.work);
+	DHT20_data = container_of(work, struct DHT20_data, dw);
 	
 	if(!DHT20_data) {
 		PDEBUG("Failed when retrieving data. \n");
 		return;
 	}
 	
-	cmd_r[0] = 0xAC;
-	cmd_r[1] = 0x33;
-	cmd_r[2] = 0x00;
-	cmd_r[3] = '\0';
+	trace_dht20_work(DHT20_data->stage, DHT20_data->busy_polls);
 	
-	res = i2c_master_send(DHT20_data->client, cmd_r, 3);
-	if(IS_ERR_VALUE(res)) {
-		PDEBUG("Read command transmission failed. \n");
-		return;
+	switch(DHT20_data->stage) {
+		case DHT20_TRIGGER:
+			cmd_r[0] = 0xAC;
+			cmd_r[1] = 0x33;
+			cmd_r[2] = 0x00;
+			cmd_r[3] = '\0';
+			
+			DHT20_data->trigger_time = jiffies;
+			DHT20_data->trigger_ns = start = ktime_get_ns();
+			
+			res = i2c_master_send(DHT20_data->client, cmd_r, 3);
+			
+			DHT20_xfer_done(DHT20_data, "trigger", start, res);
+			
+			if(IS_ERR_VALUE(res)) {
+				PDEBUG("Read command transmission failed. \n");
+				DHT20_schedule_next(DHT20_data);
+				return;
+			}
+			
+			// let the cpu idle while the sensor converts
+			DHT20_data->stage = DHT20_FETCH;
+			DHT20_data->busy_polls = 0;
+			sensor_hub_queue(DHT20_data->hub, &(DHT20_data->dw), msecs_to_jiffies(CONV_MIN_MS));
+			
+			break;
+			
+		case DHT20_FETCH:
+			data[FRAME_LEN] = '\0';
+			
+			start = ktime_get_ns();
+			
+			res = i2c_master_recv(DHT20_data->client, data, FRAME_LEN);
+			
+			DHT20_xfer_done(DHT20_data, "fetch", start, res);
+			
+			if(IS_ERR_VALUE(res)) {
+				sensor_stats_inc(&(DHT20_data->stats), SENSOR_DROPPED);
+				PDEBUG("Return data transmission failed. \n");
+				DHT20_schedule_next(DHT20_data);
+				return;
+			}
+			
+			// conversion still in progress, check again shortly
+			if(data[0] & STATUS_BUSY) {
+				atomic_inc(&(DHT20_data->busy_retries));
+				sensor_stats_inc(&(DHT20_data->stats), SENSOR_RETRIES);
+				
+				if(++DHT20_data->busy_polls < MAX_BUSY_POLL) {
+					sensor_hub_queue(DHT20_data->hub, &(DHT20_data->dw), msecs_to_jiffies(BUSY_POLL_MS));
+					return;
+				}
+				
+				trace_dht20_conv_wait(jiffies_to_msecs(jiffies - DHT20_data->trigger_time), DHT20_data->busy_polls, -ETIMEDOUT);
+				sensor_stats_inc(&(DHT20_data->stats), SENSOR_DROPPED);
+				
+				PDEBUG("Conversion timed out. \n");
+				DHT20_schedule_next(DHT20_data);
+				return;
+			}
+			
+			trace_dht20_conv_wait(jiffies_to_msecs(jiffies - DHT20_data->trigger_time), DHT20_data->busy_polls, 0);
+			
+			// reject corrupted frames and measure again right away, a few times per period
+			if(DHT20_crc8(data, FRAME_LEN - 1) != data[FRAME_LEN - 1]) {
+				atomic_inc(&(DHT20_data->crc_errors));
+				sensor_stats_inc(&(DHT20_data->stats), SENSOR_DROPPED);
+				PDEBUG("CRC mismatch, frame discarded. \n");
+				
+				if(++DHT20_data->crc_retries < MAX_CRC_RETRY) {
+					DHT20_data->stage = DHT20_TRIGGER;
+					sensor_hub_queue(DHT20_data->hub, &(DHT20_data->dw), msecs_to_jiffies(BUSY_POLL_MS));
+					return;
+				}
+				
+				DHT20_schedule_next(DHT20_data);
+				return;
+			}
+			
+			DHT20_store(DHT20_data, data);
+			
+			DHT20_schedule_next(DHT20_data);
+			
+			break;
 	}
+}
+
+static ssize_t busy_retries_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct DHT20_data *DHT20_data = dev_get_drvdata(dev);
 	
-	mdelay(80);
+	return sprintf(buf, "%d\n", atomic_read(&(DHT20_data->busy_retries)));
+}
+
+static ssize_t crc_errors_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct DHT20_data *DHT20_data = dev_get_drvdata(dev);
 	
-	data[6] = '\0';
+	return sprintf(buf, "%d\n", atomic_read(&(DHT20_data->crc_errors)));
+}
+
+static DEVICE_ATTR_RO(busy_retries);
+static DEVICE_ATTR_RO(crc_errors);
+
+static struct attribute *DHT20_attrs[] = {
+	&dev_attr_busy_retries.attr,
+	&dev_attr_crc_errors.attr,
+	NULL,
+};
+
+static const struct attribute_group DHT20_group = {
+	.attrs = DHT20_attrs,
+};
+
+static umode_t DHT20_is_visible(const void *drvdata, enum hwmon_sensor_types type, u32 attr, int channel) {
+	switch(type) {
+		case hwmon_chip:
+			if(attr == hwmon_chip_update_interval)
+				return 0644;
+			break;
+			
+		case hwmon_temp:
+			if(attr == hwmon_temp_input)
+				return 0444;
+			break;
+			
+		case hwmon_humidity:
+			if(attr == hwmon_humidity_input)
+				return 0444;
+			break;
+			
+		default:
+			break;
+	}
 	
-	res = i2c_master_recv(DHT20_data->client, data, 6);
-	if(IS_ERR_VALUE(res)) {
-		PDEBUG("Return data transmission failed. \n");
-		return;
+	return 0;
+}
+
+// served from the cache, a scrape never triggers a conversion
+static int DHT20_hwmon_read(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, long *val) {
+	int res = 0;
+	struct DHT20_data *DHT20_data = dev_get_drvdata(dev);
+	
+	if(type == hwmon_chip) {
+		*val = READ_ONCE(DHT20_data->interval);
+		return 0;
 	}
 	
-	printk("DHT20: %02X %02X %02X %02X %02X %02X \n", data[0], data[1], data[2], data[3], data[4], data[5]);
+	mutex_lock(&(DHT20_data->lock));
+	
+	if(!DHT20_data->valid)
+		res = -ENODATA;
+	else if(type == hwmon_temp)
+		*val = DHT20_data->temperature;
+	else
+		*val = DHT20_data->humidity;
+	
+	mutex_unlock(&(DHT20_data->lock));
+	
+	return res;
+}
+
+static int DHT20_hwmon_write(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, long val) {
+	struct DHT20_data *DHT20_data = dev_get_drvdata(dev);
+	
+	if(type != hwmon_chip || attr != hwmon_chip_update_interval)
+		return -EOPNOTSUPP;
+	
+	val = clamp_val(val, MIN_INTERVAL_MS, MAX_INTERVAL_MS);
+	
+	// takes effect from the next trigger
+	mutex_lock(&(DHT20_data->lock));
+	WRITE_ONCE(DHT20_data->interval, val);
+	WRITE_ONCE(DHT20_data->cur_interval, val);
+	mutex_unlock(&(DHT20_data->lock));
 	
-	queue_delayed_work(DHT20_data->wq, &(DHT20_data->dw), msecs_to_jiffies(200));
+	return 0;
 }
 
+static const struct hwmon_channel_info *DHT20_hwmon_info[] = {
+	HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL),
+	HWMON_CHANNEL_INFO(temp, HWMON_T_INPUT),
+	HWMON_CHANNEL_INFO(humidity, HWMON_H_INPUT),
+	NULL,
+};
+
+static const struct hwmon_ops DHT20_hwmon_ops = {
+	.is_visible = DHT20_is_visible,
+	.read = DHT20_hwmon_read,
+	.write = DHT20_hwmon_write,
+};
+
+static const struct hwmon_chip_info DHT20_chip_info = {
+	.ops = &DHT20_hwmon_ops,
+	.info = DHT20_hwmon_info,
+};
+
+// the device and every open file hold a reference, the last one frees the ring
+static void DHT20_hist_free(struct kref *ref) {
+	vfree(container_of(ref, struct DHT20_hist, ref));
+}
+
+// misc_open holds the misc lock, so the device cannot be deregistered meanwhile
+static int DHT20_hist_open(struct inode *inode, struct file *filp) {
+	struct DHT20_data *DHT20_data;
+	
+	DHT20_data = container_of(filp->private_data, struct DHT20_data, misc);
+	
+	kref_get(&(DHT20_data->hist->ref));
+	filp->private_data = DHT20_data->hist;
+	
+	return 0;
+}
+
+static int DHT20_hist_release(struct inode *inode, struct file *filp) {
+	struct DHT20_hist *hist = filp->private_data;
+	
+	kref_put(&(hist->ref), DHT20_hist_free);
+	
+	return 0;
+}
+
+/*
+ * The file position is the sequence number of the next record to return, 
+ * a consumer resumes with lseek(fd, last_seq + 1, SEEK_SET). 
+ * Records that have been overwritten are skipped. 
+ */
+static ssize_t DHT20_hist_read(struct file *filp, char __user *buff, size_t size, loff_t *loff) {
+	u64 first, pos, count, done = 0, batch, i;
+	struct DHT20_record recs[HIST_BATCH];
+	struct DHT20_hist *hist = filp->private_data;
+	
+	count = size / sizeof(struct DHT20_record);
+	if(!count)
+		return -EINVAL;
+	
+	pos = *loff;
+	
+	while(done < count) {
+		if(mutex_lock_interruptible(&(hist->lock)))
+			return done ? done * sizeof(struct DHT20_record) : -ERESTARTSYS;
+		
+		if(hist->dead) {
+			mutex_unlock(&(hist->lock));
+			return done ? done * sizeof(struct DHT20_record) : -ENODEV;
+		}
+		
+		first = hist->seq > HIST_LEN ? hist->seq - HIST_LEN : 0;
+		pos = max_t(u64, pos, first);
+		
+		batch = min3(count - done, (u64)HIST_BATCH, pos < hist->seq ? hist->seq - pos : 0);
+		
+		for(i = 0; i < batch; i++)
+			recs[i] = hist->rec[(pos + i) & (HIST_LEN - 1)];
+		
+		mutex_unlock(&(hist->lock));
+		
+		if(!batch)
+			break;
+		
+		if(copy_to_user(buff + done * sizeof(struct DHT20_record), recs, batch * sizeof(struct DHT20_record)))
+			return done ? done * sizeof(struct DHT20_record) : -EFAULT;
+		
+		pos += batch;
+		done += batch;
+		*loff = pos;
+	}
+	
+	return done * sizeof(struct DHT20_record);
+}
+
+static const struct file_operations DHT20_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = DHT20_hist_open,
+	.read = DHT20_hist_read,
+	.release = DHT20_hist_release,
+	.llseek = no_seek_end_llseek,
+};
+
 int DHT20_probe(struct i2c_client *i2c_client, const struct i2c_device_id *id) {
 	int res;
 	char init_byte[2];
 	char status[2];
 	struct DHT20_data *DHT20_data;
-	struct device *dev;
+	struct device *dev, *hwmon_dev;
 	
 	PDEBUG("I2C_client addr: %p. \n", i2c_client);
 	
-	PDEBUG("DHT20 probed on adapter: %d. \n", ADPT_NUM);
+	PDEBUG("DHT20 probed on adapter: %d. \n", adapter);
 	
 	dev = &(i2c_client->dev);
 	
@@ -59,6 +417,16 @@ int DHT20_probe(struct i2c_client *i2c_client, const struct i2c_device_id *id) {
 	}
 	
 	DHT20_data->client = i2c_client;
+	
+	res = devm_sensor_stats_init(dev, &(DHT20_data->stats), DHT20_debugfs);
+	if(res) {
+		PDEBUG("Failed when allocating statistics. \n");
+		return res;
+	}
+	
+	DHT20_data->interval = SAMPLE_PERIOD_MS;
+	DHT20_data->cur_interval = SAMPLE_PERIOD_MS;
+	mutex_init(&(DHT20_data->lock));
 	i2c_set_clientdata(i2c_client, DHT20_data);
 		
 	mdelay(100);
@@ -92,17 +460,66 @@ int DHT20_probe(struct i2c_client *i2c_client, const struct i2c_device_id *id) {
 	
 	mdelay(10);
 	
-	DHT20_data->wq = create_workqueue("DHT20_queue");
-	if(!DHT20_data->wq) {
-		PDEBUG("Failed when creating workqueue. \n");
+	DHT20_data->hist = vzalloc(sizeof(struct DHT20_hist));
+	if(!DHT20_data->hist) {
+		PDEBUG("Failed when allocating history ring. \n");
 		return -ENOMEM;
 	}
 	
-	INIT_DELAYED_WORK(&(DHT20_data->dw), DHT20_handler);
+	kref_init(&(DHT20_data->hist->ref));
+	mutex_init(&(DHT20_data->hist->lock));
+	
+	// measurements run on the acquisition worker of the adapter
+	DHT20_data->hub = sensor_hub_get(i2c_client->adapter);
+	if(IS_ERR(DHT20_data->hub)) {
+		PDEBUG("Failed when getting sensor hub. \n");
+		res = PTR_ERR(DHT20_data->hub);
+		goto hub_fail;
+	}
+	
+	sensor_hub_init_work(&(DHT20_data->dw), DHT20_handler);
+	DHT20_data->stage = DHT20_TRIGGER;
 	
-	queue_delayed_work(DHT20_data->wq, &(DHT20_data->dw), msecs_to_jiffies(200));
+	// retry counters under /sys/bus/i2c/devices/<client>/
+	res = devm_device_add_group(dev, &DHT20_group);
+	if(res) {
+		PDEBUG("Failed when creating sysfs attributes. \n");
+		goto attr_fail;
+	}
+	
+	// temp1_input, humidity1_input and update_interval under /sys/class/hwmon
+	hwmon_dev = devm_hwmon_device_register_with_info(dev, "dht20", DHT20_data, &DHT20_chip_info, NULL);
+	if(IS_ERR(hwmon_dev)) {
+		PDEBUG("Failed when registering hwmon device. \n");
+		res = PTR_ERR(hwmon_dev);
+		goto attr_fail;
+	}
+	
+	// bulk readout of the history ring
+	snprintf(DHT20_data->hist_name, sizeof(DHT20_data->hist_name), "DHT20_hist-%d", i2c_adapter_id(i2c_client->adapter));
+	
+	DHT20_data->misc.minor = MISC_DYNAMIC_MINOR;
+	DHT20_data->misc.name = DHT20_data->hist_name;
+	DHT20_data->misc.fops = &DHT20_hist_fops;
+	DHT20_data->misc.parent = dev;
+	
+	res = misc_register(&(DHT20_data->misc));
+	if(res) {
+		PDEBUG("Failed when registering history device. \n");
+		goto attr_fail;
+	}
+	
+	sensor_hub_queue(DHT20_data->hub, &(DHT20_data->dw), msecs_to_jiffies(POLL_INTERVAL_MS));
 	
 	return 0;
+
+attr_fail:
+	sensor_hub_put(DHT20_data->hub);
+	
+hub_fail:
+	vfree(DHT20_data->hist);
+	
+	return res;
 }
 
 int DHT20_remove(struct i2c_client *i2c_client) {
@@ -115,13 +532,18 @@ int DHT20_remove(struct i2c_client *i2c_client) {
 		return -ENOTTY;
 	}
 	
-	cancel_delayed_work_sync(&(DHT20_data->dw));
+	sensor_hub_cancel(&(DHT20_data->dw));
 	
-	flush_workqueue(DHT20_data->wq);
+	sensor_hub_put(DHT20_data->hub);
 	
-	mdelay(200);
+	misc_deregister(&(DHT20_data->misc));
 	
-	destroy_workqueue(DHT20_data->wq);
+	// files still open keep the ring, their reads fail from now on
+	mutex_lock(&(DHT20_data->hist->lock));
+	DHT20_data->hist->dead = true;
+	mutex_unlock(&(DHT20_data->hist->lock));
+	
+	kref_put(&(DHT20_data->hist->ref), DHT20_hist_free);
 	
 	PDEBUG("DHT20 removed. \n");
 	return 0;
@@ -146,12 +568,15 @@ static struct i2c_client *DHT20_client;
 static int __init DHT20_init(void) {	
 	int result;
 	
-	DHT20_adpt = i2c_get_adapter(ADPT_NUM);
+	DHT20_adpt = i2c_get_adapter(adapter);
 	if(!DHT20_adpt) {
-		PDEBUG("I2C adapter number %d does not exist. \n", ADPT_NUM);
+		PDEBUG("I2C adapter number %d does not exist. \n", adapter);
 		return -ENODEV;
 	}
 	
+	// statistics are optional, the driver works without debugfs
+	DHT20_debugfs = debugfs_create_dir("DHT20", NULL);
+	
 	DHT20_client = i2c_new_client_device(DHT20_adpt, &DHT20_info);
 	PDEBUG("DHT20_client addr: %p", DHT20_client);
 	
@@ -173,6 +598,8 @@ driver_fail:
 	i2c_unregister_device(DHT20_client);
 	
 client_fail:
+	debugfs_remove_recursive(DHT20_debugfs);
+	
 	i2c_put_adapter(DHT20_adpt);
 		
 	return result;
@@ -183,6 +610,8 @@ static void __exit DHT20_exit(void) {
 	
 	i2c_unregister_device(DHT20_client);
 	
+	debugfs_remove_recursive(DHT20_debugfs);
+	
 	i2c_put_adapter(DHT20_adpt);
 	
 	PDEBUG("DHT20 I2C driver unloaded. \n");
@@ -10,6 +10,20 @@
 #include <linux/i2c.h>
 #include <linux/workqueue.h>
 #include <linux/jiffies.h>
+#include <linux/atomic.h>
+#include <linux/sysfs.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/hwmon.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+
+#include "DHT20_trace.h"
+#include "sensor_stats.h"
+#include "sensor_hub.h"
 
 #define DHT20_DEBUG
 
@@ -21,9 +35,49 @@
 
 #define ADPT_NUM 2
 
+#define CONV_TIME_MS 80
+#define POLL_INTERVAL_MS 200
+#define SAMPLE_PERIOD_MS (CONV_TIME_MS + POLL_INTERVAL_MS)
+
+// bounds of the hwmon update_interval attribute
+#define MIN_INTERVAL_MS (CONV_MIN_MS + BUSY_POLL_MS * MAX_BUSY_POLL)
+#define MAX_INTERVAL_MS 3600000
+
+// the busy bit is polled from CONV_MIN_MS after the trigger
+#define CONV_MIN_MS 60
+#define BUSY_POLL_MS 5
+#define MAX_BUSY_POLL 20
+#define MAX_CRC_RETRY 3
+
+// number of samples kept in the history ring, must be a power of 2
+#define HIST_LEN 4096
+
+#define FRAME_LEN 7
+#define STATUS_BUSY 0x80
+#define CRC_INIT 0xFF
+#define CRC_POLY 0x31
+
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Polling DHT20 from kernel space");
 
+// the polling interval doubles while readings stay within these deltas
+static unsigned int max_interval = 8960;
+static unsigned int temp_delta = 100;
+static unsigned int humidity_delta = 500;
+
+module_param(max_interval, uint, 0644);
+MODULE_PARM_DESC(max_interval, "Upper bound of the adaptive polling interval in ms");
+module_param(temp_delta, uint, 0644);
+MODULE_PARM_DESC(temp_delta, "Temperature change in milli-degree Celsius regarded as stable");
+module_param(humidity_delta, uint, 0644);
+MODULE_PARM_DESC(humidity_delta, "Humidity change in milli-percent RH regarded as stable");
+
+// defaults to the BeagleBone bus, i2c_sim reports its own number
+static int adapter = ADPT_NUM;
+
+module_param(adapter, int, 0444);
+MODULE_PARM_DESC(adapter, "Number of the I2C adapter the sensor is attached to");
+
 static struct i2c_board_info DHT20_info = {
 	I2C_BOARD_INFO("DHT20", 0x38),
 };
@@ -35,10 +89,63 @@ static struct i2c_device_id DHT20_id_table[] = {
 
 MODULE_DEVICE_TABLE(i2c, DHT20_id_table);
 
+// one entry of the history ring as returned by read() on /dev/DHT20_hist-<adapter>
+struct DHT20_record {
+	__u64 seq;
+	__u64 timestamp;	// ktime_get_ns() when the frame was read
+	__s32 temperature;	// milli-degree Celsius
+	__u32 humidity;		// milli-percent RH
+};
+
+// records copied out per lock hold, the copy to the reader is done unlocked
+#define HIST_BATCH 16
+
+/*
+ * History ring, refcounted so that readers holding /dev/DHT20_hist-<adapter> 
+ * across a remove keep it alive, dead is set by remove and fails later reads
+ */
+struct DHT20_hist {
+	struct kref ref;
+	struct mutex lock;	// protects seq, dead and rec
+	bool dead;
+	u64 seq;		// sequence number of the next record
+	struct DHT20_record rec[HIST_LEN];
+};
+
+// stages of one measurement, the handler runs once per stage
+enum DHT20_stage {
+	DHT20_TRIGGER = 0,
+	DHT20_FETCH = 1,
+};
+
+// per-device counters under /sys/kernel/debug/DHT20/<client>/stats
+static struct dentry *DHT20_debugfs;
+
 struct DHT20_data {
-	struct delayed_work dw;
-	struct workqueue_struct *wq;
+	struct sensor_hub_work dw;
+	enum DHT20_stage stage;
+	unsigned long trigger_time;
+	u64 trigger_ns;
+	int busy_polls;
+	int crc_retries;	// consecutive corrupted frames of this period
+	struct sensor_stats stats;
+	struct sensor_hub *hub;
 	struct i2c_client *client;
+	atomic_t busy_retries;
+	atomic_t crc_errors;
+	
+	// latest reading in milli-degree Celsius and milli-percent RH
+	struct mutex lock;
+	bool valid;
+	long temperature;
+	long humidity;
+	unsigned long interval;	// fast interval, set through update_interval
+	unsigned long cur_interval;	// stretched while readings are stable
+	
+	// history ring, shared with the open history files
+	struct DHT20_hist *hist;
+	struct miscdevice misc;
+	char hist_name[24];
 };
 
 #endif
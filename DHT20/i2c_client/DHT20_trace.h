@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* Trace events of the DHT20 I2C client driver, enabled through
+   /sys/kernel/tracing/events/dht20/
+
+   Copyright (c) 2024,2024 Zixuan Qiao <zqiao104@uottawa.ca> */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dht20
+
+#if !defined(_DHT20_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DHT20_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// start of a handler run, stage is DHT20_TRIGGER or DHT20_FETCH
+TRACE_EVENT(dht20_work,
+	TP_PROTO(int stage, int busy_polls),
+
+	TP_ARGS(stage, busy_polls),
+
+	TP_STRUCT__entry(
+		__field(int, stage)
+		__field(int, busy_polls)
+	),
+
+	TP_fast_assign(
+		__entry->stage = stage;
+		__entry->busy_polls = busy_polls;
+	),
+
+	TP_printk("stage=%s busy_polls=%d",
+		__entry->stage ? "fetch" : "trigger", __entry->busy_polls)
+);
+
+// one bus transaction, the trigger command or a frame read
+TRACE_EVENT(dht20_xfer,
+	TP_PROTO(int adpt, u16 addr, const char *op, u64 ns, int result),
+
+	TP_ARGS(adpt, addr, op, ns, result),
+
+	TP_STRUCT__entry(
+		__field(int, adpt)
+		__field(u16, addr)
+		__string(op, op)
+		__field(u64, ns)
+		__field(int, result)
+	),
+
+	TP_fast_assign(
+		__entry->adpt = adpt;
+		__entry->addr = addr;
+		__assign_str(op, op);
+		__entry->ns = ns;
+		__entry->result = result;
+	),
+
+	TP_printk("adapter=%d addr=0x%02x op=%s ns=%llu result=%d",
+		__entry->adpt, __entry->addr, __get_str(op), __entry->ns,
+		__entry->result)
+);
+
+// end of a conversion, wait_ms counts from the trigger
+TRACE_EVENT(dht20_conv_wait,
+	TP_PROTO(unsigned int wait_ms, int busy_polls, int result),
+
+	TP_ARGS(wait_ms, busy_polls, result),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, wait_ms)
+		__field(int, busy_polls)
+		__field(int, result)
+	),
+
+	TP_fast_assign(
+		__entry->wait_ms = wait_ms;
+		__entry->busy_polls = busy_polls;
+		__entry->result = result;
+	),
+
+	TP_printk("wait_ms=%u busy_polls=%d result=%d",
+		__entry->wait_ms, __entry->busy_polls, __entry->result)
+);
+
+// reading stored in the cache and the history ring
+TRACE_EVENT(dht20_sample,
+	TP_PROTO(long temperature, long humidity, unsigned long interval),
+
+	TP_ARGS(temperature, humidity, interval),
+
+	TP_STRUCT__entry(
+		__field(long, temperature)
+		__field(long, humidity)
+		__field(unsigned long, interval)
+	),
+
+	TP_fast_assign(
+		__entry->temperature = temperature;
+		__entry->humidity = humidity;
+		__entry->interval = interval;
+	),
+
+	TP_printk("temperature=%ld humidity=%ld interval_ms=%lu",
+		__entry->temperature, __entry->humidity, __entry->interval)
+);
+
+#endif
+
+// the header lives next to the driver, see CFLAGS_DHT20.o
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE DHT20_trace
+#include <trace/define_trace.h>
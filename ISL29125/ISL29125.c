@@ -1,44 +1,69 @@
 #include "ISL29125.h"
 
-void isl_work_handler(struct work_struct *work) {
-	s32 data;
-	struct ISL29125_data *ISL29125_data;
+#define CREATE_TRACE_POINTS
+#include "ISL29125_trace.h"
+
+// called by i2c_xfer.h for every transaction, the hub is NULL until probe gets it
+struct sensor_hub *ISL29125_hub(struct i2c_client *client) {
+	struct ISL29125_data *ISL29125_data = i2c_get_clientdata(client);
+	
+	return ISL29125_data ? ISL29125_data->hub : NULL;
+}
+
+// called by i2c_xfer.h after every transaction
+void ISL29125_xfer_done(struct i2c_client *client, struct i2c_xfer_stats *stats, int msgs, u64 ns, int result) {
+	struct ISL29125_data *ISL29125_data = i2c_get_clientdata(client);
 	
-	PDEBUG("Workqueue handler invoked. \n");
+	if(ISL29125_data)
+		sensor_stats_xfer(&(ISL29125_data->stats), ns, result);
+	
+	trace_isl29125_xfer(client->adapter->nr, client->addr, stats ? stats->name : "", msgs, ns, result);
+}
+
+void isl_work_handler(struct sensor_hub_work *work) {
+	int result;
+	u64 irq_time;
+	u8 values[IRQ_READ_LEN];
+	struct ISL29125_data *ISL29125_data;
 	
 	ISL29125_data = container_of(work, struct ISL29125_data, w);
 	if(!ISL29125_data) {
 		PDEBUG("Failed when retrieving data. \n");
 		return;
 	}
+	
+	trace_isl29125_work(ISL29125_data->irq_nr);
+	
+	irq_time = atomic64_xchg(&(ISL29125_data->irq_time), 0);
 
-	// getting interrupt data
-	data = i2c_smbus_read_byte_data(ISL29125_data->client, DATA_REG_RL);
-	if(data < 0) {
-		PDEBUG("Failed when reading the value of DATA_REG_RL. \n");
-		return;
-	}
-	printk("Red low: %02X. \n", data);
+	// status flags and interrupt data in one transaction, reading ST_FLG_REG clears interrupt state
+	i2c_xfer_begin(&ISL29125_xfer[XFER_IRQ]);
 	
-	data = i2c_smbus_read_byte_data(ISL29125_data->client, DATA_REG_RH);
-	if(data < 0) {
-		PDEBUG("Failed when reading the value of DATA_REG_RH. \n");
+	result = i2c_xfer_read(ISL29125_data->client, ST_FLG_REG, values, IRQ_READ_LEN, &ISL29125_xfer[XFER_IRQ]);
+	if(result) {
+		sensor_stats_inc(&(ISL29125_data->stats), SENSOR_DROPPED);
+		PDEBUG("Failed when reading status and data registers. \n");
 		return;
 	}
-	printk("Red high: %02X. \n", data);
+	
+	trace_isl29125_sample(values[0],
+		values[DATA_REG_GL - ST_FLG_REG] | (values[DATA_REG_GH - ST_FLG_REG] << 8),
+		values[DATA_REG_RL - ST_FLG_REG] | (values[DATA_REG_RH - ST_FLG_REG] << 8));
+	
+	sensor_stats_inc(&(ISL29125_data->stats), SENSOR_SAMPLES);
+	
+	if(irq_time)
+		sensor_stats_hist(&(ISL29125_data->stats), SENSOR_LATENCY_NS, ktime_get_ns() - irq_time);
+}
 
-	// clearing interrupt state
-	data = i2c_smbus_read_byte_data(ISL29125_data->client, ST_FLG_REG);
-	if(data < 0) {
-		PDEBUG("Failed when reading the value of ST_FLG_REG. \n");
-		return;
-	}
+static void ISL29125_hub_put(void *hub) {
+	sensor_hub_put(hub);
 }
 
 irqreturn_t isl_int_handler(int irq, void *dev_id) {
 	struct ISL29125_data *ISL29125_data;
 	
-	PDEBUG("Interrupt detected. \n");
+	trace_isl29125_irq(irq);
 	
 	ISL29125_data = dev_id;
 	if(!ISL29125_data) {
@@ -46,44 +71,80 @@ irqreturn_t isl_int_handler(int irq, void *dev_id) {
 		return -ENOTTY;
 	}
 	
-	queue_work(ISL29125_data->wq, &(ISL29125_data->w));
+	sensor_stats_inc(&(ISL29125_data->stats), SENSOR_IRQS);
+	
+	// an interrupt arriving while the bottom half is pending is merged into it
+	atomic64_cmpxchg(&(ISL29125_data->irq_time), 0, ktime_get_ns());
+	
+	if(!sensor_hub_queue(ISL29125_data->hub, &(ISL29125_data->w), 0))
+		sensor_stats_inc(&(ISL29125_data->stats), SENSOR_COALESCED);
 	
 	return IRQ_HANDLED;
 }
 
 int config_register(struct i2c_client *i2c_client, u8 reg_addr, u8 config) {
 	int res;
-	s32 data;
+	struct ISL29125_data *ISL29125_data = i2c_get_clientdata(i2c_client);
 	
-	res = i2c_smbus_write_byte_data(i2c_client, reg_addr, config);
-	if(res) {
-		PDEBUG("Failed when sending command to register: %02X. \n", reg_addr);
-		return res;
-	}
+	// write and read-back in one transaction
+	i2c_xfer_begin(&ISL29125_xfer[XFER_CONFIG]);
 	
-	data = i2c_smbus_read_byte_data(i2c_client, reg_addr);
-	if(data < 0) {
-		PDEBUG("Failed when reading the value of register: %02X. \n", reg_addr);
-		return data;
+	res = i2c_xfer_write_verify(i2c_client, reg_addr, &config, 1, &ISL29125_xfer[XFER_CONFIG]);
+	if(res == -EAGAIN) {
+		sensor_stats_inc(&(ISL29125_data->stats), SENSOR_VERIFY_FAILS);
+		PDEBUG("Failed when initializing register: %02X, config: %02X. \n", reg_addr, config);
+		return res;
 	}
 	
-	if((u8)data != config) {
-		PDEBUG("Failed when initializing register: %02X, config: %02X, value: %02X. \n", reg_addr, config, (u8)data);
-		return -EAGAIN;
+	if(res) {
+		PDEBUG("Failed when sending command to register: %02X. \n", reg_addr);
+		return res;
 	}
 	
 	return 0;
 }
 
 int ISL29125_probe(struct i2c_client *i2c_client, const struct i2c_device_id *id) {
-	u8 config;
+	u8 config, status, thresholds[NUM_INT_THR_REG];
 	int result;
 	struct ISL29125_data *ISL29125_data;
 	struct device *dev;
 	
 	PDEBUG("I2C_client addr: %p. \n", i2c_client);
 	
-	PDEBUG("ISL29125 probed on adapter: %d. \n", ADPT_NUM);
+	PDEBUG("ISL29125 probed on adapter: %d. \n", adapter);
+	
+	// initialize device data first so the configuration is accounted as well
+	dev = &(i2c_client->dev);
+	
+	ISL29125_data = devm_kzalloc(dev, sizeof(struct ISL29125_data), GFP_KERNEL);
+	if(!ISL29125_data) {
+		PDEBUG("Failed when allocating ISL29125 data. \n");
+		return -ENOMEM;
+	}
+	
+	ISL29125_data->client = i2c_client;
+	
+	result = devm_sensor_stats_init(dev, &(ISL29125_data->stats), ISL29125_debugfs);
+	if(result) {
+		PDEBUG("Failed when allocating statistics. \n");
+		return result;
+	}
+	
+	i2c_set_clientdata(i2c_client, ISL29125_data);
+	
+	// the bottom half and the configuration below run on the acquisition worker of the adapter
+	ISL29125_data->hub = sensor_hub_get(i2c_client->adapter);
+	if(IS_ERR(ISL29125_data->hub)) {
+		PDEBUG("Failed when getting sensor hub. \n");
+		return PTR_ERR(ISL29125_data->hub);
+	}
+	
+	result = devm_add_action_or_reset(dev, ISL29125_hub_put, ISL29125_data->hub);
+	if(result)
+		return result;
+	
+	sensor_hub_init_work(&(ISL29125_data->w), isl_work_handler);
 	
 	mdelay(10);
 	
@@ -105,83 +166,52 @@ int ISL29125_probe(struct i2c_client *i2c_client, const struct i2c_device_id *id
 		return result;
 	}
 	
-	// config low interrupt threshold low byte register 
-	result = config_register(i2c_client, INT_REG_LTL, INT_VAL_LTL);
-	if(result) {
-		PDEBUG("Failed when initializing low interrupt threshold low byte register. \n");
-		return result;
-	}
+	// config interrupt thresholds, the four registers are adjacent and written in one transaction
+	thresholds[0] = INT_VAL_LTL;
+	thresholds[1] = INT_VAL_LTH;
+	thresholds[2] = INT_VAL_HTL;
+	thresholds[3] = INT_VAL_HTH;
 	
-	// config low interrupt threshold high byte register 
-	result = config_register(i2c_client, INT_REG_LTH, INT_VAL_LTH);
-	if(result) {
-		PDEBUG("Failed when initializing low interrupt threshold high byte register. \n");
-		return result;
-	}
+	i2c_xfer_begin(&ISL29125_xfer[XFER_CONFIG]);
 	
-	// config high interrupt threshold low byte register 
-	result = config_register(i2c_client, INT_REG_HTL, INT_VAL_HTL);
-	if(result) {
-		PDEBUG("Failed when initializing high interrupt threshold low byte register. \n");
-		return result;
-	}
+	result = i2c_xfer_write_verify(i2c_client, INT_REG_LTL, thresholds, NUM_INT_THR_REG, &ISL29125_xfer[XFER_CONFIG]);
+	if(result == -EAGAIN)
+		sensor_stats_inc(&(ISL29125_data->stats), SENSOR_VERIFY_FAILS);
 	
-	// config high interrupt threshold high byte register 
-	result = config_register(i2c_client, INT_REG_HTH, INT_VAL_HTH);
 	if(result) {
-		PDEBUG("Failed when initializing high interrupt threshold high byte register. \n");
+		PDEBUG("Failed when initializing interrupt threshold registers. \n");
 		return result;
 	}
 	
-
-	// initialize device data	
-	dev = &(i2c_client->dev);
-	
-	ISL29125_data = devm_kzalloc(dev, sizeof(struct ISL29125_data), GFP_KERNEL);
-	if(!ISL29125_data) {
-		PDEBUG("Failed when allocating ISL29125 data. \n");
-		return -ENOMEM;
-	}
-	
-	ISL29125_data->client = i2c_client;
-	
-	ISL29125_data->wq = create_workqueue("ISL29125_queue");
-	if(!ISL29125_data->wq) {
-		PDEBUG("Failed when creating workqueue. \n");
-		return -ENOMEM;
-	}
-	
-	INIT_WORK(&(ISL29125_data->w), isl_work_handler);
-	
 	// requesting irq number
-	if(!gpio_is_valid(INT_GPIO_NR)) {
-		PDEBUG("Invalid GPIO number %d. \n", INT_GPIO_NR);
+	if(!gpio_is_valid(irq_gpio)) {
+		PDEBUG("Invalid GPIO number %d. \n", irq_gpio);
 		return -ENOTTY;
 	}
 	
-	result = gpio_request(INT_GPIO_NR, INT_GPIO_LABEL);
+	result = gpio_request(irq_gpio, INT_GPIO_LABEL);
 	if(result < 0) {
 		PDEBUG("Failed when requesting %s. \n", INT_GPIO_LABEL);
 		return result;
 	}
 	
-	result = gpio_direction_input(INT_GPIO_NR);
+	result = gpio_direction_input(irq_gpio);
 	if(result < 0) {
 		PDEBUG("Failed when setting port diection. \n");
 		goto irq_fail;
 	}
 	
-	ISL29125_data->irq_nr = gpio_to_irq(INT_GPIO_NR);
+	ISL29125_data->irq_nr = gpio_to_irq(irq_gpio);
 	if(ISL29125_data->irq_nr < 0) {
-		PDEBUG("Could not get irq number of %d. \n", INT_GPIO_NR);
+		PDEBUG("Could not get irq number of %d. \n", irq_gpio);
 		result = ISL29125_data->irq_nr;
 		goto irq_fail;
 	}
 	
-	i2c_set_clientdata(i2c_client, ISL29125_data);
-	
 	// initializing interrupt state
-	result = i2c_smbus_read_byte_data(ISL29125_data->client, ST_FLG_REG);
+	i2c_xfer_begin(&ISL29125_xfer[XFER_IRQ]);
+	
+	result = i2c_xfer_read(ISL29125_data->client, ST_FLG_REG, &status, 1, &ISL29125_xfer[XFER_IRQ]);
 	if(result < 0) {
 		PDEBUG("Failed when reading the value of ST_FLG_REG. \n");
 		goto irq_fail;
@@ -197,7 +227,7 @@ int ISL29125_probe(struct i2c_client *i2c_client, const struct i2c_device_id *id
 	return 0;
 
 irq_fail:
-	gpio_free(INT_GPIO_NR);
+	gpio_free(irq_gpio);
 	
 	return result;
 }
@@ -211,16 +241,12 @@ int ISL29125_remove(struct i2c_client *i2c_client) {
 		return -ENOTTY;
 	}
 	
-	cancel_work_sync(&(ISL29125_data->w));	
-	flush_workqueue(ISL29125_data->wq);	
-	
-	mdelay(200);	
-	
-	destroy_workqueue(ISL29125_data->wq);
-	
+	// no new bottom half can be queued once the interrupt is released
 	free_irq(ISL29125_data->irq_nr, ISL29125_data);
 	
-	gpio_free(INT_GPIO_NR);
+	sensor_hub_cancel(&(ISL29125_data->w));
+	
+	gpio_free(irq_gpio);
 	
 	PDEBUG("ISL29125 removed. \n");
 	
@@ -243,12 +269,15 @@ static struct i2c_client *ISL29125_client;
 static int __init ISL29125_init(void) {	
 	int result;
 	
-	ISL29125_adpt = i2c_get_adapter(ADPT_NUM);
+	ISL29125_adpt = i2c_get_adapter(adapter);
 	if(!ISL29125_adpt) {
-		PDEBUG("I2C adapter number %d does not exist. \n", ADPT_NUM);
+		PDEBUG("I2C adapter number %d does not exist. \n", adapter);
 		return -ENODEV;
 	}
 	
+	// statistics are optional, the driver works without debugfs
+	ISL29125_debugfs = debugfs_create_dir("ISL29125", NULL);
+	
 	ISL29125_client = i2c_new_client_device(ISL29125_adpt, &ISL29125_info);
 	PDEBUG("ISL29125_client addr: %p", ISL29125_client);
 	
@@ -270,6 +299,8 @@ driver_fail:
 	i2c_unregister_device(ISL29125_client);
 	
 client_fail:
+	debugfs_remove_recursive(ISL29125_debugfs);
+	
 	i2c_put_adapter(ISL29125_adpt);
 		
 	return result;
@@ -280,6 +311,8 @@ static void __exit ISL29125_exit(void) {
 	
 	i2c_unregister_device(ISL29125_client);
 	
+	debugfs_remove_recursive(ISL29125_debugfs);
+	
 	i2c_put_adapter(ISL29125_adpt);
 	
 	PDEBUG("ISL29125 I2C driver unloaded. \n");
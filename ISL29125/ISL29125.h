@@ -14,6 +14,28 @@
 #include <linux/workqueue.h>
 #include <linux/jiffies.h>
 
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+
+#include "ISL29125_trace.h"
+
+struct i2c_xfer_stats;
+struct sensor_hub;
+
+void ISL29125_xfer_done(struct i2c_client *client, struct i2c_xfer_stats *stats, int msgs, u64 ns, int result);
+struct sensor_hub *ISL29125_hub(struct i2c_client *client);
+
+// every bus transaction feeds the device statistics and the isl29125_xfer event
+#define I2C_XFER_TRACE(client, stats, msgs, ns, result) ISL29125_xfer_done(client, stats, msgs, ns, result)
+#define I2C_XFER_TRACE_ON() true
+
+// and runs on the acquisition worker of the adapter once the hub is known
+#define I2C_XFER_HUB(client) ISL29125_hub(client)
+
+#include "i2c_xfer.h"
+#include "sensor_stats.h"
+#include "sensor_hub.h"
+
 #define DEBUG
 #ifdef DEBUG
 #	define PDEBUG(format, args...) printk(KERN_DEBUG "ISL29125: " format, ## args)
@@ -44,6 +66,10 @@
 #define DATA_REG_BL 0x0D
 #define DATA_REG_BH 0x0E
 
+// status flags followed by green and red data, read in one burst
+#define IRQ_READ_LEN 5
+#define NUM_INT_THR_REG 4
+
 #define DEFAULT_CONFG 0x00
 
 #define CONFG_MODE_G 0x01
@@ -74,6 +100,15 @@
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Testing interrupt line with ISL29125");
 
+// defaults match the BeagleBone wiring, i2c_sim reports its own numbers
+static int adapter = ADPT_NUM;
+static int irq_gpio = INT_GPIO_NR;
+
+module_param(adapter, int, 0444);
+MODULE_PARM_DESC(adapter, "Number of the I2C adapter the sensor is attached to");
+module_param(irq_gpio, int, 0444);
+MODULE_PARM_DESC(irq_gpio, "GPIO connected to the interrupt pin");
+
 static struct i2c_board_info ISL29125_info = {
 	I2C_BOARD_INFO("ISL29125", ISL29125_ADDR),
 };
@@ -85,11 +120,29 @@ static struct i2c_device_id ISL29125_id_table[] = {
 
 MODULE_DEVICE_TABLE(i2c, ISL29125_id_table);
 
+// bus transactions per operation, see i2c_xfer.h
+enum ISL29125_op {
+	XFER_CONFIG,
+	XFER_IRQ,
+};
+
+static struct i2c_xfer_stats ISL29125_xfer[] = {
+	[XFER_CONFIG] = I2C_XFER_OP("config"),
+	[XFER_IRQ] = I2C_XFER_OP("irq"),
+};
+
+I2C_XFER_STATS(ISL29125_xfer);
+
+// per-device counters under /sys/kernel/debug/ISL29125/<client>/stats
+static struct dentry *ISL29125_debugfs;
+
 struct ISL29125_data {
-	struct work_struct w;
-	struct workqueue_struct *wq;
+	struct sensor_hub_work w;
+	struct sensor_hub *hub;
 	struct i2c_client *client;
 	int irq_nr;
+	struct sensor_stats stats;
+	atomic64_t irq_time;	// oldest interrupt not served yet, 0 if none
 };	//only contain dynamically allocated data
 
 #endif
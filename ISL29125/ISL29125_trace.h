@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* Trace events of the ISL29125 driver, enabled through
+   /sys/kernel/tracing/events/isl29125/
+
+   Copyright (c) 2024,2024 Zixuan Qiao <zqiao104@uottawa.ca> */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM isl29125
+
+#if !defined(_ISL29125_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ISL29125_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// interrupt edge, logged from the hard irq handler
+TRACE_EVENT(isl29125_irq,
+	TP_PROTO(int irq),
+
+	TP_ARGS(irq),
+
+	TP_STRUCT__entry(
+		__field(int, irq)
+	),
+
+	TP_fast_assign(
+		__entry->irq = irq;
+	),
+
+	TP_printk("irq=%d", __entry->irq)
+);
+
+// start of the bottom half
+TRACE_EVENT(isl29125_work,
+	TP_PROTO(int irq),
+
+	TP_ARGS(irq),
+
+	TP_STRUCT__entry(
+		__field(int, irq)
+	),
+
+	TP_fast_assign(
+		__entry->irq = irq;
+	),
+
+	TP_printk("irq=%d", __entry->irq)
+);
+
+// one bus transaction, op is the i2c_xfer_stats name
+TRACE_EVENT(isl29125_xfer,
+	TP_PROTO(int adpt, u16 addr, const char *op, int msgs, u64 ns, int result),
+
+	TP_ARGS(adpt, addr, op, msgs, ns, result),
+
+	TP_STRUCT__entry(
+		__field(int, adpt)
+		__field(u16, addr)
+		__string(op, op)
+		__field(int, msgs)
+		__field(u64, ns)
+		__field(int, result)
+	),
+
+	TP_fast_assign(
+		__entry->adpt = adpt;
+		__entry->addr = addr;
+		__assign_str(op, op);
+		__entry->msgs = msgs;
+		__entry->ns = ns;
+		__entry->result = result;
+	),
+
+	TP_printk("adapter=%d addr=0x%02x op=%s msgs=%d ns=%llu result=%d",
+		__entry->adpt, __entry->addr, __get_str(op), __entry->msgs,
+		__entry->ns, __entry->result)
+);
+
+// status flags and data fetched by the bottom half
+TRACE_EVENT(isl29125_sample,
+	TP_PROTO(u8 status, u16 green, u16 red),
+
+	TP_ARGS(status, green, red),
+
+	TP_STRUCT__entry(
+		__field(u8, status)
+		__field(u16, green)
+		__field(u16, red)
+	),
+
+	TP_fast_assign(
+		__entry->status = status;
+		__entry->green = green;
+		__entry->red = red;
+	),
+
+	TP_printk("status=0x%02x green=%u red=%u",
+		__entry->status, __entry->green, __entry->red)
+);
+
+#endif
+
+// the header lives next to the driver, see CFLAGS_ISL29125.o
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ISL29125_trace
+#include <trace/define_trace.h>
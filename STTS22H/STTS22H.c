@@ -11,13 +11,50 @@
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/delay.h>
 #include <linux/i2c.h>
 #include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
 #include <linux/ioctl.h>
 #include <linux/mutex.h>
+#include <linux/kfifo.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#define CREATE_TRACE_POINTS
+#include "STTS22H_trace.h"
+
+struct i2c_xfer_stats;
+struct sensor_hub;
+
+static void STTS22H_xfer_done(struct i2c_client *client, 
+		struct i2c_xfer_stats *stats, int msgs, u64 ns, int result);
+static struct sensor_hub *STTS22H_hub(struct i2c_client *client);
+
+/* Every bus transaction feeds the device statistics and the trace */
+#define I2C_XFER_TRACE(client, stats, msgs, ns, result)			\
+	STTS22H_xfer_done(client, stats, msgs, ns, result)
+#define I2C_XFER_TRACE_ON() true
+
+/* and runs on the worker of the bus, reads and ioctls included */
+#define I2C_XFER_HUB(client) STTS22H_hub(client)
+
+#include "i2c_xfer.h"
+#include "sensor_stats.h"
+#include "sensor_hub.h"
 
 #define DEBUG
 #ifdef DEBUG
@@ -28,11 +65,77 @@
 
 #define WRITE_LEN 2
 #define READ_LEN 2
-#define MAX_ATTP 100
+#define BURST_LEN 3
+
+/*
+ * One-shot conversion wait in us, the estimate starts at CONV_INIT_US 
+ * and follows the measured conversion time, status is re-checked at 
+ * most MAX_RETRY times once it has elapsed
+ */
+#define CONV_INIT_US 2000
+#define CONV_MIN_US 500
+#define CONV_MAX_US 20000
+#define CONV_SLACK_US 200
+#define RETRY_US 250
+#define MAX_RETRY 20
+
+/* Number of samples buffered per file in streaming mode, power of 2 */
+#define STREAM_LEN 64
+
+/* Limit crossings buffered per file, power of 2 */
+#define EVENT_LEN 16
+#define ALERT_PERIOD_MS 1000
+
+/* Maximum number of devices in a sensor set */
+#define SET_MAX 128
+
+/* 
+ * Released devices are remembered for a while together with their 
+ * adapter reference and CTRL value, so reconfiguring a recently used 
+ * (adapter, address) pair skips the lookup and the validation
+ */
+#define RECENT_LEN 8
+#define RECENT_TTL_MS 10000
+
+/* Maximum number of entries returned by LIST_DEVS */
+#define LIST_MAX 1024
+
+/* 
+ * Compressed history, every chunk starts with a key frame (header) 
+ * followed by up to CHUNK_LEN bytes of codes, sized so that a whole 
+ * struct STTS22H_chunk is 512 bytes:
+ * 0x00 - 0x7F	one sample, 7-bit signed delta to the previous one
+ * 0x80 - 0xBF	1 to 64 samples equal to the previous one
+ * 0xC0 - 0xDF	1 to 32 periods without a sample
+ * 0xE0		one sample, absolute value in the next 2 bytes (LE)
+ */
+#define CHUNK_LEN 464
+#define CODE_RUN 0x80
+#define CODE_GAP 0xC0
+#define CODE_ABS 0xE0
+#define RUN_MAX 64
+#define GAP_MAX 32
+#define DELTA_MIN -64
+#define DELTA_MAX 63
+
+/* In-use (adapter, address) pairs are hashed on both */
+#define TABLE_BITS 6
+#define TABLE_KEY(adpt, addr) (((u32)(adpt) << 8) | (addr))
 
 #define PR_LIST _IO('S', 1)
 #define CHG_MODE _IOW('S', 2, int)
 #define CHG_ODR _IOW('S', 3, int)
+#define STREAM_CTL _IOW('S', 4, int)
+#define SET_LIMITS _IOW('S', 5, struct STTS22H_limits)
+#define GET_EVENT _IOR('S', 6, struct STTS22H_event)
+#define SET_ADD _IOW('S', 7, struct STTS22H_member)
+#define SET_READ _IOWR('S', 8, struct STTS22H_set_read)
+#define GET_CONV_STATS _IOR('S', 9, struct STTS22H_conv_stats)
+#define LIST_DEVS _IOWR('S', 10, struct STTS22H_list)
+#define SCAN _IOWR('S', 11, struct STTS22H_scan)
+#define CACHE_CTL _IOW('S', 12, int)
+#define HIST_CTL _IOW('S', 13, int)
+#define HIST_READ _IOWR('S', 14, struct STTS22H_hist_read)
 
 /* Register address */
 #define WHOAMI_REG 0x01
@@ -66,6 +169,19 @@
 #define ONE_SHOT_GET 0x01
 
 #define CONV_IN_PROG 0x01
+#define OVER_HIGH 0x02
+#define UNDER_LOW 0x04
+
+/* Limit register value = 63 + temperature / 0.64, 0 disables the limit */
+#define LIMIT_OFFSET 63
+#define LIMIT_STEP 64
+#define LIMIT_DIS 0x00
+
+#define LIMIT_HIGH_EN 0x01
+#define LIMIT_LOW_EN 0x02
+
+#define EVENT_HIGH 1
+#define EVENT_LOW 2
 
 enum mode {
 	one_shot = 0,
@@ -80,16 +196,295 @@ enum odr_rate {
 	HZ_200 = 3,
 };
 
+/* Record returned by read() in streaming mode */
+struct STTS22H_sample {
+	__s64 timestamp;	/* ktime_get_ns() when the sample was fetched */
+	__s16 temp;		/* in units of 0.01 degree Celsius */
+	__u16 reserved;
+	__u32 dropped;		/* samples lost to a full FIFO so far */
+};
+
+/* Argument of SET_LIMITS, thresholds in units of 0.01 degree Celsius */
+struct STTS22H_limits {
+	__s32 high;
+	__s32 low;
+	__u32 flags;		/* LIMIT_HIGH_EN | LIMIT_LOW_EN, 0 disables */
+};
+
+/* Limit crossing returned by GET_EVENT */
+struct STTS22H_event {
+	__s64 timestamp;
+	__s16 temp;
+	__u16 type;		/* EVENT_HIGH or EVENT_LOW */
+	__u32 reserved;
+};
+
+/* Argument of SET_ADD */
+struct STTS22H_member {
+	__s32 adpt;
+	__u32 addr;
+};
+
+/* One entry of the array filled by SET_READ */
+struct STTS22H_reading {
+	__s64 timestamp;
+	__s32 adpt;
+	__u16 addr;
+	__s16 temp;
+	__s32 error;		/* 0 or negative error code */
+	__u32 reserved;
+};
+
+/* Argument of SET_READ, count is updated to the number of readings */
+struct STTS22H_set_read {
+	__u64 readings;		/* user pointer to struct STTS22H_reading[] */
+	__u32 count;
+	__u32 reserved;
+};
+
+/* One entry of the array filled by LIST_DEVS */
+struct STTS22H_info {
+	__s64 last_sample;	/* ns, monotonic clock, 0 if never sampled */
+	__s32 adpt;
+	__u16 addr;
+	__u8 mode;
+	__u8 odr;
+	__u32 errors;		/* failed transfers and conversions */
+	__u32 timeouts;		/* one-shot conversions that never completed */
+};
+
+/* 
+ * Argument of LIST_DEVS, count is updated to the number of entries 
+ * filled and total to the number of devices in use 
+ */
+struct STTS22H_list {
+	__u64 entries;		/* user pointer to struct STTS22H_info[] */
+	__u32 count;
+	__u32 total;
+};
+
+/* One entry of the array filled by SCAN */
+struct STTS22H_found {
+	__s32 adpt;
+	__u16 addr;
+	__u8 in_use;		/* already bound to a file, not probed */
+	__u8 reserved;
+};
+
+/* 
+ * Argument of SCAN, count is updated to the number of entries filled 
+ * and total to the number of devices found 
+ */
+struct STTS22H_scan {
+	__u64 found;		/* user pointer to struct STTS22H_found[] */
+	__u32 count;
+	__u32 total;
+};
+
+/* Key frame of a history chunk, exported as is by HIST_READ */
+struct STTS22H_chunk_hdr {
+	__s64 start;		/* ns, monotonic clock, time of the key frame */
+	__u32 period;		/* us between two samples */
+	__s16 temp;		/* key frame sample */
+	__u16 len;		/* bytes of codes following the header */
+};
+
+/* 
+ * Argument of HIST_READ, len is updated to the number of bytes filled 
+ * (whole chunks, oldest first) and total to the size of the history 
+ */
+struct STTS22H_hist_read {
+	__u64 buf;		/* user pointer */
+	__u32 size;
+	__u32 len;
+	__u32 total;
+	__u32 reserved;
+};
+
+/* One-shot conversion statistics, returned by GET_CONV_STATS */
+struct STTS22H_conv_stats {
+	__u32 conv_us;		/* current conversion time estimate */
+	__u32 last_wait_us;	/* trigger to data ready, last conversion */
+	__u64 conversions;
+	__u64 total_wait_us;
+	__u64 retries;		/* status checks that found a conversion running */
+	__u64 timeouts;
+};
+
+struct STTS22H_chunk {
+	struct list_head list;
+	s64 next;		/* nominal time of the next sample */
+	s16 prev;		/* last sample encoded */
+	s16 run;		/* offset of the open run code, -1 if none */
+	struct STTS22H_chunk_hdr hdr;
+	u8 data[CHUNK_LEN];
+};
+
 struct STTS22H_data {
-	struct i2c_client *client;
-	struct list_head entry;
+	struct i2c_client *client;	/* points to i2c once configured */
+	struct i2c_client i2c;
+	struct sensor_hub *hub;		/* worker of the adapter, NULL if unbound */
+	struct hlist_node node;
+	struct rcu_head rcu;
 	struct mutex lock;
 	int mode;
+	int odr;
+	int adpt;
+	u8 addr;
+	u8 ctrl;		/* last value written to CTRL_REG */
+	
+	/* Inventory, read locklessly by LIST_DEVS */
+	s64 last_sample;
+	atomic_t errors;
+	
+	/* One-shot conversion, trigger time and calibrated wait */
+	ktime_t trigger;
+	u32 conv_us;
+	struct STTS22H_conv_stats stats;
+	
+	/* Per-CPU counters, listed in /sys/kernel/debug/STTS22H/stats */
+	struct sensor_stats counters;
+	
+	/* Non-blocking one-shot, the result is collected in the background */
+	bool pending;
+	bool ready;
+	int conv_retry;		/* status checks done by the work */
+	int conv_err;
+	u8 result[BURST_LEN];
+	struct hrtimer conv_timer;
+	struct sensor_hub_work conv_work;
+	
+	/* Devices of a sensor set, owned by this file */
+	struct STTS22H_data **set;
+	int set_len;
+	
+	/* 
+	 * Sampler shared by streaming and caching, the timer paces the 
+	 * worker at the ODR while either is on 
+	 */
+	bool streaming;
+	ktime_t period;
+	struct hrtimer timer;
+	struct sensor_hub_work work;
+	atomic64_t tick;	/* oldest tick not served yet, 0 if none */
+	struct mutex fifo_lock;
+	DECLARE_KFIFO(fifo, struct STTS22H_sample, STREAM_LEN);
+	wait_queue_head_t waitq;
+	u32 dropped;
+	
+	/* Cached mode, readers copy the last sample without any lock */
+	bool caching;
+	seqlock_t cache_lock;
+	s64 cache_time;		/* 0 until the first sample */
+	s16 cache_temp;
+	
+	/* Compressed history, low ODR mode only */
+	bool logging;
+	struct mutex hist_lock;
+	struct list_head hist;
+	struct STTS22H_chunk *hist_cur;
+	int hist_chunks;
+	
+	/* Limit alerts, status is checked at a low rate in the background */
+	bool alerts;
+	struct sensor_hub_work alert_work;
+	spinlock_t event_lock;
+	DECLARE_KFIFO(events, struct STTS22H_event, EVENT_LEN);
+};
+
+/* Lookups walk the table under RCU, the lock only covers insert/delete */
+static DEFINE_HASHTABLE(client_table, TABLE_BITS);
+static DEFINE_SPINLOCK(table_lock);
+
+/* Expires remembered adapters, device work runs on the sensor hub */
+static struct workqueue_struct *STTS22H_wq;
+
+/* Bus transactions per driver operation, see i2c_xfer.h */
+enum STTS22H_op {
+	XFER_CONFIG,
+	XFER_PROBE,
+	XFER_ONE_SHOT,
+	XFER_SAMPLE,
+	XFER_STATUS,
+};
+
+static struct i2c_xfer_stats STTS22H_xfer[] = {
+	[XFER_CONFIG] = I2C_XFER_OP("config"),
+	[XFER_PROBE] = I2C_XFER_OP("probe"),
+	[XFER_ONE_SHOT] = I2C_XFER_OP("one_shot"),
+	[XFER_SAMPLE] = I2C_XFER_OP("sample"),
+	[XFER_STATUS] = I2C_XFER_OP("status"),
+};
+
+I2C_XFER_STATS(STTS22H_xfer);
+
+static struct kmem_cache *STTS22H_cache;
+
+/* History chunks, the budget is accounted in objects of this cache */
+static struct kmem_cache *STTS22H_chunk_cache;
+
+static struct dentry *STTS22H_debugfs;
+
+struct STTS22H_recent {
+	struct i2c_adapter *adpt_ptr;	/* NULL if the slot is free */
+	int adpt;
+	u8 addr;
+	u8 ctrl;
+	unsigned long expires;
+};
+
+static struct STTS22H_recent recent[RECENT_LEN];
+static DEFINE_SPINLOCK(recent_lock);
+
+static void STTS22H_recent_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(recent_expire, STTS22H_recent_work);
+
+static unsigned int hist_kb = 256;
+module_param(hist_kb, uint, 0644);
+MODULE_PARM_DESC(hist_kb, "Memory budget of the low ODR history per device in KiB");
+
+/* Adapters are probed in parallel during a scan */
+static struct workqueue_struct *STTS22H_scan_wq;
+
+/* Addresses selectable through the ADDR pin */
+static const u8 STTS22H_addrs[] = {0x38, 0x3C, 0x3E, 0x3F};
+
+/* Per-adapter state of a scan */
+struct STTS22H_scan_job {
+	struct list_head list;
+	struct work_struct work;
+	struct i2c_client *client;	/* probing client, no device data */
 	int adpt;
+	u8 found;	/* bit i set if STTS22H_addrs[i] answered */
+	u8 in_use;	/* bit i set if STTS22H_addrs[i] is bound to a file */
 };
 
-static LIST_HEAD(client_list);
-static struct mutex list_lock;
+/*
+ * STTS22H_xfer_done - Account a bus transaction of i2c_xfer.h, clients 
+ * used by SCAN carry no device data
+ */
+static void STTS22H_xfer_done(struct i2c_client *client, 
+		struct i2c_xfer_stats *stats, int msgs, u64 ns, int result)
+{
+	struct STTS22H_data *STTS22H_data = i2c_get_clientdata(client);
+	
+	if (STTS22H_data)
+		sensor_stats_xfer(&STTS22H_data->counters, ns, result);
+	
+	trace_stts22h_xfer(client->adapter->nr, client->addr, 
+			stats ? stats->name : "", msgs, ns, result);
+}
+
+/*
+ * STTS22H_hub - Worker a bus transaction of i2c_xfer.h runs on, clients 
+ * used by SCAN and devices being unbound access the bus directly
+ */
+static struct sensor_hub *STTS22H_hub(struct i2c_client *client)
+{
+	struct STTS22H_data *STTS22H_data = i2c_get_clientdata(client);
+	
+	return STTS22H_data ? STTS22H_data->hub : NULL;
+}
 
 /*
  * config_register - Write value to a register and verify the result
@@ -99,202 +494,1332 @@ static int
 config_register(struct i2c_client *i2c_client, u8 reg_addr, u8 config)
 {
 	int res;
-	s32 data;
+	struct STTS22H_data *STTS22H_data = i2c_get_clientdata(i2c_client);
 	
-	res = i2c_smbus_write_byte_data(i2c_client, reg_addr, config);
-	if (res) {
-		PDEBUG(
-		"Failed when sending command to register: %02X\n", reg_addr);
-		return res;
-	}
+	/* Write and read-back share one transaction */
+	i2c_xfer_begin(&STTS22H_xfer[XFER_CONFIG]);
 	
-	data = i2c_smbus_read_byte_data(i2c_client, reg_addr);
-	if (data < 0) {
+	res = i2c_xfer_write_verify(i2c_client, reg_addr, &config, 1, 
+					&STTS22H_xfer[XFER_CONFIG]);
+	if (res == -EAGAIN) {
+		sensor_stats_inc(&STTS22H_data->counters, SENSOR_VERIFY_FAILS);
+		PDEBUG("Failed when initializing register: %02X\n", reg_addr);
+	} else if (res)
 		PDEBUG(
-		"Failed when reading the value of register: %02X\n", reg_addr);
-		return data;
+		"Failed when configuring register: %02X\n", reg_addr);
+	
+	return res;
+}
+
+/*
+ * STTS22H_in_use - Check whether an (adapter, address) pair is taken
+ * Return true if a file has configured the pair
+ */
+static bool STTS22H_in_use(int adpt_nr, u8 addr_nr)
+{
+	bool found = false;
+	struct STTS22H_data *entry;
+	
+	rcu_read_lock();
+	
+	hash_for_each_possible_rcu(client_table, entry, node, 
+					TABLE_KEY(adpt_nr, addr_nr)) {
+		if (entry->adpt == adpt_nr && entry->addr == addr_nr) {
+			found = true;
+			break;
+		}
 	}
 	
-	if ((u8)data != config) {
-		PDEBUG(
-		"Failed when initializing register: %02X, current value: %02X\n",
-							reg_addr, (u8)data);
-		return -EAGAIN;
+	rcu_read_unlock();
+	
+	return found;
+}
+
+/*
+ * STTS22H_recent_get - Take over the adapter reference of a recently 
+ * released device
+ * Return NULL if the pair is unknown or expired, the adapter otherwise
+ */
+static struct i2c_adapter *STTS22H_recent_get(int adpt_nr, u8 addr_nr, 
+								u8 *ctrl)
+{
+	int i;
+	struct i2c_adapter *adpt_ptr = NULL;
+	
+	spin_lock(&recent_lock);
+	
+	for (i = 0; i < RECENT_LEN; i++) {
+		if (recent[i].adpt_ptr && recent[i].adpt == adpt_nr 
+				&& recent[i].addr == addr_nr 
+				&& time_before(jiffies, recent[i].expires)) {
+			adpt_ptr = recent[i].adpt_ptr;
+			*ctrl = recent[i].ctrl;
+			recent[i].adpt_ptr = NULL;
+			break;
+		}
 	}
 	
-	return 0;
+	spin_unlock(&recent_lock);
+	
+	return adpt_ptr;
 }
 
 /*
- * STTS22H_write - Allow the user to setup the address and adapter
- * 		   number of an i2c cilent and perform validation
- * Return 0 on error, number of written bytes on success
+ * STTS22H_recent_put - Remember a released device, the least recently 
+ * released entry is evicted when all slots are taken
  */
-static ssize_t
-STTS22H_write(struct file *filp, const char __user *data,
-				size_t size, loff_t *loff)
+static void STTS22H_recent_put(struct i2c_adapter *adpt_ptr, int adpt_nr, 
+						u8 addr_nr, u8 ctrl)
 {
-	u8 addr_nr, config;
-	int adpt_nr;
-	s32 result;
-	struct STTS22H_data *STTS22H_data;
-	struct i2c_adapter *adpt_ptr;
-	char addr_adpt[WRITE_LEN + 1];
+	int i, victim;
+	struct i2c_adapter *evicted;
 	
-	if (sizeof(char) * WRITE_LEN != size) {
-		PDEBUG(
-		"Incorrect argument format, requires a len %d char array\n",
-								WRITE_LEN);
-		return 0;
+	spin_lock(&recent_lock);
+	
+	victim = 0;
+	for (i = 0; i < RECENT_LEN; i++) {
+		if (!recent[i].adpt_ptr) {
+			victim = i;
+			break;
+		}
+		
+		if (time_before(recent[i].expires, recent[victim].expires))
+			victim = i;
 	}
 	
-	addr_adpt[WRITE_LEN] = '\0';
+	evicted = recent[victim].adpt_ptr;
 	
-	if (copy_from_user(addr_adpt, data, WRITE_LEN)) {
-		PDEBUG("Copying failed\n");
-		return 0;
+	recent[victim].adpt_ptr = adpt_ptr;
+	recent[victim].adpt = adpt_nr;
+	recent[victim].addr = addr_nr;
+	recent[victim].ctrl = ctrl;
+	recent[victim].expires = jiffies + msecs_to_jiffies(RECENT_TTL_MS);
+	
+	spin_unlock(&recent_lock);
+	
+	if (evicted)
+		i2c_put_adapter(evicted);
+	
+	mod_delayed_work(STTS22H_wq, &recent_expire, 
+				msecs_to_jiffies(RECENT_TTL_MS));
+}
+
+/*
+ * STTS22H_recent_drop - Release adapter references of expired entries, 
+ * or of all entries if all is set
+ * Return true if entries are left
+ */
+static bool STTS22H_recent_drop(bool all)
+{
+	int i, nr = 0;
+	bool left = false;
+	struct i2c_adapter *expired[RECENT_LEN];
+	
+	spin_lock(&recent_lock);
+	
+	for (i = 0; i < RECENT_LEN; i++) {
+		if (!recent[i].adpt_ptr)
+			continue;
+		
+		if (all || !time_before(jiffies, recent[i].expires)) {
+			expired[nr++] = recent[i].adpt_ptr;
+			recent[i].adpt_ptr = NULL;
+		} else {
+			left = true;
+		}
 	}
 	
-	addr_nr = (u8)addr_adpt[0];
-	adpt_nr = (int)addr_adpt[1];
+	spin_unlock(&recent_lock);
 	
-	adpt_ptr = i2c_get_adapter(adpt_nr);
-	if (!adpt_ptr) {
-		PDEBUG("Invalid adapter number\n");
-		return 0;
+	/* Adapter references are dropped outside the spinlock */
+	for (i = 0; i < nr; i++)
+		i2c_put_adapter(expired[i]);
+	
+	return left;
+}
+
+/*
+ * STTS22H_recent_work - Expire remembered devices so that idle adapter 
+ * references do not pin adapter modules
+ */
+static void STTS22H_recent_work(struct work_struct *work)
+{
+	if (STTS22H_recent_drop(false))
+		queue_delayed_work(STTS22H_wq, &recent_expire, 
+				msecs_to_jiffies(RECENT_TTL_MS));
+}
+
+/*
+ * STTS22H_detach - Take a configured device off the table and drop 
+ * its client, called with the device lock held or on release. If keep 
+ * is set, the adapter reference is remembered for a later attach
+ */
+static void STTS22H_detach(struct STTS22H_data *STTS22H_data, bool keep)
+{
+	int adpt_nr;
+	
+	adpt_nr = STTS22H_data->adpt;
+	
+	if (adpt_nr != -1) {
+		spin_lock(&table_lock);
+		hash_del_rcu(&STTS22H_data->node);
+		spin_unlock(&table_lock);
+		
+		STTS22H_data->adpt = -1;
 	}
 	
-	if (mutex_lock_interruptible(&list_lock)) {
-		i2c_put_adapter(adpt_ptr);
-		PDEBUG("Cannot perform mutex locking, restart system\n");
-		return 0;
+	if (STTS22H_data->hub) {
+		sensor_hub_put(STTS22H_data->hub);
+		STTS22H_data->hub = NULL;
 	}
 	
-	if (!list_empty(&client_list)) {
-		list_for_each_entry(STTS22H_data, &client_list, entry) {
-			if (STTS22H_data->client->addr == addr_nr 
-					&& STTS22H_data->adpt == adpt_nr) {
-				mutex_unlock(&list_lock);
-				i2c_put_adapter(adpt_ptr);
-				PDEBUG(
-				"Device busy, try a different address/adapter\n");
-				return 0;
-			}
+	if (STTS22H_data->client) {
+		if (keep && adpt_nr != -1)
+			STTS22H_recent_put(STTS22H_data->client->adapter, 
+				adpt_nr, STTS22H_data->addr, STTS22H_data->ctrl);
+		else
+			i2c_put_adapter(STTS22H_data->client->adapter);
+		
+		STTS22H_data->client = NULL;
+	}
+}
+
+/*
+ * STTS22H_attach - Bind a device to an address and adapter number, 
+ * validate the chip and initialize it to one-shot mode
+ * Return error code on error, 0 on success
+ */
+static int
+STTS22H_attach(struct STTS22H_data *STTS22H_data, u8 addr_nr, int adpt_nr)
+{
+	u8 config, chip_id, cur = 0;
+	s32 result;
+	bool validated;
+	struct i2c_xfer_seg segs[2];
+	struct i2c_adapter *adpt_ptr;
+	
+	/* A recently released pair has been checked already */
+	adpt_ptr = STTS22H_recent_get(adpt_nr, addr_nr, &cur);
+	validated = adpt_ptr;
+	
+	if (!validated) {
+		adpt_ptr = i2c_get_adapter(adpt_nr);
+		if (!adpt_ptr) {
+			PDEBUG("Invalid adapter number\n");
+			return -ENODEV;
+		}
+		
+		/* Temperature is fetched with burst reads */
+		if (!i2c_check_functionality(adpt_ptr, 
+					I2C_FUNC_SMBUS_READ_I2C_BLOCK)) {
+			i2c_put_adapter(adpt_ptr);
+			PDEBUG("Adapter does not support I2C block reads\n");
+			return -EOPNOTSUPP;
 		}
 	}
 	
-	STTS22H_data = filp->private_data; 
+	/* Lock-free check first, most calls ask for a free pair */
+	if (STTS22H_in_use(adpt_nr, addr_nr)) {
+		i2c_put_adapter(adpt_ptr);
+		PDEBUG("Device busy, try a different address/adapter\n");
+		return -EBUSY;
+	}
 	
 	if (mutex_lock_interruptible(&STTS22H_data->lock)) {
-		mutex_unlock(&list_lock);
 		i2c_put_adapter(adpt_ptr);
 		PDEBUG("Cannot perform mutex locking, restart system\n");
-		return 0;
-	}	
-	
-	STTS22H_data->client = 
-	(struct i2c_client *)kzalloc(sizeof(struct i2c_client), GFP_KERNEL);
+		return -ERESTARTSYS;
+	}
 	
-	if (!STTS22H_data->client) {
+	if (STTS22H_data->client || STTS22H_data->set_len) {
 		mutex_unlock(&STTS22H_data->lock);
-		mutex_unlock(&list_lock);
 		i2c_put_adapter(adpt_ptr);
-		PDEBUG("No memory\n");
-		return 0;
+		PDEBUG("File already configured\n");
+		return -EEXIST;
 	}
 	
+	/* The client is embedded, configuring does not allocate */
+	STTS22H_data->client = &STTS22H_data->i2c;
 	STTS22H_data->client->addr = addr_nr;
 	STTS22H_data->client->adapter = adpt_ptr;
+	i2c_set_clientdata(STTS22H_data->client, STTS22H_data);
 	
-	/* The list behaves like a queue */
-	list_add_tail(&STTS22H_data->entry, &client_list);
+	STTS22H_data->addr = addr_nr;
 	
-	/* A non-negative adpt value indicates that the device is on list */
-	STTS22H_data->adpt = adpt_nr;
+	/* Background work of the device runs on the worker of its bus */
+	STTS22H_data->hub = sensor_hub_get(adpt_ptr);
+	if (IS_ERR(STTS22H_data->hub)) {
+		result = PTR_ERR(STTS22H_data->hub);
+		STTS22H_data->hub = NULL;
+		PDEBUG("Failed when getting sensor hub\n");
+		goto attach_fail;
+	}
 	
-	mutex_unlock(&list_lock);
+	/* Check again under the lock in case of a concurrent insert */
+	spin_lock(&table_lock);
 	
-	/* Check chip id */
-	result = i2c_smbus_read_byte_data(STTS22H_data->client, WHOAMI_REG);
-	if (result < 0) {
-		mutex_unlock(&STTS22H_data->lock);
-		PDEBUG("Failed when getting chip id\n");
-		return 0;
+	if (STTS22H_in_use(adpt_nr, addr_nr)) {
+		spin_unlock(&table_lock);
+		PDEBUG("Device busy, try a different address/adapter\n");
+		result = -EBUSY;
+		goto attach_fail;
 	}
 	
-	if ((u8)result != CHIP_ID) {
-		PDEBUG("Specified device is not STTS22H\n");
-		
-		/* Remove record from list */
-		if (mutex_lock_interruptible(&list_lock)) {
-			mutex_unlock(&STTS22H_data->lock);
-			PDEBUG(
-			"Cannot perform mutex locking, restart system\n");
-			return 0;
-		}
-		
-		list_del(&STTS22H_data->entry);
-		STTS22H_data->adpt = -1;
-		
-		mutex_unlock(&list_lock);
-		
-		kfree(STTS22H_data->client);
-		STTS22H_data->client = NULL;
+	/* A non-negative adpt value indicates that the device is on table */
+	STTS22H_data->adpt = adpt_nr;
+	
+	hash_add_rcu(client_table, &STTS22H_data->node, 
+					TABLE_KEY(adpt_nr, addr_nr));
+	
+	spin_unlock(&table_lock);
+	
+	if (!validated) {
+		/* Chip id and current config are read in one transaction */
+		segs[0].reg = WHOAMI_REG;
+		segs[0].len = 1;
+		segs[0].buf = &chip_id;
+		segs[1].reg = CTRL_REG;
+		segs[1].len = 1;
+		segs[1].buf = &cur;
 		
-		mutex_unlock(&STTS22H_data->lock);
+		i2c_xfer_begin(&STTS22H_xfer[XFER_PROBE]);
 		
-		i2c_put_adapter(adpt_ptr);
+		result = i2c_xfer_read_multi(STTS22H_data->client, segs, 2, 
+						&STTS22H_xfer[XFER_PROBE]);
+		if (result < 0) {
+			PDEBUG("Failed when getting chip id and config\n");
+			goto attach_fail;
+		}
 		
-		return 0;
+		if (chip_id != CHIP_ID) {
+			PDEBUG("Specified device is not STTS22H\n");
+			result = -ENODEV;
+			goto attach_fail;
+		}
 	}
 	
-	/* Initialize device to default mode (one-shot) */
-	result = i2c_smbus_read_byte_data(STTS22H_data->client, CTRL_REG);
-	if (result < 0) {
-		mutex_unlock(&STTS22H_data->lock);
-		PDEBUG(
-		"Failed when getting current config for initialization\n");
-		return 0;
+	/*
+	 * Initialize device to default mode (one-shot). Block data update 
+	 * keeps LSB and MSB from the same conversion, address 
+	 * auto-increment allows reading them in one transaction
+	 */
+	config = (cur & LOW_ODR_DIS & FREE_RUN_DIS) 
+				| BLK_DATA_UD | AUTO_ADDR_INC;
+	
+	/* A remembered device left in the default mode needs no access */
+	if (!validated || config != cur) {
+		result = config_register(STTS22H_data->client, CTRL_REG, 
+								config);
+		if (result < 0) {
+			PDEBUG(
+			"Failed when changing mode for initialization\n");
+			goto attach_fail;
+		}
 	}
 	
-	config = (u8)result & LOW_ODR_DIS & FREE_RUN_DIS;
+	STTS22H_data->ctrl = config;
+	STTS22H_data->odr = (config & ~ODR_CLEAR) >> 4;
 	
-	result = config_register(STTS22H_data->client, CTRL_REG, config);
-	if (result < 0) {
-		mutex_unlock(&STTS22H_data->lock);
-		PDEBUG("Failed when changing mode for initialization\n");
-		return 0;
-	}
+	mutex_unlock(&STTS22H_data->lock);
+	
+	return 0;
+	
+attach_fail:
+	STTS22H_detach(STTS22H_data, false);
 	
 	mutex_unlock(&STTS22H_data->lock);
 	
-	return WRITE_LEN * sizeof(char);
+	return result;
 }
 
 /*
- * STTS22H_read - Obtain temperature data based on current operation mode 
- * Return 0 on error, number of read bytes on success
+ * STTS22H_write - Allow the user to setup the address and adapter
+ * 		   number of an i2c cilent and perform validation
+ * Return 0 on error, number of written bytes on success
  */
 static ssize_t
-STTS22H_read(struct file *filp, char __user *buff, size_t size, loff_t *loff)
+STTS22H_write(struct file *filp, const char __user *data,
+				size_t size, loff_t *loff)
 {
-	u8 config;
-	s32 result;
-	int counter;
-	char data[READ_LEN + 1];
 	struct STTS22H_data *STTS22H_data;
+	char addr_adpt[WRITE_LEN + 1];
 	
-	if (READ_LEN * sizeof(char) > size) {
+	if (sizeof(char) * WRITE_LEN != size) {
 		PDEBUG(
-		"Insufficient buffer size, requires a len %d char array\n",
-								READ_LEN);
+		"Incorrect argument format, requires a len %d char array\n",
+								WRITE_LEN);
 		return 0;
 	}
 	
-	STTS22H_data = filp->private_data;
+	addr_adpt[WRITE_LEN] = '\0';
 	
-	if (mutex_lock_interruptible(&STTS22H_data->lock)) {
-		PDEBUG("Cannot perform mutex locking, restart system\n");
+	if (copy_from_user(addr_adpt, data, WRITE_LEN)) {
+		PDEBUG("Copying failed\n");
+		return 0;
+	}
+	
+	STTS22H_data = filp->private_data; 
+	
+	if (STTS22H_attach(STTS22H_data, (u8)addr_adpt[0], (int)addr_adpt[1]))
+		return 0;
+	
+	return WRITE_LEN * sizeof(char);
+}
+
+/*
+ * STTS22H_conv_check - Fetch status and data once the estimated 
+ * conversion time has elapsed, retry is the number of earlier checks. 
+ * Refine the estimate when done, called with the device lock held
+ * Return -EINPROGRESS while converting, error code on error, 0 on success
+ */
+static int
+STTS22H_conv_check(struct STTS22H_data *STTS22H_data, u8 *burst, int retry)
+{
+	s32 result;
+	s64 elapsed;
+	u32 conv, target;
+	
+	result = i2c_xfer_read(STTS22H_data->client, STATUS_REG, 
+			burst, BURST_LEN, &STTS22H_xfer[XFER_ONE_SHOT]);
+	if (result < 0) {
+		atomic_inc(&STTS22H_data->errors);
+		sensor_stats_add(&STTS22H_data->counters, 
+					SENSOR_RETRIES, retry);
+		trace_stts22h_conv_wait(STTS22H_data->adpt, 
+			STTS22H_data->addr, ktime_us_delta(ktime_get(), 
+			STTS22H_data->trigger), retry, result);
+		return result;
+	}
+	
+	if (burst[0] & CONV_IN_PROG) {
+		if (retry < MAX_RETRY)
+			return -EINPROGRESS;
+		
+		atomic_inc(&STTS22H_data->errors);
+		STTS22H_data->stats.retries += retry;
+		STTS22H_data->stats.timeouts++;
+		sensor_stats_add(&STTS22H_data->counters, 
+					SENSOR_RETRIES, retry);
+		trace_stts22h_conv_wait(STTS22H_data->adpt, 
+			STTS22H_data->addr, ktime_us_delta(ktime_get(), 
+			STTS22H_data->trigger), retry, -ETIMEDOUT);
+		return -ETIMEDOUT;
+	}
+	
+	WRITE_ONCE(STTS22H_data->last_sample, ktime_get_ns());
+	
+	conv = STTS22H_data->conv_us;
+	elapsed = ktime_us_delta(ktime_get(), STTS22H_data->trigger);
+	
+	trace_stts22h_conv_wait(STTS22H_data->adpt, STTS22H_data->addr, 
+							elapsed, retry, 0);
+	
+	STTS22H_data->stats.conversions++;
+	STTS22H_data->stats.retries += retry;
+	sensor_stats_add(&STTS22H_data->counters, SENSOR_RETRIES, retry);
+	STTS22H_data->stats.total_wait_us += elapsed;
+	STTS22H_data->stats.last_wait_us = (u32)elapsed;
+	
+	/* 
+	 * Ready on the first check only bounds the conversion time from 
+	 * above, so probe a slightly shorter wait next time 
+	 */
+	target = retry ? (u32)elapsed : conv - conv / 16;
+	conv = conv - conv / 8 + target / 8;
+	
+	STTS22H_data->conv_us = clamp_t(u32, conv, CONV_MIN_US, CONV_MAX_US);
+	
+	return 0;
+}
+
+/*
+ * STTS22H_conv_wait - Sleep until the estimated conversion time has 
+ * elapsed since the trigger, then check with a bounded number of 
+ * re-checks. User context only, the status reads run on the hub but 
+ * the sleeps do not, called with the device lock held
+ * Return error code on error, 0 on success
+ */
+static int STTS22H_conv_wait(struct STTS22H_data *STTS22H_data, u8 *burst)
+{
+	int retry, result;
+	s64 remain;
+	
+	remain = STTS22H_data->conv_us 
+		- ktime_us_delta(ktime_get(), STTS22H_data->trigger);
+	if (remain > 0)
+		usleep_range(remain, remain + CONV_SLACK_US);
+	
+	for (retry = 0; ; retry++) {
+		result = STTS22H_conv_check(STTS22H_data, burst, retry);
+		if (result != -EINPROGRESS)
+			return result;
+		
+		usleep_range(RETRY_US, 2 * RETRY_US);
+	}
+}
+
+/*
+ * STTS22H_check_limits - Queue an event for every limit flag raised 
+ * in a STATUS, TEMP_L, TEMP_H burst, the flags clear on read
+ */
+static void STTS22H_check_limits(struct STTS22H_data *STTS22H_data, u8 *burst)
+{
+	struct STTS22H_event event;
+	
+	if (!(burst[0] & (OVER_HIGH | UNDER_LOW)))
+		return;
+	
+	event.timestamp = ktime_get_ns();
+	event.temp = (s16)(burst[1] | (burst[2] << 8));
+	event.reserved = 0;
+	
+	if (burst[0] & OVER_HIGH) {
+		event.type = EVENT_HIGH;
+		kfifo_in_spinlocked(&STTS22H_data->events, &event, 1, 
+						&STTS22H_data->event_lock);
+	}
+	
+	if (burst[0] & UNDER_LOW) {
+		event.type = EVENT_LOW;
+		kfifo_in_spinlocked(&STTS22H_data->events, &event, 1, 
+						&STTS22H_data->event_lock);
+	}
+	
+	wake_up_interruptible(&STTS22H_data->waitq);
+}
+
+/*
+ * STTS22H_alert_work - Low rate status check while limits are enabled
+ */
+static void STTS22H_alert_work(struct sensor_hub_work *work)
+{
+	s32 result;
+	u8 burst[BURST_LEN];
+	struct STTS22H_data *STTS22H_data;
+	
+	STTS22H_data = container_of(work, struct STTS22H_data, alert_work);
+	
+	/* Skip this round if the device is busy, the flags are latched */
+	if (mutex_trylock(&STTS22H_data->lock)) {
+		if (STTS22H_data->client) {
+			i2c_xfer_begin(&STTS22H_xfer[XFER_STATUS]);
+			
+			result = i2c_xfer_read(STTS22H_data->client, STATUS_REG, 
+				burst, BURST_LEN, &STTS22H_xfer[XFER_STATUS]);
+			if (!result) {
+				STTS22H_check_limits(STTS22H_data, burst);
+			} else {
+				atomic_inc(&STTS22H_data->errors);
+				PDEBUG("Failed when checking limit status\n");
+			}
+		}
+		
+		mutex_unlock(&STTS22H_data->lock);
+	}
+	
+	if (READ_ONCE(STTS22H_data->alerts))
+		sensor_hub_queue(STTS22H_data->hub, &STTS22H_data->alert_work, 
+					msecs_to_jiffies(ALERT_PERIOD_MS));
+}
+
+/*
+ * limit_to_reg - Convert a threshold to the limit register format
+ * Return error code on error, register value on success
+ */
+static int limit_to_reg(s32 limit)
+{
+	int reg;
+	
+	reg = DIV_ROUND_CLOSEST(limit, LIMIT_STEP) + LIMIT_OFFSET;
+	if (reg < 1 || reg > 0xFF)
+		return -EINVAL;
+	
+	return reg;
+}
+
+/*
+ * STTS22H_sampling - Check whether any consumer needs the sampler
+ */
+static bool STTS22H_sampling(struct STTS22H_data *STTS22H_data)
+{
+	return READ_ONCE(STTS22H_data->streaming) 
+		|| READ_ONCE(STTS22H_data->caching) 
+		|| READ_ONCE(STTS22H_data->logging);
+}
+
+/*
+ * STTS22H_hist_add - Append one sample to the compressed history, a new 
+ * chunk is started when the current one is full or after a long gap, 
+ * the oldest chunk is recycled once the memory budget is used up
+ */
+static void 
+STTS22H_hist_add(struct STTS22H_data *STTS22H_data, s64 time, s16 temp)
+{
+	int delta;
+	s64 period, ticks;
+	struct STTS22H_chunk *chunk;
+	
+	period = ktime_to_ns(STTS22H_data->period);
+	
+	mutex_lock(&STTS22H_data->hist_lock);
+	
+	chunk = STTS22H_data->hist_cur;
+	ticks = 0;
+	
+	if (chunk) {
+		/* Missed periods since the last sample */
+		ticks = div64_s64(time - chunk->next + period / 2, period);
+		if (ticks < 0)
+			ticks = 0;
+		
+		/* Worst case is a gap code and an absolute sample */
+		if (ticks > GAP_MAX || chunk->hdr.len + 4 > CHUNK_LEN)
+			chunk = NULL;
+	}
+	
+	if (!chunk) {
+		if (STTS22H_data->hist_chunks 
+			* kmem_cache_size(STTS22H_chunk_cache) 
+					< (size_t)READ_ONCE(hist_kb) * 1024)
+			chunk = kmem_cache_alloc(STTS22H_chunk_cache, 
+								GFP_KERNEL);
+		
+		if (chunk) {
+			STTS22H_data->hist_chunks++;
+		} else if (!list_empty(&STTS22H_data->hist)) {
+			chunk = list_first_entry(&STTS22H_data->hist, 
+						struct STTS22H_chunk, list);
+			list_del(&chunk->list);
+		} else {
+			mutex_unlock(&STTS22H_data->hist_lock);
+			return;
+		}
+		
+		chunk->hdr.start = time;
+		chunk->hdr.period = (u32)div64_s64(period, NSEC_PER_USEC);
+		chunk->hdr.temp = temp;
+		chunk->hdr.len = 0;
+		chunk->prev = temp;
+		chunk->run = -1;
+		chunk->next = time + period;
+		
+		list_add_tail(&chunk->list, &STTS22H_data->hist);
+		STTS22H_data->hist_cur = chunk;
+		
+		mutex_unlock(&STTS22H_data->hist_lock);
+		return;
+	}
+	
+	if (ticks) {
+		chunk->data[chunk->hdr.len++] = CODE_GAP | (u8)(ticks - 1);
+		chunk->run = -1;
+	}
+	
+	delta = temp - chunk->prev;
+	
+	if (!delta) {
+		if (chunk->run >= 0 
+			&& (chunk->data[chunk->run] & ~CODE_RUN) < RUN_MAX - 1) {
+			chunk->data[chunk->run]++;
+		} else {
+			chunk->run = chunk->hdr.len;
+			chunk->data[chunk->hdr.len++] = CODE_RUN;
+		}
+	} else if (delta >= DELTA_MIN && delta <= DELTA_MAX) {
+		chunk->data[chunk->hdr.len++] = (u8)delta & 0x7F;
+		chunk->run = -1;
+	} else {
+		chunk->data[chunk->hdr.len++] = CODE_ABS;
+		chunk->data[chunk->hdr.len++] = (u8)temp;
+		chunk->data[chunk->hdr.len++] = (u8)((u16)temp >> 8);
+		chunk->run = -1;
+	}
+	
+	chunk->prev = temp;
+	chunk->next += (ticks + 1) * period;
+	
+	mutex_unlock(&STTS22H_data->hist_lock);
+}
+
+/*
+ * STTS22H_stream_timer - Fires once per output data period and hands 
+ * the bus access over to the worker
+ */
+static enum hrtimer_restart STTS22H_stream_timer(struct hrtimer *timer)
+{
+	struct STTS22H_data *STTS22H_data;
+	
+	STTS22H_data = container_of(timer, struct STTS22H_data, timer);
+	
+	if (!STTS22H_sampling(STTS22H_data))
+		return HRTIMER_NORESTART;
+	
+	sensor_stats_inc(&STTS22H_data->counters, SENSOR_IRQS);
+	
+	/* A tick arriving while the previous one is queued is merged */
+	atomic64_cmpxchg(&STTS22H_data->tick, 0, ktime_get_ns());
+	
+	if (!sensor_hub_queue(STTS22H_data->hub, &STTS22H_data->work, 0))
+		sensor_stats_inc(&STTS22H_data->counters, SENSOR_COALESCED);
+	
+	hrtimer_forward_now(timer, STTS22H_data->period);
+	
+	return HRTIMER_RESTART;
+}
+
+/*
+ * STTS22H_stream_work - Fetch one sample, push it into the FIFO and/or 
+ * publish it as the cached sample, a tick is skipped if the device is 
+ * being reconfigured
+ */
+static void STTS22H_stream_work(struct sensor_hub_work *work)
+{
+	s32 result;
+	s64 tick;
+	bool delivered = false;
+	u8 data[READ_LEN];
+	struct STTS22H_sample sample;
+	struct STTS22H_data *STTS22H_data;
+	
+	STTS22H_data = container_of(work, struct STTS22H_data, work);
+	
+	trace_stts22h_work(STTS22H_data->adpt, STTS22H_data->addr, "sample");
+	
+	tick = atomic64_xchg(&STTS22H_data->tick, 0);
+	
+	if (!mutex_trylock(&STTS22H_data->lock)) {
+		sensor_stats_inc(&STTS22H_data->counters, SENSOR_DROPPED);
+		return;
+	}
+	
+	if (!STTS22H_data->client || !STTS22H_sampling(STTS22H_data)) {
+		mutex_unlock(&STTS22H_data->lock);
+		return;
+	}
+	
+	i2c_xfer_begin(&STTS22H_xfer[XFER_SAMPLE]);
+	
+	result = i2c_xfer_read(STTS22H_data->client, TEMP_LSB_REG, 
+				data, READ_LEN, &STTS22H_xfer[XFER_SAMPLE]);
+	
+	mutex_unlock(&STTS22H_data->lock);
+	
+	if (result < 0) {
+		atomic_inc(&STTS22H_data->errors);
+		sensor_stats_inc(&STTS22H_data->counters, SENSOR_DROPPED);
+		PDEBUG("Failed when getting streaming data\n");
+		return;
+	}
+	
+	sample.timestamp = ktime_get_ns();
+	WRITE_ONCE(STTS22H_data->last_sample, sample.timestamp);
+	sample.temp = (s16)(data[0] | (data[1] << 8));
+	sample.reserved = 0;
+	sample.dropped = STTS22H_data->dropped;
+	
+	if (READ_ONCE(STTS22H_data->caching)) {
+		write_seqlock(&STTS22H_data->cache_lock);
+		STTS22H_data->cache_time = sample.timestamp;
+		STTS22H_data->cache_temp = sample.temp;
+		write_sequnlock(&STTS22H_data->cache_lock);
+		
+		trace_stts22h_deliver(STTS22H_data->adpt, STTS22H_data->addr, 
+							sample.temp, "cache");
+		delivered = true;
+	}
+	
+	if (READ_ONCE(STTS22H_data->logging)) {
+		STTS22H_hist_add(STTS22H_data, sample.timestamp, sample.temp);
+		
+		trace_stts22h_deliver(STTS22H_data->adpt, STTS22H_data->addr, 
+							sample.temp, "history");
+		delivered = true;
+	}
+	
+	/* Single producer, no locking needed against the reader */
+	if (READ_ONCE(STTS22H_data->streaming)) {
+		if (kfifo_put(&STTS22H_data->fifo, sample)) {
+			trace_stts22h_deliver(STTS22H_data->adpt, 
+				STTS22H_data->addr, sample.temp, "fifo");
+			delivered = true;
+		} else {
+			STTS22H_data->dropped++;
+			sensor_stats_inc(&STTS22H_data->counters, 
+							SENSOR_DROPPED);
+		}
+	}
+	
+	if (delivered) {
+		sensor_stats_inc(&STTS22H_data->counters, SENSOR_SAMPLES);
+		
+		if (tick)
+			sensor_stats_hist(&STTS22H_data->counters, 
+				SENSOR_LATENCY_NS, sample.timestamp - tick);
+	}
+	
+	wake_up_interruptible(&STTS22H_data->waitq);
+}
+
+/*
+ * STTS22H_sampler_start - Compute the sampling period from mode and ODR 
+ * and start the timer if it is not running yet
+ * Called with the device lock held
+ * Return error code on error, 0 on success
+ */
+static int STTS22H_sampler_start(struct STTS22H_data *STTS22H_data)
+{
+	u64 period;
+	
+	switch (STTS22H_data->mode) {
+	case free_run:
+		period = NSEC_PER_SEC / (25 << STTS22H_data->odr);
+		break;
+		
+	case low_odr:
+		period = NSEC_PER_SEC;
+		break;
+		
+	default:
+		PDEBUG("Sampling requires free-run or low ODR mode\n");
+		return -EINVAL;
+	}
+	
+	STTS22H_data->period = ns_to_ktime(period);
+	
+	if (!hrtimer_active(&STTS22H_data->timer))
+		hrtimer_start(&STTS22H_data->timer, STTS22H_data->period, 
+							HRTIMER_MODE_REL);
+	
+	return 0;
+}
+
+/*
+ * STTS22H_sampler_stop - Stop the timer and worker once no consumer 
+ * is left, must not be called with the device lock held since the 
+ * worker may be waiting on it
+ */
+static void STTS22H_sampler_stop(struct STTS22H_data *STTS22H_data)
+{
+	if (STTS22H_sampling(STTS22H_data))
+		return;
+	
+	hrtimer_cancel(&STTS22H_data->timer);
+	sensor_hub_cancel(&STTS22H_data->work);
+}
+
+/*
+ * STTS22H_stream_start - Start streaming at the configured ODR
+ * Called with the device lock held
+ * Return error code on error, 0 on success
+ */
+static int STTS22H_stream_start(struct STTS22H_data *STTS22H_data)
+{
+	int result;
+	
+	if (STTS22H_data->streaming)
+		return 0;
+	
+	STTS22H_data->dropped = 0;
+	kfifo_reset(&STTS22H_data->fifo);
+	
+	WRITE_ONCE(STTS22H_data->streaming, true);
+	
+	result = STTS22H_sampler_start(STTS22H_data);
+	if (result)
+		WRITE_ONCE(STTS22H_data->streaming, false);
+	
+	return result;
+}
+
+/*
+ * STTS22H_stream_stop - Stop streaming, must not be called with 
+ * the device lock held since the worker may be waiting on it
+ */
+static void STTS22H_stream_stop(struct STTS22H_data *STTS22H_data)
+{
+	if (!READ_ONCE(STTS22H_data->streaming))
+		return;
+	
+	WRITE_ONCE(STTS22H_data->streaming, false);
+	
+	STTS22H_sampler_stop(STTS22H_data);
+	
+	/* Let blocked readers notice */
+	wake_up_interruptible(&STTS22H_data->waitq);
+}
+
+/*
+ * STTS22H_cache_start - Keep a cached sample refreshed at the 
+ * configured ODR, called with the device lock held
+ * Return error code on error, 0 on success
+ */
+static int STTS22H_cache_start(struct STTS22H_data *STTS22H_data)
+{
+	int result;
+	
+	if (STTS22H_data->caching)
+		return 0;
+	
+	write_seqlock(&STTS22H_data->cache_lock);
+	STTS22H_data->cache_time = 0;
+	write_sequnlock(&STTS22H_data->cache_lock);
+	
+	WRITE_ONCE(STTS22H_data->caching, true);
+	
+	result = STTS22H_sampler_start(STTS22H_data);
+	if (result)
+		WRITE_ONCE(STTS22H_data->caching, false);
+	
+	return result;
+}
+
+/*
+ * STTS22H_cache_stop - Stop refreshing the cached sample, must not be 
+ * called with the device lock held
+ */
+static void STTS22H_cache_stop(struct STTS22H_data *STTS22H_data)
+{
+	if (!READ_ONCE(STTS22H_data->caching))
+		return;
+	
+	WRITE_ONCE(STTS22H_data->caching, false);
+	
+	STTS22H_sampler_stop(STTS22H_data);
+	
+	wake_up_interruptible(&STTS22H_data->waitq);
+}
+
+/*
+ * STTS22H_hist_start - Start logging, the first sample opens a new 
+ * chunk, called with the device lock held
+ * Return error code on error, 0 on success
+ */
+static int STTS22H_hist_start(struct STTS22H_data *STTS22H_data)
+{
+	int result;
+	
+	if (STTS22H_data->mode != low_odr) {
+		PDEBUG("History requires low ODR mode\n");
+		return -EINVAL;
+	}
+	
+	if (STTS22H_data->logging)
+		return 0;
+	
+	mutex_lock(&STTS22H_data->hist_lock);
+	STTS22H_data->hist_cur = NULL;
+	mutex_unlock(&STTS22H_data->hist_lock);
+	
+	WRITE_ONCE(STTS22H_data->logging, true);
+	
+	result = STTS22H_sampler_start(STTS22H_data);
+	if (result)
+		WRITE_ONCE(STTS22H_data->logging, false);
+	
+	return result;
+}
+
+/*
+ * STTS22H_hist_stop - Stop logging, the history is kept until release, 
+ * must not be called with the device lock held
+ */
+static void STTS22H_hist_stop(struct STTS22H_data *STTS22H_data)
+{
+	if (!READ_ONCE(STTS22H_data->logging))
+		return;
+	
+	WRITE_ONCE(STTS22H_data->logging, false);
+	
+	STTS22H_sampler_stop(STTS22H_data);
+}
+
+/*
+ * STTS22H_hist_copy - Copy whole chunks, oldest first, as long as they 
+ * fit in size bytes of buf, or only measure them if buf is NULL. Called 
+ * with hist_lock held
+ * Return number of bytes of the chunks that fit, total is set to the 
+ * size of the history
+ */
+static u32 STTS22H_hist_copy(struct STTS22H_data *STTS22H_data, u8 *buf, 
+						u32 size, u32 *total)
+{
+	u32 len = 0, chunk_size;
+	struct STTS22H_chunk *chunk;
+	
+	*total = 0;
+	
+	list_for_each_entry(chunk, &STTS22H_data->hist, list) {
+		chunk_size = sizeof(struct STTS22H_chunk_hdr) + chunk->hdr.len;
+		
+		/* Stop at the first chunk that does not fit, keeps order */
+		if (len == *total && len + chunk_size <= size) {
+			if (buf) {
+				memcpy(buf + len, &chunk->hdr, 
+					sizeof(struct STTS22H_chunk_hdr));
+				memcpy(buf + len + sizeof(struct STTS22H_chunk_hdr), 
+						chunk->data, chunk->hdr.len);
+			}
+			
+			len += chunk_size;
+		}
+		
+		*total += chunk_size;
+	}
+	
+	return len;
+}
+
+/*
+ * STTS22H_hist_read - Export the compressed history, whole chunks 
+ * oldest first, each one as a header followed by its codes. The chunks 
+ * are copied to a kernel buffer under hist_lock and to user space after 
+ * dropping it, the sampler takes the lock on the worker of the bus
+ * Return error code on error, 0 on success
+ */
+static int STTS22H_hist_read(struct STTS22H_data *STTS22H_data, 
+							unsigned long buff)
+{
+	int result = 0;
+	u32 cap;
+	u8 *buf = NULL;
+	struct STTS22H_hist_read req;
+	
+	if (copy_from_user(&req, (struct STTS22H_hist_read *)buff, 
+					sizeof(struct STTS22H_hist_read))) {
+		PDEBUG("Copying from user failed\n");
+		return -EFAULT;
+	}
+	
+	/* 
+	 * Size the buffer first, with room for the open chunk to grow and 
+	 * one more to start before the copy 
+	 */
+	mutex_lock(&STTS22H_data->hist_lock);
+	cap = STTS22H_hist_copy(STTS22H_data, NULL, req.size, &req.total);
+	mutex_unlock(&STTS22H_data->hist_lock);
+	
+	cap = min_t(u32, req.size, 
+		cap + 2 * (sizeof(struct STTS22H_chunk_hdr) + CHUNK_LEN));
+	
+	if (cap) {
+		buf = kvmalloc(cap, GFP_KERNEL);
+		if (!buf) {
+			PDEBUG("Failed when allocating history buffer\n");
+			return -ENOMEM;
+		}
+	}
+	
+	mutex_lock(&STTS22H_data->hist_lock);
+	req.len = STTS22H_hist_copy(STTS22H_data, buf, cap, &req.total);
+	mutex_unlock(&STTS22H_data->hist_lock);
+	
+	if (copy_to_user(u64_to_user_ptr(req.buf), buf, req.len) 
+		|| copy_to_user((struct STTS22H_hist_read *)buff, &req, 
+					sizeof(struct STTS22H_hist_read))) {
+		PDEBUG("Copying to user failed\n");
+		result = -EFAULT;
+	}
+	
+	kvfree(buf);
+	
+	return result;
+}
+
+/*
+ * STTS22H_cache_read - Copy the cached sample, neither the device lock 
+ * nor the bus is touched. Blocks until the first sample unless 
+ * nonblock is set
+ * Return error code on error, number of read bytes on success
+ */
+static ssize_t
+STTS22H_cache_read(struct STTS22H_data *STTS22H_data, struct iov_iter *to, 
+							bool nonblock)
+{
+	s64 time;
+	s16 temp;
+	unsigned int seq;
+	u8 data[READ_LEN];
+	
+	if (iov_iter_count(to) < READ_LEN * sizeof(char))
+		return -EINVAL;
+	
+	for (;;) {
+		do {
+			seq = read_seqbegin(&STTS22H_data->cache_lock);
+			time = STTS22H_data->cache_time;
+			temp = STTS22H_data->cache_temp;
+		} while (read_seqretry(&STTS22H_data->cache_lock, seq));
+		
+		if (time)
+			break;
+		
+		if (!READ_ONCE(STTS22H_data->caching))
+			return 0;
+		
+		if (nonblock)
+			return -EAGAIN;
+		
+		if (wait_event_interruptible(STTS22H_data->waitq, 
+				READ_ONCE(STTS22H_data->cache_time) 
+				|| !READ_ONCE(STTS22H_data->caching)))
+			return -ERESTARTSYS;
+	}
+	
+	data[0] = (u8)temp;
+	data[1] = (u8)((u16)temp >> 8);
+	
+	if (copy_to_iter(data, READ_LEN * sizeof(char), to) 
+					!= READ_LEN * sizeof(char))
+		return -EFAULT;
+	
+	return READ_LEN * sizeof(char);
+}
+
+/*
+ * STTS22H_stream_read - Copy as many buffered samples as fit in the 
+ * user buffer, blocks until one is available unless nonblock is set
+ * Return error code on error, number of read bytes on success
+ */
+static ssize_t
+STTS22H_stream_read(struct STTS22H_data *STTS22H_data, struct iov_iter *to, 
+							bool nonblock)
+{
+	size_t copied;
+	struct STTS22H_sample sample;
+	
+	if (iov_iter_count(to) < sizeof(struct STTS22H_sample))
+		return -EINVAL;
+	
+	if (mutex_lock_interruptible(&STTS22H_data->fifo_lock))
+		return -ERESTARTSYS;
+	
+	while (kfifo_is_empty(&STTS22H_data->fifo)) {
+		mutex_unlock(&STTS22H_data->fifo_lock);
+		
+		if (!READ_ONCE(STTS22H_data->streaming))
+			return 0;
+		
+		if (nonblock)
+			return -EAGAIN;
+		
+		if (wait_event_interruptible(STTS22H_data->waitq, 
+			!kfifo_is_empty(&STTS22H_data->fifo) 
+				|| !READ_ONCE(STTS22H_data->streaming)))
+			return -ERESTARTSYS;
+		
+		if (mutex_lock_interruptible(&STTS22H_data->fifo_lock))
+			return -ERESTARTSYS;
+	}
+	
+	/* A sample leaves the FIFO only once it reached the user */
+	copied = 0;
+	while (iov_iter_count(to) >= sizeof(struct STTS22H_sample) 
+			&& kfifo_peek(&STTS22H_data->fifo, &sample)) {
+		if (copy_to_iter(&sample, sizeof(struct STTS22H_sample), to) 
+					!= sizeof(struct STTS22H_sample))
+			break;
+		
+		kfifo_skip(&STTS22H_data->fifo);
+		copied += sizeof(struct STTS22H_sample);
+	}
+	
+	mutex_unlock(&STTS22H_data->fifo_lock);
+	
+	return copied ? copied : -EFAULT;
+}
+
+static __poll_t STTS22H_poll(struct file *filp, poll_table *wait)
+{
+	__poll_t mask = 0;
+	struct STTS22H_data *STTS22H_data;
+	
+	STTS22H_data = filp->private_data;
+	
+	poll_wait(filp, &STTS22H_data->waitq, wait);
+	
+	if (!kfifo_is_empty(&STTS22H_data->fifo) 
+				|| READ_ONCE(STTS22H_data->ready) 
+				|| (READ_ONCE(STTS22H_data->caching) 
+				&& READ_ONCE(STTS22H_data->cache_time)))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	
+	if (!kfifo_is_empty(&STTS22H_data->events))
+		mask |= EPOLLPRI;
+	
+	return mask;
+}
+
+/*
+ * STTS22H_trigger - Start a one-shot conversion, called with the 
+ * device lock held
+ * Return error code on error, 0 on success
+ */
+static int STTS22H_trigger(struct STTS22H_data *STTS22H_data)
+{
+	s32 result;
+	u8 config;
+	
+	/* 
+	 * The cached config is current, and the one-shot bit clears 
+	 * itself so it cannot be verified: a single write is enough 
+	 */
+	config = STTS22H_data->ctrl | ONE_SHOT_GET;
+	
+	i2c_xfer_begin(&STTS22H_xfer[XFER_ONE_SHOT]);
+	
+	result = i2c_xfer_write(STTS22H_data->client, CTRL_REG, &config, 1, 
+					&STTS22H_xfer[XFER_ONE_SHOT]);
+	if (result < 0) {
+		atomic_inc(&STTS22H_data->errors);
+		PDEBUG("Failed when setting up one-shot acquisition bit\n");
+		return result;
+	}
+	
+	STTS22H_data->trigger = ktime_get();
+	
+	return 0;
+}
+
+/*
+ * STTS22H_conv_timer - Fires once the estimated conversion time of a 
+ * non-blocking one-shot read has elapsed
+ */
+static enum hrtimer_restart STTS22H_conv_timer(struct hrtimer *timer)
+{
+	struct STTS22H_data *STTS22H_data;
+	
+	STTS22H_data = container_of(timer, struct STTS22H_data, conv_timer);
+	
+	sensor_hub_queue(STTS22H_data->hub, &STTS22H_data->conv_work, 0);
+	
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * STTS22H_conv_work - Collect the result of a non-blocking one-shot 
+ * read and wake up pollers. The work checks once and re-arms the timer 
+ * while converting, sleeping would hold up every sensor on the bus
+ */
+static void STTS22H_conv_work(struct sensor_hub_work *work)
+{
+	int result;
+	s64 remain;
+	struct STTS22H_data *STTS22H_data;
+	
+	STTS22H_data = container_of(work, struct STTS22H_data, conv_work);
+	
+	trace_stts22h_work(STTS22H_data->adpt, STTS22H_data->addr, "conv");
+	
+	/* The holder may be waiting on the hub itself, come back later */
+	if (!mutex_trylock(&STTS22H_data->lock)) {
+		if (READ_ONCE(STTS22H_data->pending))
+			hrtimer_start(&STTS22H_data->conv_timer, 
+				us_to_ktime(RETRY_US), HRTIMER_MODE_REL);
+		return;
+	}
+	
+	/* Dropped by a mode change in the meantime */
+	if (!STTS22H_data->pending) {
+		mutex_unlock(&STTS22H_data->lock);
+		return;
+	}
+	
+	/* A timer of a dropped conversion may fire early for this one */
+	remain = STTS22H_data->conv_us 
+		- ktime_us_delta(ktime_get(), STTS22H_data->trigger);
+	if (remain > 0) {
+		hrtimer_start(&STTS22H_data->conv_timer, 
+				us_to_ktime(remain), HRTIMER_MODE_REL);
+		mutex_unlock(&STTS22H_data->lock);
+		return;
+	}
+	
+	result = STTS22H_conv_check(STTS22H_data, STTS22H_data->result, 
+						STTS22H_data->conv_retry);
+	if (result == -EINPROGRESS) {
+		STTS22H_data->conv_retry++;
+		hrtimer_start(&STTS22H_data->conv_timer, 
+				us_to_ktime(RETRY_US), HRTIMER_MODE_REL);
+		mutex_unlock(&STTS22H_data->lock);
+		return;
+	}
+	
+	STTS22H_data->conv_err = result;
+	if (!STTS22H_data->conv_err)
+		STTS22H_check_limits(STTS22H_data, STTS22H_data->result);
+	
+	WRITE_ONCE(STTS22H_data->pending, false);
+	WRITE_ONCE(STTS22H_data->ready, true);
+	
+	mutex_unlock(&STTS22H_data->lock);
+	
+	wake_up_interruptible(&STTS22H_data->waitq);
+}
+
+/*
+ * STTS22H_conv_start - Trigger a one-shot conversion that completes in 
+ * the background, called with the device lock held
+ * Return error code on error, 0 on success
+ */
+static int STTS22H_conv_start(struct STTS22H_data *STTS22H_data)
+{
+	int result;
+	
+	result = STTS22H_trigger(STTS22H_data);
+	if (result < 0)
+		return result;
+	
+	STTS22H_data->conv_retry = 0;
+	WRITE_ONCE(STTS22H_data->pending, true);
+	
+	hrtimer_start(&STTS22H_data->conv_timer, 
+		us_to_ktime(STTS22H_data->conv_us), HRTIMER_MODE_REL);
+	
+	return 0;
+}
+
+/*
+ * STTS22H_read_iter - Obtain temperature data based on current operation 
+ * mode. A non-blocking one-shot read (O_NONBLOCK or IOCB_NOWAIT) starts a 
+ * conversion and returns -EAGAIN, poll reports the result as readable
+ * Return 0 on error, number of read bytes on success
+ */
+static ssize_t STTS22H_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	s32 result;
+	s64 trigger = 0;
+	bool nonblock;
+	u8 burst[BURST_LEN];
+	char data[READ_LEN + 1];
+	struct STTS22H_data *STTS22H_data;
+	
+	STTS22H_data = iocb->ki_filp->private_data;
+	
+	nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) 
+				|| (iocb->ki_flags & IOCB_NOWAIT);
+	
+	trace_stts22h_read(STTS22H_data->adpt, STTS22H_data->addr, 
+					STTS22H_data->mode, nonblock);
+	
+	if (READ_ONCE(STTS22H_data->streaming))
+		return STTS22H_stream_read(STTS22H_data, to, nonblock);
+	
+	if (READ_ONCE(STTS22H_data->caching))
+		return STTS22H_cache_read(STTS22H_data, to, nonblock);
+	
+	if (READ_LEN * sizeof(char) > iov_iter_count(to)) {
+		PDEBUG(
+		"Insufficient buffer size, requires a len %d char array\n",
+								READ_LEN);
+		return 0;
+	}
+	
+relock:
+	if (nonblock) {
+		if (!mutex_trylock(&STTS22H_data->lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&STTS22H_data->lock)) {
+		PDEBUG("Cannot perform mutex locking, restart system\n");
 		return 0;
 	}
 	
@@ -307,79 +1832,612 @@ STTS22H_read(struct file *filp, char __user *buff, size_t size, loff_t *loff)
 	
 	/* For one-shot mode */
 	if (STTS22H_data->mode == one_shot) {
-		/* Preserve current config */
-		result =
-		i2c_smbus_read_byte_data(STTS22H_data->client, CTRL_REG);
-		if (result < 0) {
-			mutex_unlock(&STTS22H_data->lock);
-			PDEBUG("Failed when getting current config\n");
-			return 0;
-		}
-		
-		config = (u8)result | ONE_SHOT_GET;
-		
-		if (config_register(STTS22H_data->client, 
-						CTRL_REG, config) < 0) {
+		/* Result of an earlier non-blocking read */
+		if (STTS22H_data->ready) {
+			WRITE_ONCE(STTS22H_data->ready, false);
+			
+			if (STTS22H_data->conv_err) {
+				sensor_stats_inc(&STTS22H_data->counters, 
+							SENSOR_DROPPED);
+				mutex_unlock(&STTS22H_data->lock);
+				PDEBUG("Data conversion failed\n");
+				return 0;
+			}
+			
+			memcpy(burst, STTS22H_data->result, BURST_LEN);
+		} else if (nonblock || STTS22H_data->pending) {
+			if (!STTS22H_data->pending 
+				&& STTS22H_conv_start(STTS22H_data) < 0) {
+				mutex_unlock(&STTS22H_data->lock);
+				return 0;
+			}
+			
 			mutex_unlock(&STTS22H_data->lock);
-			PDEBUG(
-			"Failed when setting up one-shot acquisition bit\n");
-			return 0;
-		}
-		
-		counter = 0;
-		while (counter < MAX_ATTP) {
-			result = i2c_smbus_read_byte_data(
-					STTS22H_data->client, STATUS_REG);
-			if (result < 0) {
+			
+			if (nonblock)
+				return -EAGAIN;
+			
+			/* Wait for the conversion already in flight */
+			if (wait_event_interruptible(STTS22H_data->waitq, 
+					READ_ONCE(STTS22H_data->ready) 
+				|| !READ_ONCE(STTS22H_data->pending)))
+				return -ERESTARTSYS;
+			
+			goto relock;
+		} else {
+			if (STTS22H_trigger(STTS22H_data) < 0) {
 				mutex_unlock(&STTS22H_data->lock);
-				PDEBUG("Failed when getting data\n");
 				return 0;
 			}
 			
-			if ((u8)result & 0x01) {
-				PDEBUG("Data conversion in process\n");
-				udelay(100);
-				counter++;
-			} else {
-				break;
+			/* Status and both data bytes come in one burst */
+			if (STTS22H_conv_wait(STTS22H_data, burst) < 0) {
+				sensor_stats_inc(&STTS22H_data->counters, 
+							SENSOR_DROPPED);
+				mutex_unlock(&STTS22H_data->lock);
+				PDEBUG("Data conversion failed\n");
+				return 0;
 			}
+			
+			STTS22H_check_limits(STTS22H_data, burst);
 		}
 		
-		if (counter == MAX_ATTP) {
+		data[0] = (char)burst[1];
+		data[1] = (char)burst[2];
+		
+		trigger = ktime_to_ns(STTS22H_data->trigger);
+	} else {
+		i2c_xfer_begin(&STTS22H_xfer[XFER_SAMPLE]);
+		
+		result = i2c_xfer_read(STTS22H_data->client, TEMP_LSB_REG, 
+			(u8 *)data, READ_LEN, &STTS22H_xfer[XFER_SAMPLE]);
+		if (result < 0) {
+			atomic_inc(&STTS22H_data->errors);
 			mutex_unlock(&STTS22H_data->lock);
-			PDEBUG("Data conversion failed\n");
+			PDEBUG("Failed when getting temperature data\n");
 			return 0;
 		}
+		
+		WRITE_ONCE(STTS22H_data->last_sample, ktime_get_ns());
+	}
+	
+	mutex_unlock(&STTS22H_data->lock);
+	
+	if (copy_to_iter(data, READ_LEN * sizeof(char), to) 
+					!= READ_LEN * sizeof(char)) {
+		PDEBUG("Failed when copying data to user\n");
+		return 0;
+	}
+	
+	trace_stts22h_deliver(STTS22H_data->adpt, STTS22H_data->addr, 
+		(s16)((u8)data[0] | ((u8)data[1] << 8)), "user");
+	
+	sensor_stats_inc(&STTS22H_data->counters, SENSOR_SAMPLES);
+	
+	/* Trigger to user, one-shot mode only */
+	if (trigger)
+		sensor_stats_hist(&STTS22H_data->counters, SENSOR_LATENCY_NS, 
+						ktime_get_ns() - trigger);
+	
+	return READ_LEN * sizeof(char);
+}
+
+/*
+ * STTS22H_alloc - Allocate and initialize the state of one device
+ * Return NULL on error, the new structure on success
+ */
+static struct STTS22H_data *STTS22H_alloc(void)
+{
+	struct STTS22H_data *STTS22H_data;
+	
+	STTS22H_data = (struct STTS22H_data*)
+	kmem_cache_zalloc(STTS22H_cache, GFP_KERNEL);
+	
+	if (!STTS22H_data)
+		return NULL;
+	
+	if (sensor_stats_init(&STTS22H_data->counters)) {
+		kmem_cache_free(STTS22H_cache, STTS22H_data);
+		return NULL;
+	}
+	
+	STTS22H_data->adpt = -1;
+	STTS22H_data->conv_us = CONV_INIT_US;
+	
+	mutex_init(&STTS22H_data->lock);
+	mutex_init(&STTS22H_data->fifo_lock);
+	seqlock_init(&STTS22H_data->cache_lock);
+	mutex_init(&STTS22H_data->hist_lock);
+	INIT_LIST_HEAD(&STTS22H_data->hist);
+	
+	INIT_KFIFO(STTS22H_data->fifo);
+	init_waitqueue_head(&STTS22H_data->waitq);
+	sensor_hub_init_work(&STTS22H_data->work, STTS22H_stream_work);
+	
+	hrtimer_init(&STTS22H_data->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	STTS22H_data->timer.function = STTS22H_stream_timer;
+	
+	hrtimer_init(&STTS22H_data->conv_timer, CLOCK_MONOTONIC, 
+							HRTIMER_MODE_REL);
+	STTS22H_data->conv_timer.function = STTS22H_conv_timer;
+	sensor_hub_init_work(&STTS22H_data->conv_work, STTS22H_conv_work);
+	
+	spin_lock_init(&STTS22H_data->event_lock);
+	INIT_KFIFO(STTS22H_data->events);
+	sensor_hub_init_work(&STTS22H_data->alert_work, STTS22H_alert_work);
+	
+	return STTS22H_data;
+}
+
+static void STTS22H_free_rcu(struct rcu_head *rcu)
+{
+	struct STTS22H_data *STTS22H_data;
+	
+	STTS22H_data = container_of(rcu, struct STTS22H_data, rcu);
+	
+	/* The stats file may still be summing the counters until now */
+	sensor_stats_free(&STTS22H_data->counters);
+	
+	kmem_cache_free(STTS22H_cache, STTS22H_data);
+}
+
+/*
+ * STTS22H_free - Stop background activity, release the device and 
+ * every member of its sensor set
+ */
+static void STTS22H_free(struct STTS22H_data *STTS22H_data)
+{
+	int i;
+	struct STTS22H_chunk *chunk, *tmp;
+	
+	STTS22H_stream_stop(STTS22H_data);
+	STTS22H_cache_stop(STTS22H_data);
+	STTS22H_hist_stop(STTS22H_data);
+	
+	list_for_each_entry_safe(chunk, tmp, &STTS22H_data->hist, list)
+		kmem_cache_free(STTS22H_chunk_cache, chunk);
+	
+	WRITE_ONCE(STTS22H_data->alerts, false);
+	sensor_hub_cancel(&STTS22H_data->alert_work);
+	
+	/* 
+	 * The work re-arms the timer while a conversion is pending, stop 
+	 * that first, then flush the work and the timer it may have armed
+	 */
+	WRITE_ONCE(STTS22H_data->pending, false);
+	sensor_hub_cancel(&STTS22H_data->conv_work);
+	hrtimer_cancel(&STTS22H_data->conv_timer);
+	sensor_hub_cancel(&STTS22H_data->conv_work);
+	
+	for (i = 0; i < STTS22H_data->set_len; i++)
+		STTS22H_free(STTS22H_data->set[i]);
+	
+	kfree(STTS22H_data->set);
+	
+	STTS22H_detach(STTS22H_data, true);
+	
+	/* Lockless readers may still be walking over the entry */
+	call_rcu(&STTS22H_data->rcu, STTS22H_free_rcu);
+}
+
+/*
+ * STTS22H_set_add - Configure one more device of a sensor set
+ * Return error code on error, 0 on success
+ */
+static int
+STTS22H_set_add(struct STTS22H_data *STTS22H_data, unsigned long buff)
+{
+	int result;
+	struct STTS22H_member member;
+	struct STTS22H_data *entry;
+	
+	if (copy_from_user(&member, (struct STTS22H_member *)buff, 
+					sizeof(struct STTS22H_member))) {
+		PDEBUG("Copying from user failed\n");
+		return -EFAULT;
+	}
+	
+	if (member.addr > 0x7F)
+		return -EINVAL;
+	
+	if (mutex_lock_interruptible(&STTS22H_data->lock)) {
+		PDEBUG("Cannot perform mutex locking, restart system\n");
+		return -ERESTARTSYS;
+	}
+	
+	if (STTS22H_data->client) {
+		result = -EBUSY;
+		PDEBUG("File already configured as a single device\n");
+		goto add_out;
+	}
+	
+	if (STTS22H_data->set_len == SET_MAX) {
+		result = -ENOSPC;
+		PDEBUG("Sensor set full\n");
+		goto add_out;
+	}
+	
+	if (!STTS22H_data->set) {
+		STTS22H_data->set = kcalloc(SET_MAX, 
+				sizeof(struct STTS22H_data *), GFP_KERNEL);
+		if (!STTS22H_data->set) {
+			result = -ENOMEM;
+			goto add_out;
+		}
+	}
+	
+	entry = STTS22H_alloc();
+	if (!entry) {
+		result = -ENOMEM;
+		goto add_out;
+	}
+	
+	result = STTS22H_attach(entry, (u8)member.addr, member.adpt);
+	if (result < 0) {
+		STTS22H_free(entry);
+		goto add_out;
+	}
+	
+	STTS22H_data->set[STTS22H_data->set_len++] = entry;
+	
+add_out:
+	mutex_unlock(&STTS22H_data->lock);
+	
+	return result;
+}
+
+/*
+ * STTS22H_set_read - Read every device of a sensor set, all one-shot 
+ * conversions are started before the first result is collected
+ * Return error code on error, 0 on success
+ */
+static int
+STTS22H_set_read(struct STTS22H_data *STTS22H_data, unsigned long buff)
+{
+	int i, result;
+	u8 burst[BURST_LEN];
+	struct STTS22H_set_read req;
+	struct STTS22H_reading *readings;
+	struct STTS22H_data *entry;
+	
+	if (copy_from_user(&req, (struct STTS22H_set_read *)buff, 
+					sizeof(struct STTS22H_set_read))) {
+		PDEBUG("Copying from user failed\n");
+		return -EFAULT;
+	}
+	
+	if (mutex_lock_interruptible(&STTS22H_data->lock)) {
+		PDEBUG("Cannot perform mutex locking, restart system\n");
+		return -ERESTARTSYS;
+	}
+	
+	req.count = min_t(u32, req.count, STTS22H_data->set_len);
+	if (!req.count) {
+		mutex_unlock(&STTS22H_data->lock);
+		return -EINVAL;
+	}
+	
+	readings = kcalloc(req.count, sizeof(struct STTS22H_reading), 
+								GFP_KERNEL);
+	if (!readings) {
+		mutex_unlock(&STTS22H_data->lock);
+		return -ENOMEM;
+	}
+	
+	/* Start every conversion, they run in parallel on the chips */
+	for (i = 0; i < req.count; i++) {
+		entry = STTS22H_data->set[i];
+		
+		readings[i].adpt = entry->adpt;
+		readings[i].addr = entry->addr;
+		readings[i].error = STTS22H_trigger(entry);
+	}
+	
+	/* Then collect them, most are done by the time they are polled */
+	for (i = 0; i < req.count; i++) {
+		entry = STTS22H_data->set[i];
+		
+		if (readings[i].error)
+			continue;
+		
+		readings[i].error = STTS22H_conv_wait(entry, burst);
+		if (readings[i].error)
+			continue;
+		
+		readings[i].timestamp = ktime_get_ns();
+		readings[i].temp = (s16)(burst[1] | (burst[2] << 8));
+	}
+	
+	mutex_unlock(&STTS22H_data->lock);
+	
+	result = 0;
+	
+	if (copy_to_user(u64_to_user_ptr(req.readings), readings, 
+			req.count * sizeof(struct STTS22H_reading)) 
+		|| copy_to_user((struct STTS22H_set_read *)buff, &req, 
+					sizeof(struct STTS22H_set_read))) {
+		PDEBUG("Copying to user failed\n");
+		result = -EFAULT;
+	}
+	
+	kfree(readings);
+	
+	return result;
+}
+
+/*
+ * STTS22H_list - Fill a user array with the devices currently in use
+ * Return error code on error, 0 on success
+ */
+static int STTS22H_list(unsigned long buff)
+{
+	int bkt;
+	u32 nr, total;
+	struct STTS22H_list req;
+	struct STTS22H_info *entries;
+	struct STTS22H_data *STTS22H_data;
+	
+	if (copy_from_user(&req, (struct STTS22H_list *)buff, 
+					sizeof(struct STTS22H_list))) {
+		PDEBUG("Copying from user failed\n");
+		return -EFAULT;
+	}
+	
+	req.count = min_t(u32, req.count, LIST_MAX);
+	
+	entries = NULL;
+	if (req.count) {
+		entries = kcalloc(req.count, sizeof(struct STTS22H_info), 
+								GFP_KERNEL);
+		if (!entries)
+			return -ENOMEM;
+	}
+	
+	nr = 0;
+	total = 0;
+	
+	/* Snapshot under RCU, fields are read without the device locks */
+	rcu_read_lock();
+	
+	hash_for_each_rcu(client_table, bkt, STTS22H_data, node) {
+		if (nr < req.count) {
+			entries[nr].last_sample = 
+				READ_ONCE(STTS22H_data->last_sample);
+			entries[nr].adpt = STTS22H_data->adpt;
+			entries[nr].addr = STTS22H_data->addr;
+			entries[nr].mode = READ_ONCE(STTS22H_data->mode);
+			entries[nr].odr = READ_ONCE(STTS22H_data->odr);
+			entries[nr].errors = 
+				atomic_read(&STTS22H_data->errors);
+			entries[nr].timeouts = 
+				READ_ONCE(STTS22H_data->stats.timeouts);
+			nr++;
+		}
+		
+		total++;
+	}
+	
+	rcu_read_unlock();
+	
+	req.count = nr;
+	req.total = total;
+	
+	if ((nr && copy_to_user(u64_to_user_ptr(req.entries), entries, 
+				nr * sizeof(struct STTS22H_info))) 
+		|| copy_to_user((struct STTS22H_list *)buff, &req, 
+					sizeof(struct STTS22H_list))) {
+		kfree(entries);
+		PDEBUG("Copying to user failed\n");
+		return -EFAULT;
+	}
+	
+	kfree(entries);
+	
+	return 0;
+}
+
+/*
+ * STTS22H_scan_bound - device_for_each_child callback, match a client 
+ * bound on the adapter at the given address
+ */
+static int STTS22H_scan_bound(struct device *dev, void *addr)
+{
+	struct i2c_client *client = i2c_verify_client(dev);
+	
+	return client && client->addr == *(u16 *)addr;
+}
+
+/*
+ * STTS22H_scan_probe - Probe the possible addresses on one adapter, runs 
+ * on the hub of the adapter
+ * Return 0
+ */
+static int STTS22H_scan_probe(void *arg)
+{
+	int i;
+	s32 result;
+	u8 chip_id;
+	u16 addr;
+	struct i2c_client *client;
+	struct STTS22H_scan_job *job = arg;
+	
+	client = job->client;
+	
+	for (i = 0; i < ARRAY_SIZE(STTS22H_addrs); i++) {
+		/* Leave devices owned by a file alone */
+		if (STTS22H_in_use(job->adpt, STTS22H_addrs[i])) {
+			job->in_use |= BIT(i);
+			continue;
+		}
+		
+		/* Nor chips another driver is bound to, e.g. DHT20 at 0x38 */
+		addr = STTS22H_addrs[i];
+		if (device_for_each_child(&client->adapter->dev, &addr, 
+						STTS22H_scan_bound))
+			continue;
+		
+		client->addr = STTS22H_addrs[i];
+		
+		i2c_xfer_begin(&STTS22H_xfer[XFER_PROBE]);
+		
+		result = i2c_xfer_read(client, WHOAMI_REG, &chip_id, 1, 
+					&STTS22H_xfer[XFER_PROBE]);
+		if (!result && chip_id == CHIP_ID)
+			job->found |= BIT(i);
+	}
+	
+	return 0;
+}
+
+/*
+ * STTS22H_scan_work - Probe one adapter in a single run of its hub, so 
+ * the probes do not interleave with the sensors bound there
+ */
+static void STTS22H_scan_work(struct work_struct *work)
+{
+	struct i2c_adapter *adpt_ptr;
+	struct sensor_hub *hub;
+	struct STTS22H_scan_job *job;
+	
+	job = container_of(work, struct STTS22H_scan_job, work);
+	
+	adpt_ptr = i2c_get_adapter(job->adpt);
+	if (!adpt_ptr)
+		return;
+	
+	/* Same requirement as STTS22H_attach */
+	if (!i2c_check_functionality(adpt_ptr, I2C_FUNC_SMBUS_READ_I2C_BLOCK))
+		goto scan_out;
+	
+	hub = sensor_hub_get(adpt_ptr);
+	if (IS_ERR(hub))
+		goto scan_out;
+	
+	job->client = (struct i2c_client *)
+	kzalloc(sizeof(struct i2c_client), GFP_KERNEL);
+	if (!job->client)
+		goto hub_out;
+	
+	job->client->adapter = adpt_ptr;
+	
+	sensor_hub_call(hub, STTS22H_scan_probe, job);
+	
+	kfree(job->client);
+	
+hub_out:
+	sensor_hub_put(hub);
+	
+scan_out:
+	i2c_put_adapter(adpt_ptr);
+}
+
+/*
+ * STTS22H_scan_add - i2c_for_each_dev callback, queue up one job per 
+ * adapter. The core lock is held, so adapters are only looked up by 
+ * number here and referenced from the job
+ */
+static int STTS22H_scan_add(struct device *dev, void *jobs)
+{
+	struct i2c_adapter *adpt_ptr;
+	struct STTS22H_scan_job *job;
+	
+	adpt_ptr = i2c_verify_adapter(dev);
+	if (!adpt_ptr)
+		return 0;
+	
+	job = kzalloc(sizeof(struct STTS22H_scan_job), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+	
+	job->adpt = adpt_ptr->nr;
+	INIT_WORK(&job->work, STTS22H_scan_work);
+	
+	list_add_tail(&job->list, (struct list_head *)jobs);
+	
+	return 0;
+}
+
+/*
+ * STTS22H_scan - Look for STTS22H on every adapter and possible address, 
+ * adapters are probed concurrently
+ * Return error code on error, 0 on success
+ */
+static int STTS22H_scan(unsigned long buff)
+{
+	int i, result;
+	u32 nr, total;
+	LIST_HEAD(jobs);
+	struct STTS22H_scan req;
+	struct STTS22H_found *found;
+	struct STTS22H_scan_job *job, *tmp;
+	
+	if (copy_from_user(&req, (struct STTS22H_scan *)buff, 
+					sizeof(struct STTS22H_scan))) {
+		PDEBUG("Copying from user failed\n");
+		return -EFAULT;
 	}
 	
-	data[READ_LEN] = '\0';
+	req.count = min_t(u32, req.count, LIST_MAX);
 	
-	result = i2c_smbus_read_byte_data(STTS22H_data->client, TEMP_LSB_REG);
-	if (result < 0) {
-		mutex_unlock(&STTS22H_data->lock);
-		PDEBUG("Failed when getting LSB data\n");
-		return 0;
+	found = NULL;
+	if (req.count) {
+		found = kcalloc(req.count, sizeof(struct STTS22H_found), 
+								GFP_KERNEL);
+		if (!found)
+			return -ENOMEM;
+	}
+	
+	result = i2c_for_each_dev(&jobs, STTS22H_scan_add);
+	if (result) {
+		PDEBUG("Failed when listing adapters\n");
+		goto scan_free;
 	}
 	
-	data[0] = (char)result;
+	list_for_each_entry(job, &jobs, list)
+		queue_work(STTS22H_scan_wq, &job->work);
 	
-	result = i2c_smbus_read_byte_data(STTS22H_data->client, TEMP_MSB_REG);
-	if (result < 0) {
-		mutex_unlock(&STTS22H_data->lock);
-		PDEBUG("Failed when getting MSB data\n");
-		return 0;
+	nr = 0;
+	total = 0;
+	
+	/* Results are reported in adapter order */
+	list_for_each_entry(job, &jobs, list) {
+		flush_work(&job->work);
+		
+		for (i = 0; i < ARRAY_SIZE(STTS22H_addrs); i++) {
+			if (!((job->found | job->in_use) & BIT(i)))
+				continue;
+			
+			if (nr < req.count) {
+				found[nr].adpt = job->adpt;
+				found[nr].addr = STTS22H_addrs[i];
+				found[nr].in_use = !!(job->in_use & BIT(i));
+				nr++;
+			}
+			
+			total++;
+		}
 	}
 	
-	data[1] = (char)result;
+	req.count = nr;
+	req.total = total;
 	
-	mutex_unlock(&STTS22H_data->lock);
+	if ((nr && copy_to_user(u64_to_user_ptr(req.found), found, 
+				nr * sizeof(struct STTS22H_found))) 
+		|| copy_to_user((struct STTS22H_scan *)buff, &req, 
+					sizeof(struct STTS22H_scan))) {
+		PDEBUG("Copying to user failed\n");
+		result = -EFAULT;
+	}
 	
-	if (copy_to_user(buff, data, READ_LEN * sizeof(char))) {
-		PDEBUG("Failed when copying data to user\n");
-		return 0;
+scan_free:
+	list_for_each_entry_safe(job, tmp, &jobs, list) {
+		list_del(&job->list);
+		kfree(job);
 	}
 	
-	return READ_LEN * sizeof(char);
+	kfree(found);
+	
+	return result;
 }
 
 /*
@@ -390,23 +2448,22 @@ STTS22H_read(struct file *filp, char __user *buff, size_t size, loff_t *loff)
 static long
 STTS22H_ioctl(struct file *filp, unsigned int command, unsigned long buff)
 {
-	u8 config;
-	int cur, result, mode_nr, odr;
+	u8 config, limit_regs[2];
+	int cur, result, mode_nr, odr, enable, high, low, bkt;
+	struct STTS22H_limits limits;
+	struct STTS22H_event event;
+	struct STTS22H_conv_stats stats;
 	struct STTS22H_data *STTS22H_data;
 	
 	switch (command) {
 	case PR_LIST:
-		if (mutex_lock_interruptible(&list_lock)) {
-			PDEBUG(
-			"Cannot perform mutex locking, restart system\n");
-			return -ERESTARTSYS;
-		}
+		rcu_read_lock();
 	
-		if (!list_empty(&client_list)) {
-			list_for_each_entry(STTS22H_data, &client_list, entry) {
+		if (!hash_empty(client_table)) {
+			hash_for_each_rcu(client_table, bkt, STTS22H_data, node) {
 				PDEBUG(
 				"Device address: %02X, adapter: %d, mode: %d\n",
-				STTS22H_data->client->addr, 
+				STTS22H_data->addr, 
 				STTS22H_data->adpt,
 				STTS22H_data->mode);
 			}
@@ -414,7 +2471,7 @@ STTS22H_ioctl(struct file *filp, unsigned int command, unsigned long buff)
 			PDEBUG("Device list empty\n");
 		}
 		
-		mutex_unlock(&list_lock);	
+		rcu_read_unlock();
 		
 		break;
 			
@@ -426,6 +2483,11 @@ STTS22H_ioctl(struct file *filp, unsigned int command, unsigned long buff)
 	
 		STTS22H_data = filp->private_data;
 		
+		/* The sampling period depends on mode and ODR */
+		STTS22H_stream_stop(STTS22H_data);
+		STTS22H_cache_stop(STTS22H_data);
+		STTS22H_hist_stop(STTS22H_data);
+		
 		if (mutex_lock_interruptible(&STTS22H_data->lock)) {
 			PDEBUG(
 			"Cannot perform mutex locking, restart system\n");
@@ -438,18 +2500,14 @@ STTS22H_ioctl(struct file *filp, unsigned int command, unsigned long buff)
 			PDEBUG("Mode change failed, unconfigured device\n");
 			return -EFAULT;
 		}
+		
+		/* A pending one-shot result belongs to the old mode */
+		WRITE_ONCE(STTS22H_data->pending, false);
+		WRITE_ONCE(STTS22H_data->ready, false);
+		wake_up_interruptible(&STTS22H_data->waitq);
 	
-		/* Preserve current config */
-		result =
-		i2c_smbus_read_byte_data(STTS22H_data->client, CTRL_REG);
-		if (result < 0) {
-			mutex_unlock(&STTS22H_data->lock);
-			PDEBUG("Failed when getting current config\n");
-			return result;
-		}
-			
 		/* Power down device before changing mode */
-		config = (u8)result & LOW_ODR_DIS & FREE_RUN_DIS;
+		config = STTS22H_data->ctrl & LOW_ODR_DIS & FREE_RUN_DIS;
 		
 		result =
 		config_register(STTS22H_data->client, CTRL_REG, config);
@@ -459,6 +2517,8 @@ STTS22H_ioctl(struct file *filp, unsigned int command, unsigned long buff)
 			return result;
 		}
 		
+		STTS22H_data->ctrl = config;
+		
 		switch (mode_nr) {
 		case one_shot:
 			STTS22H_data->mode = 0;
@@ -487,6 +2547,8 @@ STTS22H_ioctl(struct file *filp, unsigned int command, unsigned long buff)
 			return result;
 		}
 		
+		STTS22H_data->ctrl = config;
+		
 		STTS22H_data->mode = mode_nr;
 		
 		mutex_unlock(&STTS22H_data->lock);
@@ -501,6 +2563,11 @@ STTS22H_ioctl(struct file *filp, unsigned int command, unsigned long buff)
 	
 		STTS22H_data = filp->private_data;
 		
+		/* The sampling period depends on mode and ODR */
+		STTS22H_stream_stop(STTS22H_data);
+		STTS22H_cache_stop(STTS22H_data);
+		STTS22H_hist_stop(STTS22H_data);
+		
 		if (mutex_lock_interruptible(&STTS22H_data->lock)) {
 			PDEBUG(
 			"Cannot perform mutex locking, restart system\n");
@@ -514,16 +2581,8 @@ STTS22H_ioctl(struct file *filp, unsigned int command, unsigned long buff)
 			return -EFAULT;
 		}
 	
-		/* Preserve current config */
-		result =
-		i2c_smbus_read_byte_data(STTS22H_data->client, CTRL_REG);
-		if (result < 0) {
-			mutex_unlock(&STTS22H_data->lock);
-			PDEBUG("Failed when getting current config\n");
-			return result;
-		}
-		
-		cur = (u8)result;
+		/* The cached config is kept in sync with the register */
+		cur = STTS22H_data->ctrl;
 		
 		/* Power down device before changing ODR */
 		config = cur & LOW_ODR_DIS & FREE_RUN_DIS;
@@ -536,6 +2595,8 @@ STTS22H_ioctl(struct file *filp, unsigned int command, unsigned long buff)
 			return result;
 		}
 		
+		STTS22H_data->ctrl = config;
+		
 		config = cur & ODR_CLEAR;
 		
 		switch (odr) {
@@ -569,8 +2630,219 @@ STTS22H_ioctl(struct file *filp, unsigned int command, unsigned long buff)
 			return result;
 		}
 		
+		STTS22H_data->ctrl = config;
+		
+		STTS22H_data->odr = odr;
+		
+		mutex_unlock(&STTS22H_data->lock);
+		
+		break;
+		
+	case STREAM_CTL:
+		if (copy_from_user(&enable, (int *)buff, sizeof(int))) {
+			PDEBUG("Copying from user failed\n");
+			return -EFAULT;
+		}
+	
+		STTS22H_data = filp->private_data;
+		
+		if (!enable) {
+			STTS22H_stream_stop(STTS22H_data);
+			break;
+		}
+		
+		if (mutex_lock_interruptible(&STTS22H_data->lock)) {
+			PDEBUG(
+			"Cannot perform mutex locking, restart system\n");
+			return -ERESTARTSYS;
+		}
+		
+		if (!STTS22H_data->client) {
+			mutex_unlock(&STTS22H_data->lock);
+			PDEBUG("Streaming failed, unconfigured device\n");
+			return -EFAULT;
+		}
+		
+		result = STTS22H_stream_start(STTS22H_data);
+		
+		mutex_unlock(&STTS22H_data->lock);
+		
+		return result;
+		
+	case CACHE_CTL:
+		if (copy_from_user(&enable, (int *)buff, sizeof(int))) {
+			PDEBUG("Copying from user failed\n");
+			return -EFAULT;
+		}
+	
+		STTS22H_data = filp->private_data;
+		
+		if (!enable) {
+			STTS22H_cache_stop(STTS22H_data);
+			break;
+		}
+		
+		if (mutex_lock_interruptible(&STTS22H_data->lock)) {
+			PDEBUG(
+			"Cannot perform mutex locking, restart system\n");
+			return -ERESTARTSYS;
+		}
+		
+		if (!STTS22H_data->client) {
+			mutex_unlock(&STTS22H_data->lock);
+			PDEBUG("Caching failed, unconfigured device\n");
+			return -EFAULT;
+		}
+		
+		result = STTS22H_cache_start(STTS22H_data);
+		
+		mutex_unlock(&STTS22H_data->lock);
+		
+		return result;
+		
+	case HIST_CTL:
+		if (copy_from_user(&enable, (int *)buff, sizeof(int))) {
+			PDEBUG("Copying from user failed\n");
+			return -EFAULT;
+		}
+	
+		STTS22H_data = filp->private_data;
+		
+		if (!enable) {
+			STTS22H_hist_stop(STTS22H_data);
+			break;
+		}
+		
+		if (mutex_lock_interruptible(&STTS22H_data->lock)) {
+			PDEBUG(
+			"Cannot perform mutex locking, restart system\n");
+			return -ERESTARTSYS;
+		}
+		
+		if (!STTS22H_data->client) {
+			mutex_unlock(&STTS22H_data->lock);
+			PDEBUG("Logging failed, unconfigured device\n");
+			return -EFAULT;
+		}
+		
+		result = STTS22H_hist_start(STTS22H_data);
+		
+		mutex_unlock(&STTS22H_data->lock);
+		
+		return result;
+		
+	case HIST_READ:
+		return STTS22H_hist_read(filp->private_data, buff);
+		
+	case SET_LIMITS:
+		if (copy_from_user(&limits, (struct STTS22H_limits *)buff, 
+					sizeof(struct STTS22H_limits))) {
+			PDEBUG("Copying from user failed\n");
+			return -EFAULT;
+		}
+		
+		high = LIMIT_DIS;
+		if (limits.flags & LIMIT_HIGH_EN) {
+			high = limit_to_reg(limits.high);
+			if (high < 0) {
+				PDEBUG("High limit out of range\n");
+				return high;
+			}
+		}
+		
+		low = LIMIT_DIS;
+		if (limits.flags & LIMIT_LOW_EN) {
+			low = limit_to_reg(limits.low);
+			if (low < 0) {
+				PDEBUG("Low limit out of range\n");
+				return low;
+			}
+		}
+	
+		STTS22H_data = filp->private_data;
+		
+		if (mutex_lock_interruptible(&STTS22H_data->lock)) {
+			PDEBUG(
+			"Cannot perform mutex locking, restart system\n");
+			return -ERESTARTSYS;
+		}
+		
+		if (!STTS22H_data->client) {
+			mutex_unlock(&STTS22H_data->lock);
+			PDEBUG("Limit change failed, unconfigured device\n");
+			return -EFAULT;
+		}
+		
+		/* Both limit registers are adjacent, written and verified at once */
+		limit_regs[0] = (u8)high;
+		limit_regs[1] = (u8)low;
+		
+		i2c_xfer_begin(&STTS22H_xfer[XFER_CONFIG]);
+		
+		result = i2c_xfer_write_verify(STTS22H_data->client, 
+			HIGH_LIMIT_REG, limit_regs, 2, &STTS22H_xfer[XFER_CONFIG]);
+		if (result < 0) {
+			mutex_unlock(&STTS22H_data->lock);
+			PDEBUG("Failed when setting limits\n");
+			return result;
+		}
+		
+		WRITE_ONCE(STTS22H_data->alerts, high || low);
+		
+		if (STTS22H_data->alerts)
+			sensor_hub_queue(STTS22H_data->hub, 
+					&STTS22H_data->alert_work, 0);
+		
+		mutex_unlock(&STTS22H_data->lock);
+		
+		break;
+		
+	case GET_EVENT:
+		STTS22H_data = filp->private_data;
+		
+		if (!kfifo_out_spinlocked(&STTS22H_data->events, &event, 1, 
+						&STTS22H_data->event_lock))
+			return -EAGAIN;
+		
+		if (copy_to_user((struct STTS22H_event *)buff, &event, 
+					sizeof(struct STTS22H_event))) {
+			PDEBUG("Copying to user failed\n");
+			return -EFAULT;
+		}
+		
+		break;
+		
+	case SET_ADD:
+		return STTS22H_set_add(filp->private_data, buff);
+		
+	case SET_READ:
+		return STTS22H_set_read(filp->private_data, buff);
+		
+	case LIST_DEVS:
+		return STTS22H_list(buff);
+		
+	case SCAN:
+		return STTS22H_scan(buff);
+		
+	case GET_CONV_STATS:
+		STTS22H_data = filp->private_data;
+		
+		if (mutex_lock_interruptible(&STTS22H_data->lock)) {
+			PDEBUG("Cannot perform mutex locking, restart system\n");
+			return -ERESTARTSYS;
+		}
+		
+		stats = STTS22H_data->stats;
+		stats.conv_us = STTS22H_data->conv_us;
+		
 		mutex_unlock(&STTS22H_data->lock);
 		
+		if (copy_to_user((struct STTS22H_conv_stats *)buff, &stats, 
+					sizeof(struct STTS22H_conv_stats))) {
+			PDEBUG("Copying to user failed\n");
+			return -EFAULT;
+		}
+		
 		break;
 		
 	default:
@@ -585,58 +2857,89 @@ static int STTS22H_open(struct inode *inode, struct file *filp)
 {
 	struct STTS22H_data *STTS22H_data;
 	
-	STTS22H_data = (struct STTS22H_data*)
-	kzalloc(sizeof(struct STTS22H_data), GFP_KERNEL);
-	
+	STTS22H_data = STTS22H_alloc();
 	if (!STTS22H_data)
 		return -ENOMEM;
 	
-	STTS22H_data->adpt = -1;
-	
-	mutex_init(&STTS22H_data->lock);
-	
 	filp->private_data = STTS22H_data;
 	
+	/* Reads honour IOCB_NOWAIT */
+	filp->f_mode |= FMODE_NOWAIT;
+	
 	return 0;
 }
 
 static int STTS22H_release(struct inode *inode, struct file *filp)
 {
-	struct STTS22H_data *STTS22H_data;
+	STTS22H_free(filp->private_data);
 	
-	STTS22H_data = filp->private_data;
+	filp->private_data = NULL;
+
+	return 0;
+}
+
+/*
+ * STTS22H_stats_show - Counters of every configured device, preceded by 
+ * a "device <adapter>-<address>" line, walked under RCU like LIST_DEVS
+ */
+static int STTS22H_stats_show(struct seq_file *s, void *unused)
+{
+	int bkt, adpt;
+	struct STTS22H_data *STTS22H_data;
 	
-	/* Check if the device is on the list */
-	if (STTS22H_data->adpt != -1) {
-		if (mutex_lock_interruptible(&list_lock)) {
-			PDEBUG(
-			"Cannot perform mutex locking, restart system\n");
-			return -ERESTARTSYS;
-		}
+	rcu_read_lock();
 	
-		list_del(&STTS22H_data->entry);
+	hash_for_each_rcu(client_table, bkt, STTS22H_data, node) {
+		adpt = READ_ONCE(STTS22H_data->adpt);
+		if (adpt == -1)
+			continue;
 		
-		mutex_unlock(&list_lock);
-	}
-	
-	if (STTS22H_data->client) {
-		i2c_put_adapter(STTS22H_data->client->adapter);
-		kfree(STTS22H_data->client);
-		STTS22H_data->client = NULL;
+		seq_printf(s, "device %d-%02x\n", adpt, STTS22H_data->addr);
+		sensor_stats_print(s, &STTS22H_data->counters);
 	}
 	
-	kfree(STTS22H_data);
+	rcu_read_unlock();
 	
-	filp->private_data = NULL;
-
 	return 0;
 }
 
+static int STTS22H_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, STTS22H_stats_show, NULL);
+}
+
+/* Any write clears the counters of every configured device */
+static ssize_t STTS22H_stats_write(struct file *file, 
+		const char __user *buf, size_t count, loff_t *ppos)
+{
+	int bkt;
+	struct STTS22H_data *STTS22H_data;
+	
+	rcu_read_lock();
+	
+	hash_for_each_rcu(client_table, bkt, STTS22H_data, node)
+		sensor_stats_reset(&STTS22H_data->counters);
+	
+	rcu_read_unlock();
+	
+	return count;
+}
+
+static const struct file_operations STTS22H_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = STTS22H_stats_open,
+	.read = seq_read,
+	.write = STTS22H_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static struct file_operations STTS22H_fops = {
 	.owner = THIS_MODULE, 
 	.open = STTS22H_open,
 	.write = STTS22H_write,
-	.read = STTS22H_read,
+	.read_iter = STTS22H_read_iter,
+	.poll = STTS22H_poll,
 	.unlocked_ioctl = STTS22H_ioctl,
 	.release = STTS22H_release,
 };
@@ -651,10 +2954,37 @@ static int __init STTS22H_init(void)
 	int result;
 	struct device *dev_res;
 	
+	STTS22H_wq = create_workqueue("STTS22H_queue");
+	if (!STTS22H_wq) {
+		PDEBUG("Failed when creating workqueue\n");
+		return -ENOMEM;
+	}
+	
+	STTS22H_scan_wq = alloc_workqueue("STTS22H_scan", WQ_UNBOUND, 0);
+	if (!STTS22H_scan_wq) {
+		PDEBUG("Failed when creating workqueue\n");
+		result = -ENOMEM;
+		goto scan_wq_fail;
+	}
+	
+	STTS22H_cache = KMEM_CACHE(STTS22H_data, 0);
+	if (!STTS22H_cache) {
+		PDEBUG("Failed when creating slab cache\n");
+		result = -ENOMEM;
+		goto cache_fail;
+	}
+	
+	STTS22H_chunk_cache = KMEM_CACHE(STTS22H_chunk, 0);
+	if (!STTS22H_chunk_cache) {
+		PDEBUG("Failed when creating slab cache\n");
+		result = -ENOMEM;
+		goto chunk_cache_fail;
+	}
+	
 	result = alloc_chrdev_region(&STTS22H_id, 0, 1, "STTS22H");
 	if (result < 0) {
 		PDEBUG("Failed when requesting device number\n");
-		return result;
+		goto region_fail;
 	}
 	
 	STTS22H_class = class_create(THIS_MODULE, "temp_sensor");
@@ -682,7 +3012,10 @@ static int __init STTS22H_init(void)
 		goto create_fail;
 	}
 	
-	mutex_init(&list_lock);
+	/* Statistics are optional, the driver works without debugfs */
+	STTS22H_debugfs = debugfs_create_dir("STTS22H", NULL);
+	debugfs_create_file("stats", 0600, STTS22H_debugfs, NULL, 
+						&STTS22H_stats_fops);
 	
 	PDEBUG("Driver loaded\n");
 	
@@ -696,12 +3029,26 @@ cdev_fail:
 
 class_fail:
 	unregister_chrdev_region(STTS22H_id, 1);
+
+region_fail:
+	kmem_cache_destroy(STTS22H_chunk_cache);
+
+chunk_cache_fail:
+	kmem_cache_destroy(STTS22H_cache);
+
+cache_fail:
+	destroy_workqueue(STTS22H_scan_wq);
+
+scan_wq_fail:
+	destroy_workqueue(STTS22H_wq);
 	
 	return result;
 }
 
 static void __exit STTS22H_exit(void)
 {
+	debugfs_remove_recursive(STTS22H_debugfs);
+	
 	device_destroy(STTS22H_class, STTS22H_id);
 	
 	cdev_del(&STTS22H_cdev);
@@ -710,6 +3057,18 @@ static void __exit STTS22H_exit(void)
 	
 	unregister_chrdev_region(STTS22H_id, 1);
 	
+	cancel_delayed_work_sync(&recent_expire);
+	STTS22H_recent_drop(true);
+	
+	/* Wait for deferred frees before the cache goes away */
+	rcu_barrier();
+	kmem_cache_destroy(STTS22H_cache);
+	kmem_cache_destroy(STTS22H_chunk_cache);
+	
+	destroy_workqueue(STTS22H_scan_wq);
+	
+	destroy_workqueue(STTS22H_wq);
+	
 	PDEBUG("Driver unloaded\n");
 }
 
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Measures the cost of the open -> configure -> read -> close cycle
+ * short-lived tools go through, usage: STTS22H_bench [addr] [adapter] [loops]
+ */
+
+double elapsed_us(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e6
+		+ (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+int main(int argc, char* argv[]) {
+	int i, fd, loops, failed;
+	char data[2];
+	double open_us, write_us, read_us, close_us, total_us;
+	struct timespec t0, t1, t2, t3, t4;
+
+	data[0] = argc > 1 ? (char)strtol(argv[1], NULL, 0) : 0x3C;
+	data[1] = argc > 2 ? (char)strtol(argv[2], NULL, 0) : 2;
+	loops = argc > 3 ? atoi(argv[3]) : 1000;
+
+	if(loops < 1) {
+		printf("Loop count must be at least 1. \n");
+		return 1;
+	}
+
+	open_us = write_us = read_us = close_us = 0;
+	failed = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for(i = 0; i < loops; i++) {
+		char cfg[2] = {data[0], data[1]};
+		char temp[2];
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		fd = open("/dev/STTS22H", O_RDWR);
+		if(fd < 0) {
+			printf("Failed to open device file. \n");
+			return 1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		open_us += elapsed_us(&t1, &t2);
+
+		if(write(fd, cfg, 2 * sizeof(char)) != 2)
+			failed++;
+
+		clock_gettime(CLOCK_MONOTONIC, &t3);
+		write_us += elapsed_us(&t2, &t3);
+
+		if(read(fd, temp, 2 * sizeof(char)) != 2)
+			failed++;
+
+		clock_gettime(CLOCK_MONOTONIC, &t4);
+		read_us += elapsed_us(&t3, &t4);
+
+		close(fd);
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		close_us += elapsed_us(&t4, &t1);
+	}
+
+	total_us = elapsed_us(&t0, &t1);
+
+	printf("%d cycles, %d failed calls. \n", loops, failed);
+	printf("open: %.1lf us, configure: %.1lf us, read: %.1lf us, close: %.1lf us. \n",
+		open_us / loops, write_us / loops, read_us / loops, close_us / loops);
+	printf("Total: %.1lf us per cycle, %.0lf cycles/s. \n", total_us / loops, loops / (total_us / 1e6));
+
+	return 0;
+}
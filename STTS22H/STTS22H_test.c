@@ -8,6 +8,24 @@
 #define PR_LIST _IO('S', 1)
 #define CHG_MODE _IOW('S', 2, int)
 #define CHG_ODR _IOW('S', 3, int)
+#define STREAM_CTL _IOW('S', 4, int)
+#define GET_CONV_STATS _IOR('S', 9, struct STTS22H_conv_stats)
+
+struct STTS22H_sample {
+	long long timestamp;
+	short temp;
+	unsigned short reserved;
+	unsigned int dropped;
+};
+
+struct STTS22H_conv_stats {
+	unsigned int conv_us;
+	unsigned int last_wait_us;
+	unsigned long long conversions;
+	unsigned long long total_wait_us;
+	unsigned long long retries;
+	unsigned long long timeouts;
+};
 
 double data_conver(unsigned char *data) {
 	int temp;
@@ -23,9 +41,12 @@ double data_conver(unsigned char *data) {
 }
 
 int main(int argc, char* argv[]) {
-	int fd, mode, odr; 
+	int i, fd, mode, odr, enable; 
+	ssize_t len;
 	double value;
 	char data[3];
+	struct STTS22H_sample samples[16];
+	struct STTS22H_conv_stats stats;
 	
 	fd = open("/dev/STTS22H", O_RDWR);
 	printf("Device file opened. \n");
@@ -48,6 +69,9 @@ int main(int argc, char* argv[]) {
 	value = data_conver(data);
 	printf("One-shot mode data: %lf, %02X %02X. \n", value, data[1], data[0]);
 	
+	ioctl(fd, GET_CONV_STATS, &stats);
+	printf("Conversion wait: %u us, estimate %u us, %llu retries. \n", stats.last_wait_us, stats.conv_us, stats.retries);
+	
 	printf("Trying to change to low ODR mode. \n");
 	mode = 2;
 	ioctl(fd, CHG_MODE, &mode);
@@ -67,6 +91,19 @@ int main(int argc, char* argv[]) {
 	read(fd, data, 2 * sizeof(char));
 	value = data_conver(data);
 	printf("Free run mode data: %lf, %02X %02X. \n", value, data[1], data[0]);
+	
+	printf("Trying to stream at 50 Hz. \n");
+	enable = 1;
+	ioctl(fd, STREAM_CTL, &enable);
+	
+	usleep(200000);
+	
+	len = read(fd, samples, sizeof(samples));
+	for(i = 0; i < len / (ssize_t)sizeof(struct STTS22H_sample); i++)
+		printf("Streamed data: %lld ns, %lf. \n", samples[i].timestamp, samples[i].temp / 100.0);
+	
+	enable = 0;
+	ioctl(fd, STREAM_CTL, &enable);
 
 	close(fd);
 	printf("Device file closed. \n");
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* Trace events of the STTS22H driver, one per acquisition stage
+
+   Enabled through /sys/kernel/tracing/events/stts22h/, a disabled
+   event costs a static branch
+
+   Copyright (c) 2024,2024 Zixuan Qiao <zqiao104@uottawa.ca> */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM stts22h
+
+#if !defined(_STTS22H_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _STTS22H_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Entry of a read, before the device lock is taken */
+TRACE_EVENT(stts22h_read,
+	TP_PROTO(int adpt, u8 addr, int mode, bool nonblock),
+
+	TP_ARGS(adpt, addr, mode, nonblock),
+
+	TP_STRUCT__entry(
+		__field(int, adpt)
+		__field(u8, addr)
+		__field(int, mode)
+		__field(bool, nonblock)
+	),
+
+	TP_fast_assign(
+		__entry->adpt = adpt;
+		__entry->addr = addr;
+		__entry->mode = mode;
+		__entry->nonblock = nonblock;
+	),
+
+	TP_printk("adapter=%d addr=0x%02x mode=%d nonblock=%d",
+		__entry->adpt, __entry->addr, __entry->mode, __entry->nonblock)
+);
+
+/* Start of a background work item, stage is "sample" or "conv" */
+TRACE_EVENT(stts22h_work,
+	TP_PROTO(int adpt, u8 addr, const char *stage),
+
+	TP_ARGS(adpt, addr, stage),
+
+	TP_STRUCT__entry(
+		__field(int, adpt)
+		__field(u8, addr)
+		__string(stage, stage)
+	),
+
+	TP_fast_assign(
+		__entry->adpt = adpt;
+		__entry->addr = addr;
+		__assign_str(stage, stage);
+	),
+
+	TP_printk("adapter=%d addr=0x%02x stage=%s",
+		__entry->adpt, __entry->addr, __get_str(stage))
+);
+
+/* One bus transaction, op is the i2c_xfer_stats name */
+TRACE_EVENT(stts22h_xfer,
+	TP_PROTO(int adpt, u16 addr, const char *op, int msgs, u64 ns,
+								int result),
+
+	TP_ARGS(adpt, addr, op, msgs, ns, result),
+
+	TP_STRUCT__entry(
+		__field(int, adpt)
+		__field(u16, addr)
+		__string(op, op)
+		__field(int, msgs)
+		__field(u64, ns)
+		__field(int, result)
+	),
+
+	TP_fast_assign(
+		__entry->adpt = adpt;
+		__entry->addr = addr;
+		__assign_str(op, op);
+		__entry->msgs = msgs;
+		__entry->ns = ns;
+		__entry->result = result;
+	),
+
+	TP_printk("adapter=%d addr=0x%02x op=%s msgs=%d ns=%llu result=%d",
+		__entry->adpt, __entry->addr, __get_str(op), __entry->msgs,
+		__entry->ns, __entry->result)
+);
+
+/* End of a one-shot conversion wait, wait_us counts from the trigger */
+TRACE_EVENT(stts22h_conv_wait,
+	TP_PROTO(int adpt, u8 addr, s64 wait_us, int retries, int result),
+
+	TP_ARGS(adpt, addr, wait_us, retries, result),
+
+	TP_STRUCT__entry(
+		__field(int, adpt)
+		__field(u8, addr)
+		__field(s64, wait_us)
+		__field(int, retries)
+		__field(int, result)
+	),
+
+	TP_fast_assign(
+		__entry->adpt = adpt;
+		__entry->addr = addr;
+		__entry->wait_us = wait_us;
+		__entry->retries = retries;
+		__entry->result = result;
+	),
+
+	TP_printk("adapter=%d addr=0x%02x wait_us=%lld retries=%d result=%d",
+		__entry->adpt, __entry->addr, __entry->wait_us,
+		__entry->retries, __entry->result)
+);
+
+/* A sample handed to the user, the FIFO, the cache or the history */
+TRACE_EVENT(stts22h_deliver,
+	TP_PROTO(int adpt, u8 addr, s16 temp, const char *dest),
+
+	TP_ARGS(adpt, addr, temp, dest),
+
+	TP_STRUCT__entry(
+		__field(int, adpt)
+		__field(u8, addr)
+		__field(s16, temp)
+		__string(dest, dest)
+	),
+
+	TP_fast_assign(
+		__entry->adpt = adpt;
+		__entry->addr = addr;
+		__entry->temp = temp;
+		__assign_str(dest, dest);
+	),
+
+	TP_printk("adapter=%d addr=0x%02x temp=%d dest=%s",
+		__entry->adpt, __entry->addr, __entry->temp, __get_str(dest))
+);
+
+#endif
+
+/* The header lives next to the driver, see CFLAGS_STTS22H.o */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE STTS22H_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,82 @@
+#!/bin/sh
+# Loads i2c_sim and every driver in turn and prints the results as a JSON array
+# usage: run_bench.sh [seconds] [bus_khz] > results.json, run as root with the modules built
+# a scenario that fails is reported as {"scenario": ..., "error": ...}, the array is closed
+# on any exit so the output stays valid JSON
+
+set -e
+
+SECONDS_RUN=${1:-10}
+BUS_KHZ=${2:-400}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BENCH="$ROOT/bench/sim_bench"
+
+OPEN=0
+FIRST=1
+LOADED=""
+
+cleanup() {
+	status=$?
+
+	if [ "$OPEN" = 1 ]; then
+		echo "]"
+	fi
+
+	for mod in $LOADED; do
+		rmmod "$mod" || true
+	done
+
+	exit $status
+}
+trap cleanup EXIT
+
+# error <scenario> <message>
+error() {
+	printf '{"scenario": "%s", "error": "%s"}\n' "$1" "$2"
+}
+
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+
+echo "["
+OPEN=1
+
+insmod "$ROOT/i2c_sim/i2c_sim.ko" bus_khz="$BUS_KHZ"
+LOADED="i2c_sim"
+
+# the drivers run their bus work on the sensor hub
+insmod "$ROOT/sensor_hub/sensor_hub.ko"
+LOADED="sensor_hub $LOADED"
+
+ADPT=$(cat /sys/module/i2c_sim/parameters/adapter_nr)
+GPIO=$(cat /sys/module/i2c_sim/parameters/gpio_base)
+
+# run <scenario> <module name> <module path> [parameters...]
+run() {
+	scenario=$1
+	name=$2
+	path=$3
+	shift 3
+
+	if [ "$FIRST" = 0 ]; then
+		echo ","
+	fi
+	FIRST=0
+
+	if ! insmod "$ROOT/$path" "$@"; then
+		error "$scenario" "insmod $path failed"
+		return 0
+	fi
+
+	if out=$("$BENCH" "$scenario" "$SECONDS_RUN"); then
+		echo "$out"
+	else
+		error "$scenario" "sim_bench exited with status $?"
+	fi
+
+	rmmod "$name" || echo "Failed to unload $name" >&2
+}
+
+run stts22h STTS22H STTS22H/STTS22H.ko
+run dht20 DHT20 DHT20/i2c_client/DHT20.ko adapter="$ADPT"
+run bma400 BMA400 BMA400/BMA400.ko adapter="$ADPT" irq_gpio=$((GPIO + 1)) mode=1
+run isl29125 ISL29125 ISL29125/ISL29125.ko adapter="$ADPT" irq_gpio="$GPIO"
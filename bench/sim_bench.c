@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glob.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Runs one benchmark scenario against the drivers loaded on i2c_sim and
+ * prints the result as a JSON object, usage: sim_bench <scenario> [seconds]
+ *
+ * stts22h   one-shot reads through /dev/STTS22H, trigger to user latency
+ * dht20     polling at the shortest update_interval, trigger to fetch latency
+ * bma400    interrupt driven (load with mode=1), interrupt to fetch latency
+ * isl29125  threshold interrupts, interrupt to fetch latency
+ *
+ * Counters come from /sys/kernel/debug/i2c_sim, whose latency ring only
+ * holds the latest 4096 values and is drained every DRAIN_MS during the
+ * run, values overwritten before that are counted as lost. CPU time is
+ * the run time of the drivers' work on the sensor hub of the adapter, the
+ * busy time of the whole system from /proc/stat is reported next to it,
+ * errors go to stderr so stdout only carries the JSON
+ */
+
+#define SIM_DEBUGFS "/sys/kernel/debug/i2c_sim"
+#define SIM_PARAMS "/sys/module/i2c_sim/parameters"
+#define HUB_DEBUGFS "/sys/kernel/debug/sensor_hub"
+
+#define DRAIN_MS 100
+
+struct sim_stats {
+	unsigned long long xfers;
+	unsigned long long msgs;
+	unsigned long long bytes;
+	unsigned long long samples;
+	unsigned long long irqs;
+	unsigned long long fetches;
+};
+
+struct lat_buf {
+	unsigned long long *val;
+	size_t nr;
+	size_t size;
+	unsigned long long seen;	// values recorded by i2c_sim so far
+	unsigned long long lost;	// overwritten before they were drained
+};
+
+struct result {
+	double seconds;
+	unsigned long long samples;
+	double cpu_s;
+	double system_cpu_s;
+	struct sim_stats stats;
+	struct lat_buf user;
+	struct lat_buf device;
+};
+
+struct scenario {
+	const char *name;
+	const char *chip;
+	int (*setup)(void);
+	int (*run)(const struct scenario *sc, struct result *res, int seconds);
+};
+
+double now_s(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int lat_add(struct lat_buf *buf, unsigned long long val) {
+	unsigned long long *val_new;
+
+	if(buf->nr == buf->size) {
+		buf->size = buf->size ? buf->size * 2 : 4096;
+
+		val_new = realloc(buf->val, buf->size * sizeof(*val_new));
+		if(!val_new)
+			return -1;
+
+		buf->val = val_new;
+	}
+
+	buf->val[buf->nr++] = val;
+
+	return 0;
+}
+
+int cmp_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// nearest rank on a sorted buffer
+unsigned long long lat_pct(struct lat_buf *buf, double q) {
+	size_t rank;
+
+	if(!buf->nr)
+		return 0;
+
+	rank = (size_t)(q * buf->nr + 0.5);
+	if(rank < 1)
+		rank = 1;
+	if(rank > buf->nr)
+		rank = buf->nr;
+
+	return buf->val[rank - 1];
+}
+
+int write_str(const char *path, const char *str) {
+	int fd, res;
+
+	fd = open(path, O_WRONLY);
+	if(fd < 0)
+		return -1;
+
+	res = write(fd, str, strlen(str)) < 0 ? -1 : 0;
+
+	close(fd);
+
+	return res;
+}
+
+int read_int(const char *path, int *val) {
+	FILE *fp;
+	int res;
+
+	fp = fopen(path, "r");
+	if(!fp)
+		return -1;
+
+	res = fscanf(fp, "%d", val) == 1 ? 0 : -1;
+
+	fclose(fp);
+
+	return res;
+}
+
+// busy time of all CPUs in seconds, everything but idle and iowait
+double cpu_busy_s(void) {
+	FILE *fp;
+	unsigned long long v[8] = {0};
+	double busy;
+
+	fp = fopen("/proc/stat", "r");
+	if(!fp)
+		return 0;
+
+	if(fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) != 8) {
+		fclose(fp);
+		return 0;
+	}
+
+	fclose(fp);
+
+	busy = v[0] + v[1] + v[2] + v[5] + v[6] + v[7];
+
+	return busy / sysconf(_SC_CLK_TCK);
+}
+
+// run time of the work on the hub of the adapter in seconds, 0 until a driver creates the hub
+double hub_busy_s(int adapter) {
+	FILE *fp;
+	char path[64], key[32];
+	unsigned long long val, busy = 0;
+
+	snprintf(path, sizeof(path), HUB_DEBUGFS "/i2c-%d/stats", adapter);
+
+	fp = fopen(path, "r");
+	if(!fp)
+		return 0;
+
+	while(fscanf(fp, "%31s %llu%*[^\n]", key, &val) == 2)
+		if(!strcmp(key, "busy_ns")) {
+			busy = val;
+			break;
+		}
+
+	fclose(fp);
+
+	return busy / 1e9;
+}
+
+int read_sim_stats(const char *chip, struct sim_stats *stats) {
+	FILE *fp;
+	char path[128], key[32];
+	unsigned long long val;
+
+	snprintf(path, sizeof(path), SIM_DEBUGFS "/%s/stats", chip);
+
+	fp = fopen(path, "r");
+	if(!fp)
+		return -1;
+
+	memset(stats, 0, sizeof(*stats));
+
+	while(fscanf(fp, "%31s %llu", key, &val) == 2) {
+		if(!strcmp(key, "xfers"))
+			stats->xfers = val;
+		else if(!strcmp(key, "msgs"))
+			stats->msgs = val;
+		else if(!strcmp(key, "bytes"))
+			stats->bytes = val;
+		else if(!strcmp(key, "samples"))
+			stats->samples = val;
+		else if(!strcmp(key, "irqs"))
+			stats->irqs = val;
+		else if(!strcmp(key, "fetches"))
+			stats->fetches = val;
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+// add the values recorded since the last call, the file lists the total count and the latest values
+int read_sim_latency(const char *chip, struct lat_buf *buf) {
+	FILE *fp;
+	char path[128];
+	unsigned long long count, fresh, val;
+	struct lat_buf ring = {0};
+	size_t i;
+	int res = 0;
+
+	snprintf(path, sizeof(path), SIM_DEBUGFS "/%s/latency", chip);
+
+	fp = fopen(path, "r");
+	if(!fp)
+		return -1;
+
+	if(fscanf(fp, "count %llu", &count) != 1) {
+		fclose(fp);
+		return -1;
+	}
+
+	while(fscanf(fp, "%llu", &val) == 1)
+		if(lat_add(&ring, val)) {
+			res = -1;
+			goto out;
+		}
+
+	fresh = count - buf->seen;
+	if(fresh > ring.nr) {
+		buf->lost += fresh - ring.nr;
+		fresh = ring.nr;
+	}
+
+	for(i = ring.nr - fresh; i < ring.nr; i++)
+		if(lat_add(buf, ring.val[i])) {
+			res = -1;
+			goto out;
+		}
+
+	buf->seen = count;
+
+out:
+	free(ring.val);
+	fclose(fp);
+
+	return res;
+}
+
+int run_stts22h(const struct scenario *sc, struct result *res, int seconds) {
+	int fd, adapter;
+	char data[2], temp[2];
+	double start, drain, t0, t1;
+
+	if(read_int(SIM_PARAMS "/adapter_nr", &adapter)) {
+		fprintf(stderr, "i2c_sim is not loaded. \n");
+		return -1;
+	}
+
+	fd = open("/dev/STTS22H", O_RDWR);
+	if(fd < 0) {
+		fprintf(stderr, "Failed to open device file. \n");
+		return -1;
+	}
+
+	data[0] = 0x3C;
+	data[1] = (char)adapter;
+
+	if(write(fd, data, 2 * sizeof(char)) != 2) {
+		fprintf(stderr, "Failed to configure the device. \n");
+		close(fd);
+		return -1;
+	}
+
+	start = now_s();
+	drain = start;
+
+	do {
+		t0 = now_s();
+
+		if(t0 - drain >= DRAIN_MS / 1e3) {
+			if(read_sim_latency(sc->chip, &res->device)) {
+				fprintf(stderr, "Failed to read the i2c_sim latencies of %s. \n", sc->chip);
+				close(fd);
+				return -1;
+			}
+
+			drain = now_s();
+			t0 = drain;
+		}
+
+		if(read(fd, temp, 2 * sizeof(char)) != 2) {
+			t1 = now_s();
+			continue;
+		}
+
+		t1 = now_s();
+
+		res->samples++;
+		lat_add(&res->user, (unsigned long long)((t1 - t0) * 1e9));
+	} while(t1 - start < seconds);
+
+	close(fd);
+
+	return 0;
+}
+
+// shortest polling interval, it is clamped by the driver
+int dht20_fast(void) {
+	glob_t names;
+	size_t i;
+	char name[32], path[128];
+	FILE *fp;
+	int res = -1;
+
+	if(glob("/sys/class/hwmon/hwmon*/name", 0, NULL, &names))
+		return -1;
+
+	for(i = 0; i < names.gl_pathc; i++) {
+		fp = fopen(names.gl_pathv[i], "r");
+		if(!fp)
+			continue;
+
+		if(fscanf(fp, "%31s", name) == 1 && !strcmp(name, "dht20")) {
+			snprintf(path, sizeof(path), "%.*s/update_interval",
+				(int)(strlen(names.gl_pathv[i]) - strlen("/name")), names.gl_pathv[i]);
+			res = write_str(path, "1");
+		}
+
+		fclose(fp);
+	}
+
+	globfree(&names);
+
+	return res;
+}
+
+// the driver works on its own, sample for the given time
+int run_passive(const struct scenario *sc, struct result *res, int seconds) {
+	double start;
+
+	start = now_s();
+
+	while(now_s() - start < seconds) {
+		usleep(DRAIN_MS * 1000);
+
+		if(read_sim_latency(sc->chip, &res->device)) {
+			fprintf(stderr, "Failed to read the i2c_sim latencies of %s. \n", sc->chip);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int setup_dht20(void) {
+	if(dht20_fast()) {
+		fprintf(stderr, "Failed to set the DHT20 update_interval. \n");
+		return -1;
+	}
+
+	// let the new interval take over before measuring
+	sleep(1);
+
+	return 0;
+}
+
+void print_lat(const char *key, struct lat_buf *buf) {
+	if(buf->nr)
+		qsort(buf->val, buf->nr, sizeof(*buf->val), cmp_ull);
+
+	printf("\"%s\": {\"count\": %zu, \"lost\": %llu, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+		key, buf->nr, buf->lost, lat_pct(buf, 0.50), lat_pct(buf, 0.99), lat_pct(buf, 0.999),
+		buf->nr ? buf->val[buf->nr - 1] : 0);
+}
+
+void print_json(const struct scenario *sc, struct result *res) {
+	double per = res->samples ? 1.0 / res->samples : 0;
+
+	printf("{\"scenario\": \"%s\", \"chip\": \"%s\", \"seconds\": %.3f, ", sc->name, sc->chip, res->seconds);
+	printf("\"samples\": %llu, \"samples_per_sec\": %.2f, ", res->samples, res->samples / res->seconds);
+
+	// trigger or interrupt to user-space where the driver delivers to it, else to the data fetch
+	print_lat("latency_ns", res->user.nr ? &res->user : &res->device);
+	printf(", \"latency_source\": \"%s\", ", res->user.nr ? "user" : "device");
+	print_lat("fetch_latency_ns", &res->device);
+
+	printf(", \"cpu_us_per_sample\": %.2f, ", res->cpu_s * 1e6 * per);
+	printf("\"system_cpu_us_per_sample\": %.2f, ", res->system_cpu_s * 1e6 * per);
+	printf("\"xfers_per_sample\": %.3f, \"msgs_per_sample\": %.3f, \"bytes_per_sample\": %.3f, ",
+		res->stats.xfers * per, res->stats.msgs * per, res->stats.bytes * per);
+	printf("\"device_samples\": %llu, \"irqs\": %llu, \"fetches\": %llu}\n",
+		res->stats.samples, res->stats.irqs, res->stats.fetches);
+}
+
+static const struct scenario scenarios[] = {
+	{"stts22h", "STTS22H-3c", NULL, run_stts22h},
+	{"dht20", "DHT20-38", setup_dht20, run_passive},
+	{"bma400", "BMA400-14", NULL, run_passive},
+	{"isl29125", "ISL29125-44", NULL, run_passive},
+};
+
+int main(int argc, char* argv[]) {
+	int i, seconds, adapter;
+	double start, cpu, hub;
+	const struct scenario *sc = NULL;
+	struct result res;
+
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s <stts22h|dht20|bma400|isl29125> [seconds] \n", argv[0]);
+		return 1;
+	}
+
+	for(i = 0; i < (int)(sizeof(scenarios) / sizeof(scenarios[0])); i++)
+		if(!strcmp(argv[1], scenarios[i].name))
+			sc = &scenarios[i];
+
+	if(!sc) {
+		fprintf(stderr, "Unknown scenario %s. \n", argv[1]);
+		return 1;
+	}
+
+	seconds = argc > 2 ? atoi(argv[2]) : 10;
+
+	memset(&res, 0, sizeof(res));
+
+	if(sc->setup && sc->setup())
+		return 1;
+
+	if(write_str(SIM_DEBUGFS "/reset", "1")) {
+		fprintf(stderr, "Failed to reset the i2c_sim counters, is debugfs mounted? \n");
+		return 1;
+	}
+
+	if(read_int(SIM_PARAMS "/adapter_nr", &adapter)) {
+		fprintf(stderr, "Failed to read the adapter of i2c_sim. \n");
+		return 1;
+	}
+
+	hub = hub_busy_s(adapter);
+	cpu = cpu_busy_s();
+	start = now_s();
+
+	if(sc->run(sc, &res, seconds))
+		return 1;
+
+	res.seconds = now_s() - start;
+	res.system_cpu_s = cpu_busy_s() - cpu;
+	res.cpu_s = hub_busy_s(adapter) - hub;
+
+	if(read_sim_stats(sc->chip, &res.stats) || read_sim_latency(sc->chip, &res.device)) {
+		fprintf(stderr, "Failed to read the i2c_sim counters of %s. \n", sc->chip);
+		return 1;
+	}
+
+	// drivers without a user-space path deliver a sample when they fetch it
+	if(!res.samples)
+		res.samples = res.stats.fetches;
+
+	print_json(sc, &res);
+
+	free(res.user.val);
+	free(res.device.val);
+
+	return 0;
+}
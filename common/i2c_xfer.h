@@ -0,0 +1,411 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* Combined-message I2C transfers shared by the sensor drivers
+
+   Register accesses are built as i2c_transfer message sequences joined
+   by repeated starts, so a register write plus read-back, or several
+   register reads, cost one bus transaction. Adapters without plain I2C
+   support fall back to one SMBus call per segment.
+
+   Every operation is accounted in a struct i2c_xfer_stats, the table
+   of a driver is exported read-only as the xfer_stats module parameter:
+   name, operations, transactions, messages, errors per line.
+
+   A driver traces every transaction by defining I2C_XFER_TRACE(client,
+   stats, msgs, ns, result) and I2C_XFER_TRACE_ON() before including
+   this header, typically around its trace event, the duration is only
+   measured while I2C_XFER_TRACE_ON() is true.
+
+   A driver runs every operation on the acquisition worker of its bus
+   (common/sensor_hub.h) by defining I2C_XFER_HUB(client) to the hub of
+   the client, so operations of user context are queued behind the
+   background work of the bus instead of interleaving with it. NULL, the
+   default, runs them in the caller's context.
+
+   Copyright (c) 2024,2024 Zixuan Qiao <zqiao104@uottawa.ca> */
+
+#ifndef I2C_XFER_HEADER
+#define I2C_XFER_HEADER
+
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/atomic.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/i2c.h>
+
+#include "sensor_hub.h"
+
+#ifndef I2C_XFER_TRACE
+#define I2C_XFER_TRACE(client, stats, msgs, ns, result) do { } while (0)
+#define I2C_XFER_TRACE_ON() false
+#endif
+
+#ifndef I2C_XFER_HUB
+#define I2C_XFER_HUB(client) NULL
+#endif
+
+/* Longest register block written in one message */
+#define I2C_XFER_MAX_LEN 8
+
+/* Most register reads joined in one transaction */
+#define I2C_XFER_MAX_SEGS 3
+
+struct i2c_xfer_stats {
+	const char *name;
+	atomic_t ops;		/* driver level operations */
+	atomic_t xfers;		/* bus transactions, start to stop */
+	atomic_t msgs;		/* messages, i.e. (repeated) starts */
+	atomic_t errors;
+};
+
+#define I2C_XFER_OP(op_name) { .name = op_name }
+
+struct i2c_xfer_table {
+	struct i2c_xfer_stats *stats;
+	int nr;
+};
+
+/* One register read of a combined transaction */
+struct i2c_xfer_seg {
+	u8 reg;
+	u8 len;
+	u8 *buf;
+};
+
+/*
+ * i2c_xfer_begin - Account the start of a driver level operation
+ */
+static inline void i2c_xfer_begin(struct i2c_xfer_stats *stats)
+{
+	if (stats)
+		atomic_inc(&stats->ops);
+}
+
+/* Start of a transaction, 0 unless it is traced */
+static inline u64 i2c_xfer_clock(void)
+{
+	return I2C_XFER_TRACE_ON() ? ktime_get_ns() : 0;
+}
+
+/* result is 0 or a negative errno */
+static inline void
+i2c_xfer_account(struct i2c_client *client, struct i2c_xfer_stats *stats,
+					int msgs, int result, u64 start)
+{
+	if (start)
+		I2C_XFER_TRACE(client, stats, msgs, ktime_get_ns() - start,
+								result);
+
+	if (!stats)
+		return;
+
+	atomic_inc(&stats->xfers);
+	atomic_add(msgs, &stats->msgs);
+
+	if (result)
+		atomic_inc(&stats->errors);
+}
+
+static inline bool i2c_xfer_raw(struct i2c_client *client)
+{
+	return i2c_check_functionality(client->adapter, I2C_FUNC_I2C);
+}
+
+static inline void i2c_xfer_msg(struct i2c_msg *msg, struct i2c_client *client,
+					u16 flags, u8 *buf, u16 len)
+{
+	msg->addr = client->addr;
+	msg->flags = (client->flags & I2C_M_TEN) | flags;
+	msg->len = len;
+	msg->buf = buf;
+}
+
+/*
+ * i2c_xfer - Run a message sequence as one transaction
+ * Return error code on error, 0 on success
+ */
+static inline int i2c_xfer(struct i2c_client *client, struct i2c_msg *msgs,
+				int num, struct i2c_xfer_stats *stats)
+{
+	int result;
+	u64 start = i2c_xfer_clock();
+
+	result = i2c_transfer(client->adapter, msgs, num);
+	if (result >= 0)
+		result = result == num ? 0 : -EIO;
+
+	i2c_xfer_account(client, stats, num, result, start);
+
+	return result;
+}
+
+/* Operation handed to the hub, see i2c_xfer_on_hub */
+struct i2c_xfer_call {
+	int (*op)(struct i2c_xfer_call *call);
+	struct i2c_client *client;
+	struct i2c_xfer_seg *segs;
+	int nr;
+	u8 reg;
+	const u8 *vals;
+	u8 len;
+	struct i2c_xfer_stats *stats;
+};
+
+static inline int i2c_xfer_call_run(void *arg)
+{
+	struct i2c_xfer_call *call = arg;
+
+	return call->op(call);
+}
+
+/* Run an operation on the hub of the client if it has one */
+static inline int i2c_xfer_on_hub(struct i2c_xfer_call *call)
+{
+	struct sensor_hub *hub = I2C_XFER_HUB(call->client);
+
+	if (!hub)
+		return call->op(call);
+
+	return sensor_hub_call(hub, i2c_xfer_call_run, call);
+}
+
+static inline int __i2c_xfer_read_multi(struct i2c_client *client,
+		struct i2c_xfer_seg *segs, int nr, struct i2c_xfer_stats *stats)
+{
+	int i, result;
+	u64 start;
+	struct i2c_msg msgs[2 * I2C_XFER_MAX_SEGS];
+
+	if (nr > I2C_XFER_MAX_SEGS)
+		return -EINVAL;
+
+	if (i2c_xfer_raw(client)) {
+		for (i = 0; i < nr; i++) {
+			i2c_xfer_msg(&msgs[2 * i], client, 0, &segs[i].reg, 1);
+			i2c_xfer_msg(&msgs[2 * i + 1], client, I2C_M_RD,
+						segs[i].buf, segs[i].len);
+		}
+
+		return i2c_xfer(client, msgs, 2 * nr, stats);
+	}
+
+	for (i = 0; i < nr; i++) {
+		start = i2c_xfer_clock();
+
+		if (segs[i].len == 1) {
+			result = i2c_smbus_read_byte_data(client, segs[i].reg);
+			if (result >= 0) {
+				segs[i].buf[0] = (u8)result;
+				result = 0;
+			}
+		} else {
+			result = i2c_smbus_read_i2c_block_data(client,
+				segs[i].reg, segs[i].len, segs[i].buf);
+			if (result >= 0)
+				result = result == segs[i].len ? 0 : -EIO;
+		}
+
+		i2c_xfer_account(client, stats, 2, result, start);
+
+		if (result)
+			return result;
+	}
+
+	return 0;
+}
+
+static inline int i2c_xfer_read_multi_op(struct i2c_xfer_call *call)
+{
+	return __i2c_xfer_read_multi(call->client, call->segs, call->nr,
+								call->stats);
+}
+
+/*
+ * i2c_xfer_read_multi - Read several register blocks in one transaction,
+ * every block is an address write followed by a repeated start read
+ * Return error code on error, 0 on success
+ */
+static inline int i2c_xfer_read_multi(struct i2c_client *client,
+		struct i2c_xfer_seg *segs, int nr, struct i2c_xfer_stats *stats)
+{
+	struct i2c_xfer_call call = {
+		.op = i2c_xfer_read_multi_op,
+		.client = client,
+		.segs = segs,
+		.nr = nr,
+		.stats = stats,
+	};
+
+	return i2c_xfer_on_hub(&call);
+}
+
+/*
+ * i2c_xfer_read - Read len bytes starting at reg in one transaction
+ * Return error code on error, 0 on success
+ */
+static inline int i2c_xfer_read(struct i2c_client *client, u8 reg,
+			u8 *buf, u8 len, struct i2c_xfer_stats *stats)
+{
+	struct i2c_xfer_seg seg = {
+		.reg = reg,
+		.len = len,
+		.buf = buf,
+	};
+
+	return i2c_xfer_read_multi(client, &seg, 1, stats);
+}
+
+static inline int __i2c_xfer_write(struct i2c_client *client, u8 reg,
+		const u8 *vals, u8 len, struct i2c_xfer_stats *stats)
+{
+	int result;
+	u64 start;
+	u8 out[I2C_XFER_MAX_LEN + 1];
+	struct i2c_msg msg;
+
+	if (len > I2C_XFER_MAX_LEN)
+		return -EINVAL;
+
+	if (i2c_xfer_raw(client)) {
+		out[0] = reg;
+		memcpy(&out[1], vals, len);
+
+		i2c_xfer_msg(&msg, client, 0, out, len + 1);
+
+		return i2c_xfer(client, &msg, 1, stats);
+	}
+
+	start = i2c_xfer_clock();
+
+	if (len == 1)
+		result = i2c_smbus_write_byte_data(client, reg, vals[0]);
+	else
+		result = i2c_smbus_write_i2c_block_data(client, reg, len, vals);
+
+	if (result > 0)
+		result = 0;
+
+	i2c_xfer_account(client, stats, 1, result, start);
+
+	return result;
+}
+
+static inline int i2c_xfer_write_op(struct i2c_xfer_call *call)
+{
+	return __i2c_xfer_write(call->client, call->reg, call->vals,
+						call->len, call->stats);
+}
+
+/*
+ * i2c_xfer_write - Write len bytes starting at reg in one transaction,
+ * relies on address auto-increment for len > 1
+ * Return error code on error, 0 on success
+ */
+static inline int i2c_xfer_write(struct i2c_client *client, u8 reg,
+		const u8 *vals, u8 len, struct i2c_xfer_stats *stats)
+{
+	struct i2c_xfer_call call = {
+		.op = i2c_xfer_write_op,
+		.client = client,
+		.reg = reg,
+		.vals = vals,
+		.len = len,
+		.stats = stats,
+	};
+
+	return i2c_xfer_on_hub(&call);
+}
+
+static inline int __i2c_xfer_write_verify(struct i2c_client *client, u8 reg,
+		const u8 *vals, u8 len, struct i2c_xfer_stats *stats)
+{
+	int result;
+	u8 out[I2C_XFER_MAX_LEN + 1], back[I2C_XFER_MAX_LEN];
+	struct i2c_msg msgs[3];
+
+	if (len > I2C_XFER_MAX_LEN)
+		return -EINVAL;
+
+	if (i2c_xfer_raw(client)) {
+		out[0] = reg;
+		memcpy(&out[1], vals, len);
+
+		i2c_xfer_msg(&msgs[0], client, 0, out, len + 1);
+		i2c_xfer_msg(&msgs[1], client, 0, out, 1);
+		i2c_xfer_msg(&msgs[2], client, I2C_M_RD, back, len);
+
+		result = i2c_xfer(client, msgs, 3, stats);
+	} else {
+		struct i2c_xfer_seg seg = {
+			.reg = reg,
+			.len = len,
+			.buf = back,
+		};
+
+		result = __i2c_xfer_write(client, reg, vals, len, stats);
+		if (!result)
+			result = __i2c_xfer_read_multi(client, &seg, 1, stats);
+	}
+
+	if (result)
+		return result;
+
+	return memcmp(vals, back, len) ? -EAGAIN : 0;
+}
+
+static inline int i2c_xfer_write_verify_op(struct i2c_xfer_call *call)
+{
+	return __i2c_xfer_write_verify(call->client, call->reg, call->vals,
+						call->len, call->stats);
+}
+
+/*
+ * i2c_xfer_write_verify - Write len bytes starting at reg and read them
+ * back in the same transaction
+ * Return error code on error, -EAGAIN on mismatch, 0 on success
+ */
+static inline int i2c_xfer_write_verify(struct i2c_client *client, u8 reg,
+		const u8 *vals, u8 len, struct i2c_xfer_stats *stats)
+{
+	struct i2c_xfer_call call = {
+		.op = i2c_xfer_write_verify_op,
+		.client = client,
+		.reg = reg,
+		.vals = vals,
+		.len = len,
+		.stats = stats,
+	};
+
+	return i2c_xfer_on_hub(&call);
+}
+
+static int i2c_xfer_stats_get(char *buffer, const struct kernel_param *kp)
+{
+	int i, len = 0;
+	const struct i2c_xfer_table *table = kp->arg;
+
+	for (i = 0; i < table->nr; i++)
+		len += scnprintf(buffer + len, PAGE_SIZE - len,
+			"%s %d %d %d %d\n", table->stats[i].name,
+			atomic_read(&table->stats[i].ops),
+			atomic_read(&table->stats[i].xfers),
+			atomic_read(&table->stats[i].msgs),
+			atomic_read(&table->stats[i].errors));
+
+	return len;
+}
+
+static const struct kernel_param_ops i2c_xfer_stats_ops = {
+	.get = i2c_xfer_stats_get,
+};
+
+/* Export a driver's counters as /sys/module/<driver>/parameters/xfer_stats */
+#define I2C_XFER_STATS(stats_array)					\
+	static struct i2c_xfer_table i2c_xfer_table = {			\
+		.stats = stats_array,					\
+		.nr = ARRAY_SIZE(stats_array),				\
+	};								\
+	module_param_cb(xfer_stats, &i2c_xfer_stats_ops, 		\
+						&i2c_xfer_table, 0444)
+
+#endif
@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* Per-adapter acquisition workers shared by the sensor drivers
+
+   The sensor_hub module runs one ordered workqueue per I2C adapter.
+   Drivers queue their background bus work on the hub of the adapter
+   their device sits on instead of a private workqueue, and run the bus
+   accesses of user context (reads, ioctls, setup) through
+   sensor_hub_call(), so every operation of one bus runs back-to-back in
+   queueing order and never interleaves, while different buses proceed
+   in parallel. Queueing work that is still pending is dropped in favour
+   of the pending run, the only merging done. Hub work must not sleep
+   for long, a wait delays every sensor on the bus: requeue with a delay
+   instead.
+
+   Scheduling statistics are kept per adapter in
+   /sys/kernel/debug/sensor_hub/i2c-<nr>/stats.
+
+   Drivers link against sensor_hub (KBUILD_EXTRA_SYMBOLS), which has to
+   be loaded first.
+
+   Copyright (c) 2024,2024 Zixuan Qiao <zqiao104@uottawa.ca> */
+
+#ifndef SENSOR_HUB_HEADER
+#define SENSOR_HUB_HEADER
+
+#include <linux/types.h>
+#include <linux/workqueue.h>
+#include <linux/i2c.h>
+
+struct sensor_hub;
+
+struct sensor_hub_work {
+	struct delayed_work dw;
+	void (*func)(struct sensor_hub_work *work);
+	struct sensor_hub *hub;		/* set when queued */
+	u64 due;			/* ktime_get_ns() the run is due at */
+};
+
+/*
+ * sensor_hub_get - Find or create the hub of an adapter, may sleep
+ * Return ERR_PTR on error, the hub on success
+ */
+struct sensor_hub *sensor_hub_get(struct i2c_adapter *adpt);
+
+/* Drop a client, its work must have been cancelled */
+void sensor_hub_put(struct sensor_hub *hub);
+
+void sensor_hub_init_work(struct sensor_hub_work *work,
+			void (*func)(struct sensor_hub_work *work));
+
+/*
+ * sensor_hub_queue - Run work on the hub after delay jiffies, safe from
+ * interrupt context
+ * Return false if the work was pending already, true otherwise
+ */
+bool sensor_hub_queue(struct sensor_hub *hub, struct sensor_hub_work *work,
+							unsigned long delay);
+
+/*
+ * sensor_hub_call - Run func(arg) on the hub and wait for it, may sleep.
+ * Called from work of the same hub it runs func directly
+ * Return the result of func
+ */
+int sensor_hub_call(struct sensor_hub *hub, int (*func)(void *arg), void *arg);
+
+/*
+ * sensor_hub_cancel - Cancel pending work and wait for a running one
+ * Return true if the work was pending
+ */
+bool sensor_hub_cancel(struct sensor_hub_work *work);
+
+#endif
@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* Per-device statistics shared by the sensor drivers
+
+   Counters and log2 histograms are kept per CPU, so updating them from
+   the interrupt handler, the bottom half or a read is a local increment
+   without atomics or locks. They are summed when the debugfs stats file
+   of the device is read and cleared when anything is written to it:
+
+   name value			one line per counter
+   hist lower_bound count	one line per non-empty bucket, in ns
+
+   Clearing races with concurrent updates, an increment landing in the
+   middle of it may survive.
+
+   Copyright (c) 2024,2024 Zixuan Qiao <zqiao104@uottawa.ca> */
+
+#ifndef SENSOR_STATS_HEADER
+#define SENSOR_STATS_HEADER
+
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+enum sensor_stat {
+	SENSOR_XFERS,		/* bus transactions */
+	SENSOR_XFER_ERRORS,
+	SENSOR_RETRIES,		/* status re-checks while converting */
+	SENSOR_VERIFY_FAILS,	/* read-back mismatch of a config write */
+	SENSOR_IRQS,		/* interrupts or timer ticks */
+	SENSOR_COALESCED,	/* arrived while the previous one was pending */
+	SENSOR_SAMPLES,		/* delivered to a reader or a buffer */
+	SENSOR_DROPPED,		/* fetched or expected but never delivered */
+	NR_SENSOR_STATS,
+};
+
+enum sensor_hist {
+	SENSOR_XFER_NS,		/* duration of a bus transaction */
+	SENSOR_LATENCY_NS,	/* interrupt or trigger to delivery */
+	NR_SENSOR_HISTS,
+};
+
+/* Bucket i counts values in [2^(i-1), 2^i) ns, the last one the rest */
+#define SENSOR_HIST_BUCKETS 32
+
+struct sensor_stats_cpu {
+	u64 count[NR_SENSOR_STATS];
+	u64 hist[NR_SENSOR_HISTS][SENSOR_HIST_BUCKETS];
+};
+
+struct sensor_stats {
+	struct sensor_stats_cpu __percpu *cpu;
+	struct dentry *dir;
+};
+
+static const char * const sensor_stat_names[NR_SENSOR_STATS] = {
+	[SENSOR_XFERS] = "xfers",
+	[SENSOR_XFER_ERRORS] = "xfer_errors",
+	[SENSOR_RETRIES] = "retries",
+	[SENSOR_VERIFY_FAILS] = "verify_fails",
+	[SENSOR_IRQS] = "irqs",
+	[SENSOR_COALESCED] = "coalesced",
+	[SENSOR_SAMPLES] = "samples",
+	[SENSOR_DROPPED] = "dropped",
+};
+
+static const char * const sensor_hist_names[NR_SENSOR_HISTS] = {
+	[SENSOR_XFER_NS] = "xfer_ns",
+	[SENSOR_LATENCY_NS] = "latency_ns",
+};
+
+/*
+ * sensor_stats_init - Allocate the per-CPU counters, may sleep
+ * Return error code on error, 0 on success
+ */
+static inline int sensor_stats_init(struct sensor_stats *stats)
+{
+	stats->cpu = alloc_percpu(struct sensor_stats_cpu);
+	stats->dir = NULL;
+
+	return stats->cpu ? 0 : -ENOMEM;
+}
+
+/* Safe from atomic context, e.g. an RCU callback */
+static inline void sensor_stats_free(struct sensor_stats *stats)
+{
+	free_percpu(stats->cpu);
+	stats->cpu = NULL;
+}
+
+static inline void sensor_stats_add(struct sensor_stats *stats,
+					enum sensor_stat stat, u64 val)
+{
+	if (stats->cpu)
+		this_cpu_add(stats->cpu->count[stat], val);
+}
+
+static inline void sensor_stats_inc(struct sensor_stats *stats,
+						enum sensor_stat stat)
+{
+	sensor_stats_add(stats, stat, 1);
+}
+
+static inline void sensor_stats_hist(struct sensor_stats *stats,
+					enum sensor_hist hist, u64 ns)
+{
+	if (stats->cpu)
+		this_cpu_inc(stats->cpu->hist[hist][min_t(int, fls64(ns),
+						SENSOR_HIST_BUCKETS - 1)]);
+}
+
+/* Account one bus transaction, result is 0 or a negative errno */
+static inline void sensor_stats_xfer(struct sensor_stats *stats, u64 ns,
+								int result)
+{
+	sensor_stats_inc(stats, SENSOR_XFERS);
+
+	if (result)
+		sensor_stats_inc(stats, SENSOR_XFER_ERRORS);
+
+	sensor_stats_hist(stats, SENSOR_XFER_NS, ns);
+}
+
+static inline void sensor_stats_reset(struct sensor_stats *stats)
+{
+	int cpu;
+
+	if (!stats->cpu)
+		return;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(stats->cpu, cpu), 0,
+					sizeof(struct sensor_stats_cpu));
+}
+
+/*
+ * sensor_stats_print - Sum the counters over all CPUs and print them in
+ * the format described at the top of this file
+ */
+static inline void sensor_stats_print(struct seq_file *s,
+					struct sensor_stats *stats)
+{
+	int cpu, i, j;
+	u64 count[NR_SENSOR_STATS] = {0};
+	u64 hist[SENSOR_HIST_BUCKETS];
+	struct sensor_stats_cpu *pcpu;
+
+	if (!stats->cpu)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(stats->cpu, cpu);
+
+		for (i = 0; i < NR_SENSOR_STATS; i++)
+			count[i] += READ_ONCE(pcpu->count[i]);
+	}
+
+	for (i = 0; i < NR_SENSOR_STATS; i++)
+		seq_printf(s, "%s %llu\n", sensor_stat_names[i], count[i]);
+
+	for (i = 0; i < NR_SENSOR_HISTS; i++) {
+		memset(hist, 0, sizeof(hist));
+
+		for_each_possible_cpu(cpu) {
+			pcpu = per_cpu_ptr(stats->cpu, cpu);
+
+			for (j = 0; j < SENSOR_HIST_BUCKETS; j++)
+				hist[j] += READ_ONCE(pcpu->hist[i][j]);
+		}
+
+		for (j = 0; j < SENSOR_HIST_BUCKETS; j++)
+			if (hist[j])
+				seq_printf(s, "%s %llu %llu\n",
+					sensor_hist_names[i],
+					j ? 1ULL << (j - 1) : 0, hist[j]);
+	}
+}
+
+static int sensor_stats_show(struct seq_file *s, void *unused)
+{
+	sensor_stats_print(s, s->private);
+
+	return 0;
+}
+
+static int sensor_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sensor_stats_show, inode->i_private);
+}
+
+static ssize_t sensor_stats_write(struct file *file, const char __user *buf,
+						size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+
+	sensor_stats_reset(s->private);
+
+	return count;
+}
+
+static const struct file_operations sensor_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = sensor_stats_open,
+	.read = seq_read,
+	.write = sensor_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void sensor_stats_release(void *data)
+{
+	struct sensor_stats *stats = data;
+
+	debugfs_remove_recursive(stats->dir);
+	sensor_stats_free(stats);
+}
+
+/*
+ * devm_sensor_stats_init - Allocate the counters of a device and export
+ * them as <parent>/<dev_name>/stats, both go away after remove. A
+ * missing debugfs only hides the file
+ * Return error code on error, 0 on success
+ */
+static inline int devm_sensor_stats_init(struct device *dev,
+			struct sensor_stats *stats, struct dentry *parent)
+{
+	int result;
+
+	result = sensor_stats_init(stats);
+	if (result)
+		return result;
+
+	stats->dir = debugfs_create_dir(dev_name(dev), parent);
+	debugfs_create_file("stats", 0600, stats->dir, stats,
+						&sensor_stats_fops);
+
+	return devm_add_action_or_reset(dev, sensor_stats_release, stats);
+}
+
+#endif
@@ -0,0 +1,1127 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Virtual I2C adapter emulating DHT20, ISL29125, BMA400 and STTS22H
+
+   Registers an I2C adapter whose devices follow the register maps and
+   timing of the real chips, and a gpio chip whose lines raise software
+   interrupts, so every driver can be loaded and exercised without the
+   sensors attached
+
+   Copyright (c) 2024,2024 Zixuan Qiao <zqiao104@uottawa.ca> */
+
+#include "i2c_sim.h"
+
+static int adapter_nr = -1;
+module_param(adapter_nr, int, 0444);
+MODULE_PARM_DESC(adapter_nr, "Adapter number to register, -1 for a dynamic one, reports the number in use");
+
+static int gpio_base = -1;
+module_param(gpio_base, int, 0444);
+MODULE_PARM_DESC(gpio_base, "First gpio of the interrupt lines (ISL29125, BMA400), -1 for a dynamic one, reports the base in use");
+
+static int nr_stts22h = 1;
+module_param(nr_stts22h, int, 0444);
+MODULE_PARM_DESC(nr_stts22h, "Number of STTS22H instances at 0x3C, 0x3E, 0x3F");
+
+static unsigned int bus_khz;
+module_param(bus_khz, uint, 0644);
+MODULE_PARM_DESC(bus_khz, "Simulated bus clock in kHz, transfers take as long as on a real bus, 0 for no delay");
+
+/* Values reported by the chips */
+static int temp = 25000;
+module_param(temp, int, 0644);
+MODULE_PARM_DESC(temp, "Temperature in milli-degree Celsius (DHT20, STTS22H)");
+
+static unsigned int humidity = 45000;
+module_param(humidity, uint, 0644);
+MODULE_PARM_DESC(humidity, "Relative humidity in milli-percent (DHT20)");
+
+static unsigned int red = 0x0200;
+static unsigned int green = 0x0300;
+static unsigned int blue = 0x0100;
+module_param(red, uint, 0644);
+MODULE_PARM_DESC(red, "Raw red count (ISL29125)");
+module_param(green, uint, 0644);
+MODULE_PARM_DESC(green, "Raw green count (ISL29125)");
+module_param(blue, uint, 0644);
+MODULE_PARM_DESC(blue, "Raw blue count (ISL29125)");
+
+static int accel_x;
+static int accel_y;
+static int accel_z = 1000;
+module_param(accel_x, int, 0644);
+MODULE_PARM_DESC(accel_x, "X acceleration in mg (BMA400)");
+module_param(accel_y, int, 0644);
+MODULE_PARM_DESC(accel_y, "Y acceleration in mg (BMA400)");
+module_param(accel_z, int, 0644);
+MODULE_PARM_DESC(accel_z, "Z acceleration in mg (BMA400)");
+
+static unsigned int noise;
+module_param(noise, uint, 0644);
+MODULE_PARM_DESC(noise, "Uniform noise added to every raw sample in LSB, 0 for repeatable values");
+
+/* Timing */
+static unsigned int dht20_conv_ms = 80;
+module_param(dht20_conv_ms, uint, 0644);
+MODULE_PARM_DESC(dht20_conv_ms, "DHT20 measurement time in ms");
+
+static unsigned int stts22h_conv_us = 1000;
+module_param(stts22h_conv_us, uint, 0644);
+MODULE_PARM_DESC(stts22h_conv_us, "STTS22H one-shot conversion time in us");
+
+static unsigned int event_ms = 1000;
+module_param(event_ms, uint, 0644);
+MODULE_PARM_DESC(event_ms, "Interval of BMA400 wake-up and tap events in ms");
+
+static struct sim_dev sim_devs[3 + SIM_MAX_STTS22H];
+static int nr_sim_devs;
+static bool sim_stopping;
+
+static const u16 STTS22H_addrs[SIM_MAX_STTS22H] = {0x3C, 0x3E, 0x3F};
+static u8 BMA400_fifo[BMA400_FIFO_SIZE];
+
+static struct dentry *sim_debugfs;
+
+static int sim_irq_base;
+static struct sim_dev *sim_line_dev[NR_LINES];
+
+/* ISL29125 pulls its open-drain output low, BMA400 drives it high */
+static const bool sim_active_low[NR_LINES] = {
+	[LINE_ISL29125] = true,
+};
+
+static int sim_noise(void)
+{
+	unsigned int n = READ_ONCE(noise);
+
+	if (!n)
+		return 0;
+
+	return (int)prandom_u32_max(2 * n + 1) - (int)n;
+}
+
+/*
+ * sim_assert - Raise the interrupt line of a chip
+ * A latched line stays asserted until the driver reads the interrupt
+ * status, a pulse leaves it idle again
+ * Return true if an edge is generated
+ */
+static bool sim_assert(struct sim_dev *dev, bool latch)
+{
+	if (dev->asserted)
+		return false;
+
+	dev->asserted = latch;
+
+	return true;
+}
+
+/* A sample has been announced, by a trigger command or an interrupt */
+static void sim_mark(struct sim_dev *dev)
+{
+	dev->mark = ktime_get();
+}
+
+/* The driver reads the data of the announced sample */
+static void sim_fetch(struct sim_dev *dev)
+{
+	s64 ns;
+
+	if (!dev->mark)
+		return;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), dev->mark));
+
+	dev->lat[dev->lat_count++ & (SIM_LAT_LEN - 1)] = min_t(s64, ns, U32_MAX);
+	dev->stats.fetches++;
+	dev->mark = 0;
+}
+
+static void sim_next(struct sim_dev *dev)
+{
+	if (!dev->no_inc && dev->ptr != dev->hold_reg)
+		dev->ptr++;
+}
+
+/* Register pointer write followed by auto-incremented data bytes */
+static void sim_reg_write(struct sim_dev *dev, const u8 *buf, int len)
+{
+	int i;
+
+	if (!len)
+		return;
+
+	dev->ptr = buf[0];
+
+	for (i = 1; i < len; i++) {
+		if (dev->ptr < SIM_REGS)
+			dev->ops->store(dev, dev->ptr, buf[i]);
+
+		sim_next(dev);
+	}
+}
+
+static void sim_reg_read(struct sim_dev *dev, u8 *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = dev->ptr < SIM_REGS ? dev->ops->load(dev, dev->ptr) : 0;
+
+		sim_next(dev);
+	}
+}
+
+/* ---- DHT20 ---- */
+
+static u8 DHT20_crc8(const u8 *data, int len)
+{
+	int i, j;
+	u8 crc = DHT20_CRC_INIT;
+
+	for (i = 0; i < len; i++) {
+		crc ^= data[i];
+
+		for (j = 0; j < 8; j++)
+			crc = crc & 0x80 ? (crc << 1) ^ DHT20_CRC_POLY : crc << 1;
+	}
+
+	return crc;
+}
+
+static void DHT20_reset(struct sim_dev *dev)
+{
+	memset(dev->regs, 0, SIM_REGS);
+	dev->pending = false;
+}
+
+/* regs[1..5] hold the 20-bit humidity and temperature of the last measurement */
+static void DHT20_measure(struct sim_dev *dev)
+{
+	u32 raw_hum, raw_temp;
+	int t, h;
+
+	h = clamp_t(int, READ_ONCE(humidity), 0, 100000);
+	t = clamp_t(int, READ_ONCE(temp), -50000, 150000);
+
+	// RH = raw / 2^20 * 100%, T = raw / 2^20 * 200 - 50
+	raw_hum = (u32)div_u64((u64)h << 20, 100000);
+	raw_temp = (u32)div_u64((u64)(t + 50000) << 20, 200000);
+
+	raw_hum = clamp_t(int, (int)raw_hum + sim_noise(), 0, 0xFFFFF);
+	raw_temp = clamp_t(int, (int)raw_temp + sim_noise(), 0, 0xFFFFF);
+
+	dev->regs[1] = raw_hum >> 12;
+	dev->regs[2] = raw_hum >> 4;
+	dev->regs[3] = ((raw_hum & 0x0F) << 4) | ((raw_temp >> 16) & 0x0F);
+	dev->regs[4] = raw_temp >> 8;
+	dev->regs[5] = raw_temp;
+
+	dev->stats.samples++;
+}
+
+static void DHT20_write(struct sim_dev *dev, const u8 *buf, int len)
+{
+	if (!len)
+		return;
+
+	switch (buf[0]) {
+	case DHT20_CMD_TRIGGER:
+		dev->pending = true;
+		dev->busy_until = ktime_add_ms(ktime_get(), READ_ONCE(dht20_conv_ms));
+		sim_mark(dev);
+		break;
+
+	case DHT20_CMD_RESET:
+		DHT20_reset(dev);
+		break;
+
+	/* DHT20_CMD_STATUS only selects the status byte, which always comes first */
+	default:
+		break;
+	}
+}
+
+static void DHT20_read(struct sim_dev *dev, u8 *buf, int len)
+{
+	u8 frame[DHT20_FRAME_LEN];
+
+	if (dev->pending && !ktime_before(ktime_get(), dev->busy_until)) {
+		DHT20_measure(dev);
+		dev->pending = false;
+	}
+
+	if (!dev->pending)
+		sim_fetch(dev);
+
+	frame[0] = DHT20_STATUS_CAL | (dev->pending ? DHT20_STATUS_BUSY : 0);
+	memcpy(&frame[1], &dev->regs[1], 5);
+	frame[6] = DHT20_crc8(frame, DHT20_FRAME_LEN - 1);
+
+	memset(buf, 0xFF, len);
+	memcpy(buf, frame, min(len, DHT20_FRAME_LEN));
+}
+
+static const struct sim_ops DHT20_ops = {
+	.name = "DHT20",
+	.reset = DHT20_reset,
+	.write = DHT20_write,
+	.read = DHT20_read,
+};
+
+/* ---- STTS22H ---- */
+
+static void STTS22H_reset(struct sim_dev *dev)
+{
+	memset(dev->regs, 0, SIM_REGS);
+	dev->regs[STTS22H_WHOAMI] = STTS22H_ID;
+	dev->no_inc = true;
+	dev->pending = false;
+}
+
+/* Sampling period in free-run (25 Hz << AVG) and low ODR (1 Hz) mode */
+static u64 STTS22H_odr_ns(struct sim_dev *dev)
+{
+	u8 ctrl = dev->regs[STTS22H_CTRL];
+
+	if (ctrl & STTS22H_LOW_ODR)
+		return STTS22H_LOW_ODR_MS * NSEC_PER_MSEC;
+
+	if (ctrl & STTS22H_FREE_RUN)
+		return NSEC_PER_SEC / (25 << ((ctrl & STTS22H_AVG_MASK) >> STTS22H_AVG_SHIFT));
+
+	return 0;
+}
+
+static void STTS22H_sample(struct sim_dev *dev)
+{
+	int t, high, low;
+	s16 raw;
+
+	// 0.01 degree per LSB
+	t = READ_ONCE(temp) / 10 + sim_noise();
+	raw = clamp_t(int, t, S16_MIN, S16_MAX);
+
+	dev->regs[STTS22H_TEMP_L] = raw & 0xFF;
+	dev->regs[STTS22H_TEMP_H] = (raw >> 8) & 0xFF;
+
+	high = dev->regs[STTS22H_HIGH_LIMIT];
+	low = dev->regs[STTS22H_LOW_LIMIT];
+
+	if (high && t > (high - STTS22H_LIMIT_OFFSET) * STTS22H_LIMIT_STEP)
+		dev->regs[STTS22H_STATUS] |= STTS22H_OVER_HIGH;
+
+	if (low && t < (low - STTS22H_LIMIT_OFFSET) * STTS22H_LIMIT_STEP)
+		dev->regs[STTS22H_STATUS] |= STTS22H_UNDER_LOW;
+
+	dev->stats.samples++;
+}
+
+/* Conversions are completed lazily when the status or data is read */
+static void STTS22H_update(struct sim_dev *dev)
+{
+	u64 odr;
+	ktime_t now = ktime_get();
+
+	if (dev->pending && !ktime_before(now, dev->busy_until)) {
+		STTS22H_sample(dev);
+		dev->pending = false;
+	}
+
+	odr = STTS22H_odr_ns(dev);
+	if (odr && ktime_to_ns(ktime_sub(now, dev->last)) >= odr) {
+		STTS22H_sample(dev);
+		dev->last = now;
+	}
+}
+
+static void STTS22H_store(struct sim_dev *dev, u8 reg, u8 val)
+{
+	ktime_t now = ktime_get();
+	u8 running = STTS22H_FREE_RUN | STTS22H_LOW_ODR;
+
+	switch (reg) {
+	case STTS22H_HIGH_LIMIT:
+	case STTS22H_LOW_LIMIT:
+		dev->regs[reg] = val;
+		break;
+
+	case STTS22H_CTRL:
+		if (val & STTS22H_ONE_SHOT) {
+			dev->pending = true;
+			dev->busy_until = ktime_add_us(now, READ_ONCE(stts22h_conv_us));
+			sim_mark(dev);
+		}
+
+		// the first sample of a continuous mode is ready one period later
+		if (!(dev->regs[STTS22H_CTRL] & running) && (val & running))
+			dev->last = now;
+
+		// ONE_SHOT clears itself
+		dev->regs[STTS22H_CTRL] = val & ~STTS22H_ONE_SHOT;
+		dev->no_inc = !(val & STTS22H_IF_ADD_INC);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static u8 STTS22H_load(struct sim_dev *dev, u8 reg)
+{
+	u8 val;
+
+	switch (reg) {
+	case STTS22H_STATUS:
+		STTS22H_update(dev);
+
+		// limit flags are cleared on read
+		val = dev->regs[STTS22H_STATUS] | (dev->pending ? STTS22H_BUSY : 0);
+		dev->regs[STTS22H_STATUS] &= ~(STTS22H_OVER_HIGH | STTS22H_UNDER_LOW);
+
+		return val;
+
+	// block data update, the MSB belongs to the sample of the LSB
+	case STTS22H_TEMP_L:
+		STTS22H_update(dev);
+
+		if (!dev->pending)
+			sim_fetch(dev);
+
+		return dev->regs[reg];
+
+	default:
+		return dev->regs[reg];
+	}
+}
+
+static const struct sim_ops STTS22H_ops = {
+	.name = "STTS22H",
+	.reset = STTS22H_reset,
+	.write = sim_reg_write,
+	.read = sim_reg_read,
+	.store = STTS22H_store,
+	.load = STTS22H_load,
+};
+
+/* ---- ISL29125 ---- */
+
+/* Channels converted in each operating mode, bit 0 green, 1 red, 2 blue */
+static const u8 ISL29125_channels[8] = {0x00, 0x01, 0x02, 0x04, 0x00, 0x07, 0x03, 0x05};
+
+static void ISL29125_reset(struct sim_dev *dev)
+{
+	memset(dev->regs, 0, SIM_REGS);
+	dev->regs[ISL29125_ID_REG] = ISL29125_ID;
+	dev->persist = 0;
+	dev->asserted = false;
+}
+
+/* One cycle converts every selected channel in turn */
+static u64 ISL29125_period(struct sim_dev *dev)
+{
+	u8 conf1 = dev->regs[ISL29125_CONF1];
+	u64 conv_us;
+
+	conv_us = conf1 & ISL29125_RES_12BIT ? ISL29125_CONV_12BIT_US : ISL29125_CONV_16BIT_US;
+
+	return hweight8(ISL29125_channels[conf1 & ISL29125_MODE_MASK]) * conv_us * NSEC_PER_USEC;
+}
+
+static bool ISL29125_tick(struct sim_dev *dev)
+{
+	int i, sel, max;
+	u16 low, high, values[3];
+	u8 conf1 = dev->regs[ISL29125_CONF1];
+	u8 conf3 = dev->regs[ISL29125_CONF3];
+	u8 channels = ISL29125_channels[conf1 & ISL29125_MODE_MASK];
+
+	max = conf1 & ISL29125_RES_12BIT ? 0x0FFF : 0xFFFF;
+
+	values[0] = clamp_t(int, (int)READ_ONCE(green) + sim_noise(), 0, max);
+	values[1] = clamp_t(int, (int)READ_ONCE(red) + sim_noise(), 0, max);
+	values[2] = clamp_t(int, (int)READ_ONCE(blue) + sim_noise(), 0, max);
+
+	for (i = 0; i < 3; i++) {
+		if (!(channels & BIT(i)))
+			continue;
+
+		dev->regs[ISL29125_GREEN_L + 2 * i] = values[i] & 0xFF;
+		dev->regs[ISL29125_GREEN_L + 2 * i + 1] = values[i] >> 8;
+	}
+
+	dev->regs[ISL29125_STATUS] |= ISL29125_CONVENF;
+	dev->stats.samples++;
+
+	// threshold interrupt on the selected channel after the persistency count
+	sel = conf3 & ISL29125_INT_SEL_MASK;
+	if (!sel || !(channels & BIT(sel - 1)))
+		return false;
+
+	low = dev->regs[ISL29125_LTL] | (dev->regs[ISL29125_LTL + 1] << 8);
+	high = dev->regs[ISL29125_HTH - 1] | (dev->regs[ISL29125_HTH] << 8);
+
+	if (values[sel - 1] >= low && values[sel - 1] <= high) {
+		dev->persist = 0;
+		return false;
+	}
+
+	if (++dev->persist < 1 << ((conf3 & ISL29125_PERSIST_MASK) >> ISL29125_PERSIST_SHIFT))
+		return false;
+
+	dev->persist = 0;
+	dev->regs[ISL29125_STATUS] |= ISL29125_RGBTHF;
+
+	return sim_assert(dev, true);
+}
+
+static void ISL29125_store(struct sim_dev *dev, u8 reg, u8 val)
+{
+	switch (reg) {
+	case ISL29125_ID_REG:
+		if (val == ISL29125_RESET)
+			ISL29125_reset(dev);
+		break;
+
+	case ISL29125_CONF1 ... ISL29125_HTH:
+		dev->regs[reg] = val;
+		break;
+
+	// flags can be cleared by writing 0
+	case ISL29125_STATUS:
+		dev->regs[reg] &= val;
+		if (!(dev->regs[reg] & ISL29125_RGBTHF))
+			dev->asserted = false;
+		break;
+
+	default:
+		break;
+	}
+}
+
+static u8 ISL29125_load(struct sim_dev *dev, u8 reg)
+{
+	u8 val = dev->regs[reg];
+
+	// reading the status clears the interrupt
+	if (reg == ISL29125_STATUS) {
+		sim_fetch(dev);
+		dev->regs[reg] &= ~(ISL29125_RGBTHF | ISL29125_CONVENF);
+		dev->asserted = false;
+	}
+
+	return val;
+}
+
+static const struct sim_ops ISL29125_ops = {
+	.name = "ISL29125",
+	.reset = ISL29125_reset,
+	.write = sim_reg_write,
+	.read = sim_reg_read,
+	.store = ISL29125_store,
+	.load = ISL29125_load,
+	.period = ISL29125_period,
+	.tick = ISL29125_tick,
+};
+
+/* ---- BMA400 ---- */
+
+static void BMA400_reset(struct sim_dev *dev)
+{
+	memset(dev->regs, 0, SIM_REGS);
+	dev->regs[BMA400_CHIPID] = BMA400_ID;
+	// 4g range, 100 Hz
+	dev->regs[BMA400_ACC_CONFIG1] = 0x49;
+	dev->fifo = BMA400_fifo;
+	dev->fifo_head = 0;
+	dev->fifo_len = 0;
+	dev->asserted = false;
+	dev->next_event = ktime_add_ms(ktime_get(), READ_ONCE(event_ms));
+}
+
+/* Low-power mode samples at a fixed 25 Hz, normal mode at 12.5 Hz << (ODR - 5) */
+static u64 BMA400_period(struct sim_dev *dev)
+{
+	int odr;
+
+	switch (dev->regs[BMA400_ACC_CONFIG0] & BMA400_MODE_MASK) {
+	case BMA400_LOW_POWER:
+		return BMA400_LOW_POWER_US * NSEC_PER_USEC;
+
+	case BMA400_NORMAL:
+		odr = clamp_t(int, dev->regs[BMA400_ACC_CONFIG1] & BMA400_ODR_MASK,
+					BMA400_ODR_12P5, BMA400_ODR_800);
+
+		return (80 * NSEC_PER_MSEC) >> (odr - BMA400_ODR_12P5);
+
+	default:
+		return 0;
+	}
+}
+
+/* Header mode frames, one byte (8-bit mode) or two per enabled axis, dropped when full */
+static void BMA400_fifo_push(struct sim_dev *dev, const s16 *raw)
+{
+	int i, len = 0;
+	u8 frame[7];
+	u8 conf = dev->regs[BMA400_FIFO_CONFIG0];
+
+	if (!(conf & BMA400_FIFO_AXES))
+		return;
+
+	frame[len++] = BMA400_FIFO_HDR | ((conf & BMA400_FIFO_AXES) >> 4);
+
+	for (i = 0; i < 3; i++) {
+		if (!(conf & (0x20 << i)))
+			continue;
+
+		if (conf & BMA400_FIFO_8BIT) {
+			frame[len++] = (raw[i] >> 4) & 0xFF;
+		} else {
+			frame[len++] = raw[i] & 0xFF;
+			frame[len++] = (raw[i] >> 8) & 0x0F;
+		}
+	}
+
+	if (dev->fifo_len + len > BMA400_FIFO_SIZE)
+		return;
+
+	for (i = 0; i < len; i++)
+		dev->fifo[(dev->fifo_head + dev->fifo_len++) % BMA400_FIFO_SIZE] = frame[i];
+}
+
+static u8 BMA400_fifo_pop(struct sim_dev *dev)
+{
+	u8 val;
+
+	if (!dev->fifo_len)
+		return BMA400_FIFO_EMPTY;
+
+	val = dev->fifo[dev->fifo_head];
+	dev->fifo_head = (dev->fifo_head + 1) % BMA400_FIFO_SIZE;
+	dev->fifo_len--;
+
+	return val;
+}
+
+static bool BMA400_tick(struct sim_dev *dev)
+{
+	int i, lsb, wm;
+	s16 raw[3];
+	u8 stat0 = 0, stat1 = 0, mode;
+	ktime_t now = ktime_get();
+	int mg[3] = {READ_ONCE(accel_x), READ_ONCE(accel_y), READ_ONCE(accel_z)};
+
+	// 12-bit samples, 1024 LSB/g at 2g halving with every range step
+	lsb = 1024 >> (dev->regs[BMA400_ACC_CONFIG1] >> BMA400_RANGE_SHIFT);
+
+	for (i = 0; i < 3; i++) {
+		raw[i] = clamp_t(int, mg[i] * lsb / 1000 + sim_noise(), -2048, 2047);
+
+		dev->regs[BMA400_ACC_X_LSB + 2 * i] = raw[i] & 0xFF;
+		dev->regs[BMA400_ACC_X_LSB + 2 * i + 1] = (raw[i] >> 8) & 0x0F;
+	}
+
+	dev->regs[BMA400_STATUS] |= BMA400_DRDY;
+	dev->stats.samples++;
+
+	BMA400_fifo_push(dev, raw);
+
+	if (dev->regs[BMA400_INT_CONFIG0] & BMA400_DRDY)
+		stat0 |= BMA400_DRDY;
+
+	wm = dev->regs[BMA400_FIFO_CONFIG1] | ((dev->regs[BMA400_FIFO_CONFIG2] & 0x07) << 8);
+	if ((dev->regs[BMA400_INT_CONFIG0] & BMA400_FWM) && wm && dev->fifo_len >= wm)
+		stat0 |= BMA400_FWM;
+
+	if ((dev->regs[BMA400_INT_CONFIG0] & BMA400_FFULL) && dev->fifo_len > BMA400_FIFO_SIZE - 7)
+		stat0 |= BMA400_FFULL;
+
+	// synthetic motion: wakes the chip up in low-power mode, a tap in normal mode
+	if (!ktime_before(now, dev->next_event)) {
+		dev->next_event = ktime_add_ms(now, READ_ONCE(event_ms));
+		mode = dev->regs[BMA400_ACC_CONFIG0] & BMA400_MODE_MASK;
+
+		if (mode == BMA400_LOW_POWER && (dev->regs[BMA400_AUTO_WKUP1] & BMA400_WKUP_INT_EN)) {
+			stat0 |= BMA400_WKUP;
+			dev->regs[BMA400_ACC_CONFIG0] = (dev->regs[BMA400_ACC_CONFIG0] & ~BMA400_MODE_MASK) | BMA400_NORMAL;
+		} else if (mode == BMA400_NORMAL && (dev->regs[BMA400_INT_CONFIG1] & BMA400_S_TAP)) {
+			stat1 |= BMA400_S_TAP;
+		}
+	}
+
+	dev->regs[BMA400_INT_STAT0] |= stat0;
+	dev->regs[BMA400_INT_STAT1] |= stat1;
+
+	if (!(stat0 & dev->regs[BMA400_INT1_MAP])
+			&& !((stat1 & BMA400_S_TAP) && (dev->regs[BMA400_INT12_MAP] & BMA400_TAP_INT1)))
+		return false;
+
+	return sim_assert(dev, dev->regs[BMA400_INT_CONFIG1] & BMA400_LATCH);
+}
+
+static void BMA400_store(struct sim_dev *dev, u8 reg, u8 val)
+{
+	switch (reg) {
+	case BMA400_CMD:
+		if (val == BMA400_SOFT_RESET)
+			BMA400_reset(dev);
+		else if (val == BMA400_FIFO_FLUSH)
+			dev->fifo_len = 0;
+		break;
+
+	case BMA400_ACC_CONFIG0 ... BMA400_CMD - 1:
+		dev->regs[reg] = val;
+		break;
+
+	// chip id, data and status are read-only
+	default:
+		break;
+	}
+}
+
+static u8 BMA400_load(struct sim_dev *dev, u8 reg)
+{
+	u8 val;
+
+	switch (reg) {
+	case BMA400_STATUS:
+		val = (dev->regs[BMA400_STATUS] & BMA400_DRDY)
+			| ((dev->regs[BMA400_ACC_CONFIG0] & BMA400_MODE_MASK) << 1);
+		dev->regs[BMA400_STATUS] &= ~BMA400_DRDY;
+		return val;
+
+	// reading the interrupt status clears it and releases a latched line
+	case BMA400_INT_STAT0 ... BMA400_INT_STAT2:
+		val = dev->regs[reg];
+		dev->regs[reg] = 0;
+		dev->asserted = false;
+		return val;
+
+	case BMA400_FIFO_LENGTH0:
+		return dev->fifo_len & 0xFF;
+
+	case BMA400_FIFO_LENGTH1:
+		return (dev->fifo_len >> 8) & 0x07;
+
+	case BMA400_FIFO_DATA:
+		sim_fetch(dev);
+		return BMA400_fifo_pop(dev);
+
+	case BMA400_ACC_X_LSB:
+		sim_fetch(dev);
+		return dev->regs[reg];
+
+	default:
+		return dev->regs[reg];
+	}
+}
+
+static const struct sim_ops BMA400_ops = {
+	.name = "BMA400",
+	.reset = BMA400_reset,
+	.write = sim_reg_write,
+	.read = sim_reg_read,
+	.store = BMA400_store,
+	.load = BMA400_load,
+	.period = BMA400_period,
+	.tick = BMA400_tick,
+};
+
+/* ---- timer and interrupt lines ---- */
+
+/* Start the chip timer if its configuration calls for one, dev->lock held */
+static void sim_arm(struct sim_dev *dev)
+{
+	u64 period;
+
+	if (dev->timer_on || !dev->ops->period || READ_ONCE(sim_stopping))
+		return;
+
+	period = dev->ops->period(dev);
+	if (!period)
+		return;
+
+	dev->timer_on = true;
+	hrtimer_start(&dev->timer, ns_to_ktime(period), HRTIMER_MODE_REL_HARD);
+}
+
+/*
+ * sim_timer - Sample clock of a chip, stops itself once the chip is
+ * idle and raises the interrupt line from hard irq context
+ */
+static enum hrtimer_restart sim_timer(struct hrtimer *timer)
+{
+	u64 period;
+	bool edge;
+	struct sim_dev *dev = container_of(timer, struct sim_dev, timer);
+
+	spin_lock(&dev->lock);
+
+	period = READ_ONCE(sim_stopping) ? 0 : dev->ops->period(dev);
+	if (!period) {
+		dev->timer_on = false;
+		spin_unlock(&dev->lock);
+		return HRTIMER_NORESTART;
+	}
+
+	edge = dev->ops->tick(dev);
+
+	if (edge) {
+		dev->stats.irqs++;
+		sim_mark(dev);
+	}
+
+	spin_unlock(&dev->lock);
+
+	if (edge && dev->line != NO_LINE)
+		generic_handle_irq(sim_irq_base + dev->line);
+
+	hrtimer_forward_now(timer, ns_to_ktime(period));
+
+	return HRTIMER_RESTART;
+}
+
+static int sim_gpio_get_direction(struct gpio_chip *chip, unsigned int offset)
+{
+	return GPIO_LINE_DIRECTION_IN;
+}
+
+static int sim_gpio_direction_input(struct gpio_chip *chip, unsigned int offset)
+{
+	return 0;
+}
+
+static int sim_gpio_get(struct gpio_chip *chip, unsigned int offset)
+{
+	struct sim_dev *dev = sim_line_dev[offset];
+
+	return dev && READ_ONCE(dev->asserted) != sim_active_low[offset];
+}
+
+static int sim_gpio_to_irq(struct gpio_chip *chip, unsigned int offset)
+{
+	return sim_irq_base + offset;
+}
+
+static struct gpio_chip sim_gpio = {
+	.label = "i2c-sim",
+	.owner = THIS_MODULE,
+	.get_direction = sim_gpio_get_direction,
+	.direction_input = sim_gpio_direction_input,
+	.get = sim_gpio_get,
+	.to_irq = sim_gpio_to_irq,
+	.ngpio = NR_LINES,
+	.can_sleep = false,
+};
+
+/* ---- benchmark counters ---- */
+
+static int sim_stats_show(struct seq_file *s, void *unused)
+{
+	unsigned long flags;
+	struct sim_stats stats;
+	struct sim_dev *dev = s->private;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	stats = dev->stats;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	seq_printf(s, "xfers %llu\nmsgs %llu\nbytes %llu\n", stats.xfers, stats.msgs, stats.bytes);
+	seq_printf(s, "samples %llu\nirqs %llu\nfetches %llu\n", stats.samples, stats.irqs, stats.fetches);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(sim_stats);
+
+/*
+ * Number of latencies recorded since the last reset, then the latest
+ * ones in ns, oldest first, one per line. Readers drain the ring by
+ * comparing the count with the one they saw last
+ */
+static int sim_latency_show(struct seq_file *s, void *unused)
+{
+	int i, nr;
+	u64 first, count;
+	u32 *lat;
+	unsigned long flags;
+	struct sim_dev *dev = s->private;
+
+	lat = kmalloc_array(SIM_LAT_LEN, sizeof(u32), GFP_KERNEL);
+	if (!lat)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&dev->lock, flags);
+
+	count = dev->lat_count;
+	nr = min_t(u64, count, SIM_LAT_LEN);
+	first = count - nr;
+
+	for (i = 0; i < nr; i++)
+		lat[i] = dev->lat[(first + i) & (SIM_LAT_LEN - 1)];
+
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	seq_printf(s, "count %llu\n", count);
+
+	for (i = 0; i < nr; i++)
+		seq_printf(s, "%u\n", lat[i]);
+
+	kfree(lat);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(sim_latency);
+
+/* Any write clears the counters and latencies of every chip */
+static ssize_t sim_reset_write(struct file *filp, const char __user *buff, size_t size, loff_t *loff)
+{
+	int i;
+	unsigned long flags;
+	struct sim_dev *dev;
+
+	for (i = 0; i < nr_sim_devs; i++) {
+		dev = &sim_devs[i];
+
+		spin_lock_irqsave(&dev->lock, flags);
+		memset(&dev->stats, 0, sizeof(dev->stats));
+		dev->lat_count = 0;
+		dev->mark = 0;
+		spin_unlock_irqrestore(&dev->lock, flags);
+	}
+
+	return size;
+}
+
+static const struct file_operations sim_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = sim_reset_write,
+	.llseek = noop_llseek,
+};
+
+/* /sys/kernel/debug/i2c_sim/<chip>-<addr>/{stats,latency} and reset */
+static void sim_debugfs_init(void)
+{
+	int i;
+	struct dentry *dir;
+	struct sim_dev *dev;
+
+	sim_debugfs = debugfs_create_dir("i2c_sim", NULL);
+
+	debugfs_create_file("reset", 0200, sim_debugfs, NULL, &sim_reset_fops);
+
+	for (i = 0; i < nr_sim_devs; i++) {
+		dev = &sim_devs[i];
+
+		snprintf(dev->name, sizeof(dev->name), "%s-%02x", dev->ops->name, dev->addr);
+
+		dir = debugfs_create_dir(dev->name, sim_debugfs);
+		debugfs_create_file("stats", 0444, dir, dev, &sim_stats_fops);
+		debugfs_create_file("latency", 0444, dir, dev, &sim_latency_fops);
+	}
+}
+
+/* ---- adapter ---- */
+
+static struct sim_dev *sim_find(u16 addr)
+{
+	int i;
+
+	for (i = 0; i < nr_sim_devs; i++)
+		if (sim_devs[i].addr == addr)
+			return &sim_devs[i];
+
+	return NULL;
+}
+
+/* 9 clocks per byte (8 data bits and ack) plus a start per message */
+static void sim_bus_delay(int bytes, int msgs)
+{
+	unsigned int khz = READ_ONCE(bus_khz);
+	unsigned long us;
+
+	if (!khz)
+		return;
+
+	us = (bytes * 9 + msgs) * 1000UL / khz;
+
+	if (us < 10)
+		udelay(us);
+	else
+		usleep_range(us, us + us / 8);
+}
+
+static int sim_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+	int i, bytes = 0;
+	unsigned long flags;
+	struct sim_dev *dev;
+
+	for (i = 0; i < num; i++) {
+		if (msgs[i].flags & (I2C_M_TEN | I2C_M_RECV_LEN))
+			return -EOPNOTSUPP;
+
+		// no device acknowledges the address
+		dev = sim_find(msgs[i].addr);
+		if (!dev)
+			return -ENXIO;
+
+		spin_lock_irqsave(&dev->lock, flags);
+
+		// a transaction is accounted to the chip of its first message
+		if (!i)
+			dev->stats.xfers++;
+
+		dev->stats.msgs++;
+		dev->stats.bytes += msgs[i].len;
+
+		if (msgs[i].flags & I2C_M_RD)
+			dev->ops->read(dev, msgs[i].buf, msgs[i].len);
+		else
+			dev->ops->write(dev, msgs[i].buf, msgs[i].len);
+
+		sim_arm(dev);
+
+		spin_unlock_irqrestore(&dev->lock, flags);
+
+		bytes += msgs[i].len + 1;
+	}
+
+	sim_bus_delay(bytes, num);
+
+	return num;
+}
+
+static u32 sim_func(struct i2c_adapter *adap)
+{
+	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm sim_algo = {
+	.master_xfer = sim_xfer,
+	.functionality = sim_func,
+};
+
+static struct i2c_adapter sim_adapter = {
+	.owner = THIS_MODULE,
+	.class = I2C_CLASS_HWMON,
+	.algo = &sim_algo,
+	.name = "i2c-sim",
+};
+
+static void sim_add(const struct sim_ops *ops, u16 addr, int line)
+{
+	struct sim_dev *dev = &sim_devs[nr_sim_devs++];
+
+	dev->ops = ops;
+	dev->addr = addr;
+	dev->line = line;
+	dev->hold_reg = -1;
+
+	spin_lock_init(&dev->lock);
+	hrtimer_init(&dev->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+	dev->timer.function = sim_timer;
+
+	ops->reset(dev);
+
+	if (line != NO_LINE)
+		sim_line_dev[line] = dev;
+}
+
+static int __init sim_init(void)
+{
+	int i, result;
+
+	if (nr_stts22h < 0 || nr_stts22h > SIM_MAX_STTS22H) {
+		PDEBUG("nr_stts22h must be between 0 and %d. \n", SIM_MAX_STTS22H);
+		return -EINVAL;
+	}
+
+	sim_add(&DHT20_ops, DHT20_ADDR, NO_LINE);
+	sim_add(&ISL29125_ops, ISL29125_ADDR, LINE_ISL29125);
+	sim_add(&BMA400_ops, BMA400_ADDR, LINE_BMA400);
+	sim_devs[nr_sim_devs - 1].hold_reg = BMA400_FIFO_DATA;
+
+	for (i = 0; i < nr_stts22h; i++)
+		sim_add(&STTS22H_ops, STTS22H_addrs[i], NO_LINE);
+
+	// software interrupts behind the gpio lines, raised from the chip timers
+	sim_irq_base = irq_alloc_descs(-1, 0, NR_LINES, NUMA_NO_NODE);
+	if (sim_irq_base < 0) {
+		PDEBUG("Failed when allocating interrupts. \n");
+		return sim_irq_base;
+	}
+
+	for (i = 0; i < NR_LINES; i++) {
+		irq_set_chip_and_handler(sim_irq_base + i, &dummy_irq_chip, handle_simple_irq);
+		irq_clear_status_flags(sim_irq_base + i, IRQ_NOREQUEST | IRQ_NOPROBE);
+	}
+
+	sim_gpio.base = gpio_base;
+
+	result = gpiochip_add_data(&sim_gpio, NULL);
+	if (result) {
+		PDEBUG("Failed when adding gpio chip. \n");
+		goto gpio_fail;
+	}
+
+	gpio_base = sim_gpio.base;
+
+	sim_adapter.nr = adapter_nr;
+
+	if (adapter_nr >= 0)
+		result = i2c_add_numbered_adapter(&sim_adapter);
+	else
+		result = i2c_add_adapter(&sim_adapter);
+
+	if (result) {
+		PDEBUG("Failed when adding adapter. \n");
+		goto adapter_fail;
+	}
+
+	adapter_nr = sim_adapter.nr;
+
+	sim_debugfs_init();
+
+	PDEBUG("Adapter %d, ISL29125 interrupt on gpio %d, BMA400 on gpio %d. \n",
+		adapter_nr, gpio_base + LINE_ISL29125, gpio_base + LINE_BMA400);
+
+	return 0;
+
+adapter_fail:
+	gpiochip_remove(&sim_gpio);
+
+gpio_fail:
+	irq_free_descs(sim_irq_base, NR_LINES);
+
+	return result;
+}
+
+static void __exit sim_exit(void)
+{
+	int i;
+
+	debugfs_remove_recursive(sim_debugfs);
+
+	i2c_del_adapter(&sim_adapter);
+
+	WRITE_ONCE(sim_stopping, true);
+
+	for (i = 0; i < nr_sim_devs; i++)
+		hrtimer_cancel(&sim_devs[i].timer);
+
+	gpiochip_remove(&sim_gpio);
+
+	irq_free_descs(sim_irq_base, NR_LINES);
+
+	PDEBUG("Simulated adapter removed. \n");
+}
+
+module_init(sim_init);
+module_exit(sim_exit);
+
+MODULE_AUTHOR("Zixuan Qiao <zqiao104@uottawa.ca>");
+MODULE_DESCRIPTION("Virtual I2C adapter emulating DHT20, ISL29125, BMA400 and STTS22H");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,245 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* Virtual I2C adapter emulating the sensors supported in this repository
+
+   Copyright (c) 2024,2024 Zixuan Qiao <zqiao104@uottawa.ca> */
+
+#ifndef I2C_SIM_HEADER
+#define I2C_SIM_HEADER
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/i2c.h>
+#include <linux/gpio/driver.h>
+#include <linux/irq.h>
+#include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#define DEBUG
+#ifdef DEBUG
+#define PDEBUG(format, args...) printk(KERN_ERR "i2c_sim: " format, ## args)
+#else
+#define PDEBUG(format, args...)
+#endif
+
+#define SIM_REGS 128
+#define SIM_MAX_STTS22H 3
+
+/* latencies kept per chip for the benchmark, power of 2 */
+#define SIM_LAT_LEN 4096
+
+/* Interrupt lines, one gpio per chip with an interrupt pin */
+enum sim_line {
+	LINE_ISL29125,
+	LINE_BMA400,
+	NR_LINES,
+};
+
+#define NO_LINE (-1)
+
+/* DHT20, command based, 7 byte frame: status, 20-bit RH, 20-bit T, CRC */
+#define DHT20_ADDR 0x38
+#define DHT20_CMD_TRIGGER 0xAC
+#define DHT20_CMD_STATUS 0x71
+#define DHT20_CMD_RESET 0xBA
+#define DHT20_FRAME_LEN 7
+#define DHT20_STATUS_BUSY 0x80
+#define DHT20_STATUS_CAL 0x18
+#define DHT20_CRC_INIT 0xFF
+#define DHT20_CRC_POLY 0x31
+
+/* STTS22H, instances take the addresses not used by DHT20 */
+#define STTS22H_WHOAMI 0x01
+#define STTS22H_HIGH_LIMIT 0x02
+#define STTS22H_LOW_LIMIT 0x03
+#define STTS22H_CTRL 0x04
+#define STTS22H_STATUS 0x05
+#define STTS22H_TEMP_L 0x06
+#define STTS22H_TEMP_H 0x07
+
+#define STTS22H_ID 0xA0
+
+#define STTS22H_ONE_SHOT 0x01
+#define STTS22H_FREE_RUN 0x04
+#define STTS22H_IF_ADD_INC 0x08
+#define STTS22H_AVG_MASK 0x30
+#define STTS22H_AVG_SHIFT 4
+#define STTS22H_LOW_ODR 0x80
+
+#define STTS22H_BUSY 0x01
+#define STTS22H_OVER_HIGH 0x02
+#define STTS22H_UNDER_LOW 0x04
+
+/* limit register to centi-degree: (reg - 63) * 64 */
+#define STTS22H_LIMIT_OFFSET 63
+#define STTS22H_LIMIT_STEP 64
+
+#define STTS22H_LOW_ODR_MS 1000
+
+/* ISL29125 */
+#define ISL29125_ADDR 0x44
+
+#define ISL29125_ID_REG 0x00
+#define ISL29125_CONF1 0x01
+#define ISL29125_CONF2 0x02
+#define ISL29125_CONF3 0x03
+#define ISL29125_LTL 0x04
+#define ISL29125_HTH 0x07
+#define ISL29125_STATUS 0x08
+#define ISL29125_GREEN_L 0x09
+#define ISL29125_BLUE_H 0x0E
+
+#define ISL29125_ID 0x7D
+#define ISL29125_RESET 0x46
+
+#define ISL29125_MODE_MASK 0x07
+#define ISL29125_RES_12BIT 0x10
+#define ISL29125_INT_SEL_MASK 0x03
+#define ISL29125_PERSIST_MASK 0x0C
+#define ISL29125_PERSIST_SHIFT 2
+
+#define ISL29125_RGBTHF 0x01
+#define ISL29125_CONVENF 0x02
+#define ISL29125_BOUTF 0x04
+
+/* per channel conversion time in us */
+#define ISL29125_CONV_16BIT_US 100000
+#define ISL29125_CONV_12BIT_US 6250
+
+/* BMA400 */
+#define BMA400_ADDR 0x14
+
+#define BMA400_CHIPID 0x00
+#define BMA400_STATUS 0x03
+#define BMA400_ACC_X_LSB 0x04
+#define BMA400_INT_STAT0 0x0E
+#define BMA400_INT_STAT1 0x0F
+#define BMA400_INT_STAT2 0x10
+#define BMA400_FIFO_LENGTH0 0x12
+#define BMA400_FIFO_LENGTH1 0x13
+#define BMA400_FIFO_DATA 0x14
+#define BMA400_ACC_CONFIG0 0x19
+#define BMA400_ACC_CONFIG1 0x1A
+#define BMA400_INT_CONFIG0 0x1F
+#define BMA400_INT_CONFIG1 0x20
+#define BMA400_INT1_MAP 0x21
+#define BMA400_INT12_MAP 0x23
+#define BMA400_FIFO_CONFIG0 0x26
+#define BMA400_FIFO_CONFIG1 0x27
+#define BMA400_FIFO_CONFIG2 0x28
+#define BMA400_AUTO_WKUP1 0x2D
+#define BMA400_CMD 0x7E
+
+#define BMA400_ID 0x90
+#define BMA400_SOFT_RESET 0xB6
+#define BMA400_FIFO_FLUSH 0xB0
+
+#define BMA400_MODE_MASK 0x03
+#define BMA400_SLEEP 0x00
+#define BMA400_LOW_POWER 0x01
+#define BMA400_NORMAL 0x02
+
+#define BMA400_ODR_MASK 0x0F
+#define BMA400_ODR_12P5 0x05
+#define BMA400_ODR_800 0x0B
+#define BMA400_RANGE_SHIFT 6
+#define BMA400_LOW_POWER_US 40000
+
+/* INT_STAT0, INT_CONFIG0 and INT1_MAP share the bit layout */
+#define BMA400_WKUP 0x01
+#define BMA400_FFULL 0x20
+#define BMA400_FWM 0x40
+#define BMA400_DRDY 0x80
+/* INT_STAT1 and INT_CONFIG1 */
+#define BMA400_S_TAP 0x04
+#define BMA400_LATCH 0x80
+/* INT12_MAP */
+#define BMA400_TAP_INT1 0x04
+/* AUTO_WKUP1 */
+#define BMA400_WKUP_INT_EN 0x02
+/* FIFO_CONFIG0 */
+#define BMA400_FIFO_8BIT 0x10
+#define BMA400_FIFO_AXES 0xE0
+
+#define BMA400_FIFO_SIZE 1024
+#define BMA400_FIFO_HDR 0x80
+#define BMA400_FIFO_EMPTY 0x80
+
+/*
+ * Benchmark counters, a sample is announced by a trigger command or an
+ * interrupt edge and fetched when the driver reads its data register
+ */
+struct sim_stats {
+	u64 xfers;
+	u64 msgs;
+	u64 bytes;
+	u64 samples;
+	u64 irqs;
+	u64 fetches;
+};
+
+struct sim_dev;
+
+/*
+ * Chip model, register based chips provide load and store and use the
+ * generic pointer + auto-increment access, DHT20 overrides read/write.
+ * tick runs from the per-chip timer every period() ns, returns true to
+ * assert the interrupt line
+ */
+struct sim_ops {
+	const char *name;
+	void (*reset)(struct sim_dev *dev);
+	void (*write)(struct sim_dev *dev, const u8 *buf, int len);
+	void (*read)(struct sim_dev *dev, u8 *buf, int len);
+	void (*store)(struct sim_dev *dev, u8 reg, u8 val);
+	u8 (*load)(struct sim_dev *dev, u8 reg);
+	u64 (*period)(struct sim_dev *dev);
+	bool (*tick)(struct sim_dev *dev);
+};
+
+struct sim_dev {
+	const struct sim_ops *ops;
+	u16 addr;
+	int line;
+
+	/* taken from the transfer path and the timer */
+	spinlock_t lock;
+	u8 regs[SIM_REGS];
+	u8 ptr;
+	bool no_inc;
+	int hold_reg;		/* data port, the pointer stays on it */
+
+	/* conversion in progress until busy_until */
+	bool pending;
+	ktime_t busy_until;
+	ktime_t last;
+	ktime_t next_event;
+	int persist;
+
+	/* interrupt line state, asserted until the driver clears it */
+	bool asserted;
+
+	struct hrtimer timer;
+	bool timer_on;
+
+	/* BMA400 FIFO ring, oldest byte at fifo_head */
+	u8 *fifo;
+	int fifo_head;
+	int fifo_len;
+
+	/* announce to fetch latency in ns, exported through debugfs */
+	struct sim_stats stats;
+	ktime_t mark;
+	u32 lat[SIM_LAT_LEN];
+	u64 lat_count;
+	char name[16];
+};
+
+#endif
@@ -0,0 +1,366 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Sensor hub, one acquisition worker per I2C adapter
+
+   Hubs are created on the first request for an adapter and kept until
+   the module is unloaded, so clients that come and go (STTS22H binds a
+   device per open file) do not create a workqueue every time.
+
+   Copyright (c) 2024,2024 Zixuan Qiao <zqiao104@uottawa.ca> */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/i2c.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "sensor_hub.h"
+
+#define DEBUG
+#ifdef DEBUG
+#define PDEBUG(format, args...) printk(KERN_ERR "sensor_hub: " format, ## args)
+#else
+#define PDEBUG(format, args...)
+#endif
+
+/* Bucket i counts values in [2^(i-1), 2^i) ns, the last one the rest */
+#define HIST_BUCKETS 32
+
+struct sensor_hub {
+	struct list_head node;
+	int nr;
+	struct workqueue_struct *wq;
+	struct dentry *dir;
+	atomic_t clients;
+	struct task_struct *runner;	/* executing hub work, NULL if idle */
+
+	/* Scheduling statistics, cleared by writing to the stats file */
+	atomic64_t queued;
+	atomic64_t calls;	/* synchronous operations, part of queued */
+	atomic64_t merged;	/* requests for work already pending */
+	atomic64_t runs;
+	atomic_t pending;
+	atomic_t max_pending;
+	atomic64_t delay_ns;	/* due time to start of a run */
+	atomic64_t busy_ns;	/* time spent running work */
+	atomic64_t delay_hist[HIST_BUCKETS];
+	atomic64_t run_hist[HIST_BUCKETS];
+};
+
+static LIST_HEAD(hub_list);
+static DEFINE_MUTEX(hub_lock);
+
+static struct dentry *hub_debugfs;
+
+static void hub_hist(atomic64_t *hist, u64 ns)
+{
+	atomic64_inc(&hist[min_t(int, fls64(ns), HIST_BUCKETS - 1)]);
+}
+
+static void hub_print_hist(struct seq_file *s, const char *name,
+							atomic64_t *hist)
+{
+	int i;
+	u64 count;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		count = atomic64_read(&hist[i]);
+		if (count)
+			seq_printf(s, "%s %llu %llu\n", name,
+					i ? 1ULL << (i - 1) : 0, count);
+	}
+}
+
+static int hub_stats_show(struct seq_file *s, void *unused)
+{
+	struct sensor_hub *hub = s->private;
+
+	seq_printf(s, "clients %d\n", atomic_read(&hub->clients));
+	seq_printf(s, "queued %lld\n", atomic64_read(&hub->queued));
+	seq_printf(s, "calls %lld\n", atomic64_read(&hub->calls));
+	seq_printf(s, "merged %lld\n", atomic64_read(&hub->merged));
+	seq_printf(s, "runs %lld\n", atomic64_read(&hub->runs));
+	seq_printf(s, "pending %d\n", atomic_read(&hub->pending));
+	seq_printf(s, "max_pending %d\n", atomic_read(&hub->max_pending));
+	seq_printf(s, "delay_ns %lld\n", atomic64_read(&hub->delay_ns));
+	seq_printf(s, "busy_ns %lld\n", atomic64_read(&hub->busy_ns));
+
+	hub_print_hist(s, "delay_hist", hub->delay_hist);
+	hub_print_hist(s, "run_hist", hub->run_hist);
+
+	return 0;
+}
+
+static int hub_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hub_stats_show, inode->i_private);
+}
+
+/* Any write clears the statistics, clients and pending are state */
+static ssize_t hub_stats_write(struct file *file, const char __user *buf,
+						size_t count, loff_t *ppos)
+{
+	int i;
+	struct sensor_hub *hub = ((struct seq_file *)file->private_data)->private;
+
+	atomic64_set(&hub->queued, 0);
+	atomic64_set(&hub->calls, 0);
+	atomic64_set(&hub->merged, 0);
+	atomic64_set(&hub->runs, 0);
+	atomic_set(&hub->max_pending, atomic_read(&hub->pending));
+	atomic64_set(&hub->delay_ns, 0);
+	atomic64_set(&hub->busy_ns, 0);
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		atomic64_set(&hub->delay_hist[i], 0);
+		atomic64_set(&hub->run_hist[i], 0);
+	}
+
+	return count;
+}
+
+static const struct file_operations hub_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = hub_stats_open,
+	.read = seq_read,
+	.write = hub_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+struct sensor_hub *sensor_hub_get(struct i2c_adapter *adpt)
+{
+	int nr;
+	char name[16];
+	struct sensor_hub *hub;
+
+	nr = i2c_adapter_id(adpt);
+
+	mutex_lock(&hub_lock);
+
+	list_for_each_entry(hub, &hub_list, node)
+		if (hub->nr == nr)
+			goto found;
+
+	hub = kzalloc(sizeof(struct sensor_hub), GFP_KERNEL);
+	if (!hub) {
+		mutex_unlock(&hub_lock);
+		PDEBUG("Failed when allocating hub of adapter %d\n", nr);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	/* Ordered, work of one bus runs one at a time in queueing order */
+	hub->wq = alloc_ordered_workqueue("sensor_hub-%d", WQ_MEM_RECLAIM, nr);
+	if (!hub->wq) {
+		mutex_unlock(&hub_lock);
+		kfree(hub);
+		PDEBUG("Failed when creating worker of adapter %d\n", nr);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	hub->nr = nr;
+
+	snprintf(name, sizeof(name), "i2c-%d", nr);
+	hub->dir = debugfs_create_dir(name, hub_debugfs);
+	debugfs_create_file("stats", 0600, hub->dir, hub, &hub_stats_fops);
+
+	list_add(&hub->node, &hub_list);
+
+found:
+	atomic_inc(&hub->clients);
+
+	mutex_unlock(&hub_lock);
+
+	return hub;
+}
+EXPORT_SYMBOL_GPL(sensor_hub_get);
+
+void sensor_hub_put(struct sensor_hub *hub)
+{
+	atomic_dec(&hub->clients);
+}
+EXPORT_SYMBOL_GPL(sensor_hub_put);
+
+/*
+ * sensor_hub_run - Workqueue side of a hub work, accounts the delay from
+ * the due time and the run time around the client's function
+ */
+static void sensor_hub_run(struct work_struct *dw)
+{
+	u64 start, due, delay, run;
+	struct sensor_hub *hub;
+	struct sensor_hub_work *work;
+
+	work = container_of(to_delayed_work(dw), struct sensor_hub_work, dw);
+
+	/* The function may queue the work again, read it all first */
+	hub = work->hub;
+	due = READ_ONCE(work->due);
+
+	start = ktime_get_ns();
+	delay = start > due ? start - due : 0;
+
+	atomic_dec(&hub->pending);
+	atomic64_add(delay, &hub->delay_ns);
+	hub_hist(hub->delay_hist, delay);
+
+	WRITE_ONCE(hub->runner, current);
+
+	work->func(work);
+
+	WRITE_ONCE(hub->runner, NULL);
+
+	run = ktime_get_ns() - start;
+
+	atomic64_inc(&hub->runs);
+	atomic64_add(run, &hub->busy_ns);
+	hub_hist(hub->run_hist, run);
+}
+
+void sensor_hub_init_work(struct sensor_hub_work *work,
+			void (*func)(struct sensor_hub_work *work))
+{
+	INIT_DELAYED_WORK(&work->dw, sensor_hub_run);
+	work->func = func;
+	work->hub = NULL;
+	work->due = 0;
+}
+EXPORT_SYMBOL_GPL(sensor_hub_init_work);
+
+bool sensor_hub_queue(struct sensor_hub *hub, struct sensor_hub_work *work,
+							unsigned long delay)
+{
+	int pending, max;
+
+	/* Keep the due time of the pending request */
+	if (delayed_work_pending(&work->dw))
+		goto merged;
+
+	work->hub = hub;
+	WRITE_ONCE(work->due, ktime_get_ns() + jiffies_to_nsecs(delay));
+
+	pending = atomic_inc_return(&hub->pending);
+
+	if (!queue_delayed_work(hub->wq, &work->dw, delay)) {
+		atomic_dec(&hub->pending);
+		goto merged;
+	}
+
+	atomic64_inc(&hub->queued);
+
+	max = atomic_read(&hub->max_pending);
+	while (pending > max) {
+		if (atomic_cmpxchg(&hub->max_pending, max, pending) == max)
+			break;
+		max = atomic_read(&hub->max_pending);
+	}
+
+	return true;
+
+merged:
+	atomic64_inc(&hub->merged);
+
+	return false;
+}
+EXPORT_SYMBOL_GPL(sensor_hub_queue);
+
+/* A synchronous operation, lives on the stack of the caller */
+struct sensor_hub_call {
+	struct sensor_hub_work work;
+	int (*func)(void *arg);
+	void *arg;
+	int result;
+	struct completion done;
+};
+
+static void sensor_hub_call_run(struct sensor_hub_work *work)
+{
+	struct sensor_hub_call *call;
+
+	call = container_of(work, struct sensor_hub_call, work);
+
+	call->result = call->func(call->arg);
+
+	/* The caller returns from here on, the work is not touched again */
+	complete(&call->done);
+}
+
+int sensor_hub_call(struct sensor_hub *hub, int (*func)(void *arg), void *arg)
+{
+	struct sensor_hub_call call;
+
+	/* Already on the worker of the bus, waiting would deadlock */
+	if (READ_ONCE(hub->runner) == current)
+		return func(arg);
+
+	INIT_DELAYED_WORK_ONSTACK(&call.work.dw, sensor_hub_run);
+	call.work.func = sensor_hub_call_run;
+	call.func = func;
+	call.arg = arg;
+	init_completion(&call.done);
+
+	atomic64_inc(&hub->calls);
+
+	sensor_hub_queue(hub, &call.work, 0);
+
+	wait_for_completion(&call.done);
+
+	destroy_delayed_work_on_stack(&call.work.dw);
+
+	return call.result;
+}
+EXPORT_SYMBOL_GPL(sensor_hub_call);
+
+bool sensor_hub_cancel(struct sensor_hub_work *work)
+{
+	if (!cancel_delayed_work_sync(&work->dw))
+		return false;
+
+	atomic_dec(&work->hub->pending);
+
+	return true;
+}
+EXPORT_SYMBOL_GPL(sensor_hub_cancel);
+
+static int __init sensor_hub_init(void)
+{
+	/* Statistics are optional, the hub works without debugfs */
+	hub_debugfs = debugfs_create_dir("sensor_hub", NULL);
+
+	PDEBUG("Hub loaded\n");
+
+	return 0;
+}
+
+static void __exit sensor_hub_exit(void)
+{
+	struct sensor_hub *hub, *tmp;
+
+	/* Clients hold a reference on the module, every hub is idle */
+	list_for_each_entry_safe(hub, tmp, &hub_list, node) {
+		list_del(&hub->node);
+		destroy_workqueue(hub->wq);
+		kfree(hub);
+	}
+
+	debugfs_remove_recursive(hub_debugfs);
+
+	PDEBUG("Hub unloaded\n");
+}
+
+module_init(sensor_hub_init);
+module_exit(sensor_hub_exit);
+
+MODULE_AUTHOR("Zixuan Qiao <zqiao104@uottawa.ca>");
+MODULE_DESCRIPTION("Per-adapter acquisition workers for the sensor drivers");
+MODULE_LICENSE("GPL");